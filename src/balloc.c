@@ -0,0 +1,199 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+
+#include "ext0.h"
+
+/*
+ * Block allocation. Every group has a block bitmap(gdesc->bg_block_bitmap)
+ * with one bit per block of the group, bit 0 being the group's superblock.
+ * Bits for the group metadata are set by mkfs.ext0 so they are never handed
+ * out. bg_free_blocks_count follows every change to it. Both are protected
+ * by the group lock, allocations in different groups never contend.
+ * s_freeblocks_counter keeps the filesystem wide count, sync_fs folds it
+ * into s_free_blocks_count.
+ */
+
+static inline unsigned long ext0_group_of_block(struct super_block *sb, unsigned long block)
+{
+    return (block - EXT0_SB(sb)->s_first_data_block) / EXT0_SB(sb)->s_blocks_per_group;
+}
+
+/* The last group may be shorter than s_blocks_per_group */
+static inline unsigned long ext0_group_blocks(struct super_block *sb, unsigned long group)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    unsigned long first = ext0_group_first_block(group, in_mem_sb->s_blocks_per_group, in_mem_sb->s_first_data_block);
+
+    return min(in_mem_sb->s_blocks_per_group, in_mem_sb->s_blocks_count - first);
+}
+
+static struct buffer_head *ext0_read_block_bitmap(struct super_block *sb, struct ext0_block_descriptor *gdesc)
+{
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, le32_to_cpu(gdesc->bg_block_bitmap));
+    if (!bh)
+        ext0_debug("Could not perform I/O for block bitmap: %u", le32_to_cpu(gdesc->bg_block_bitmap));
+    return bh;
+}
+
+/* First data block of the group owning @inode */
+unsigned long ext0_inode_goal(struct inode *inode)
+{
+    struct ext0_block_descriptor *gdesc;
+
+    gdesc = ext0_get_group_desc(inode->i_sb, EXT0_I(inode)->i_block_group, NULL);
+    if (!gdesc)
+        return EXT0_SB(inode->i_sb)->s_first_data_block;
+    return le32_to_cpu(gdesc->bg_first_block);
+}
+
+/* Claim a run of up to *count free bits, preferring one that starts at
+ * @goal. Returns the first bit of the run or -1 if the bitmap is full.
+ * Caller holds the group lock.
+ */
+static long ext0_try_to_allocate(void *bitmap, unsigned long goal, unsigned long size, unsigned long *count)
+{
+    unsigned long here, end, i;
+
+    here = ext0_find_next_zero_bit(bitmap, size, goal);
+    if (here >= size)
+        here = ext0_find_first_zero_bit(bitmap, size);
+    if (here >= size)
+        return -1;
+
+    end = ext0_find_next_bit(bitmap, size, here);
+    if (end - here < *count)
+        *count = end - here;
+
+    for (i = here; i < here + *count; i++)
+        ext0_set_bit(i, bitmap);
+    return here;
+}
+
+/* Allocate up to *count contiguous blocks, as close to @goal as we can get.
+ * Returns the first block(with *count set to the run length) or 0 with
+ * *err set.
+ */
+unsigned long ext0_new_blocks(struct inode *inode, unsigned long goal, unsigned long *count, int *err)
+{
+    struct super_block *sb = inode->i_sb;
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    unsigned long group, grp_goal, i;
+    int retried = 0;
+
+    if (!*count)
+        *count = 1;
+
+    if (goal < in_mem_sb->s_first_data_block || goal >= in_mem_sb->s_blocks_count)
+        goal = ext0_inode_goal(inode);
+
+retry:
+    group = ext0_group_of_block(sb, goal);
+    grp_goal = goal - ext0_group_first_block(group, in_mem_sb->s_blocks_per_group, in_mem_sb->s_first_data_block);
+
+    for (i = 0; i < in_mem_sb->s_groups_count; i++)
+    {
+        struct ext0_block_descriptor *gdesc;
+        struct buffer_head *gdesc_bh, *bitmap_bh;
+        long bit;
+
+        /* Unlocked peek, rechecked against the bitmap under the group lock */
+        gdesc = ext0_get_group_desc(sb, group, &gdesc_bh);
+        if (!gdesc || !le16_to_cpu(READ_ONCE(gdesc->bg_free_blocks_count)))
+            goto next;
+
+        bitmap_bh = ext0_read_block_bitmap(sb, gdesc);
+        if (!bitmap_bh)
+        {
+            *err = -EIO;
+            return 0;
+        }
+
+        spin_lock(ext0_group_lock_ptr(in_mem_sb, group));
+        bit = ext0_try_to_allocate(bitmap_bh->b_data, grp_goal, ext0_group_blocks(sb, group), count);
+        if (bit >= 0)
+            le16_add_cpu(&gdesc->bg_free_blocks_count, -(int)*count);
+        spin_unlock(ext0_group_lock_ptr(in_mem_sb, group));
+
+        if (bit >= 0)
+        {
+            percpu_counter_sub(&in_mem_sb->s_freeblocks_counter, *count);
+            mark_buffer_dirty(bitmap_bh);
+            mark_buffer_dirty(gdesc_bh);
+            brelse(bitmap_bh);
+            *err = 0;
+            return ext0_group_first_block(group, in_mem_sb->s_blocks_per_group, in_mem_sb->s_first_data_block) + bit;
+        }
+        brelse(bitmap_bh);
+
+    next:
+        group = (group + 1) % in_mem_sb->s_groups_count;
+        grp_goal = 0;
+    }
+
+    /* Deleted files may still be waiting to give their blocks back */
+    if (!retried && ext0_reclaim_flush(sb))
+    {
+        retried = 1;
+        goto retry;
+    }
+
+    *err = -ENOSPC;
+    return 0;
+}
+
+void ext0_free_blocks(struct super_block *sb, unsigned long block, unsigned long count)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+
+    if (block < in_mem_sb->s_first_data_block || block + count > in_mem_sb->s_blocks_count)
+    {
+        ext0_debug("Freeing blocks outside data area: block=%lu count=%lu", block, count);
+        return;
+    }
+
+    while (count)
+    {
+        struct ext0_block_descriptor *gdesc;
+        struct buffer_head *gdesc_bh, *bitmap_bh;
+        unsigned long group = ext0_group_of_block(sb, block);
+        unsigned long bit, n, i, freed = 0;
+
+        gdesc = ext0_get_group_desc(sb, group, &gdesc_bh);
+        if (!gdesc)
+            return;
+
+        bit = block - ext0_group_first_block(group, in_mem_sb->s_blocks_per_group, in_mem_sb->s_first_data_block);
+        n = min_t(unsigned long, count, ext0_group_blocks(sb, group) - bit);
+
+        if (block < le32_to_cpu(gdesc->bg_first_block))
+        {
+            ext0_debug("Freeing group metadata block: %lu", block);
+            return;
+        }
+
+        bitmap_bh = ext0_read_block_bitmap(sb, gdesc);
+        if (!bitmap_bh)
+            return;
+
+        spin_lock(ext0_group_lock_ptr(in_mem_sb, group));
+        for (i = bit; i < bit + n; i++)
+        {
+            if (ext0_test_and_clear_bit(i, bitmap_bh->b_data))
+                freed++;
+            else
+                ext0_debug("Bit already cleared for block: %lu", block + i - bit);
+        }
+        le16_add_cpu(&gdesc->bg_free_blocks_count, freed);
+        spin_unlock(ext0_group_lock_ptr(in_mem_sb, group));
+
+        percpu_counter_add(&in_mem_sb->s_freeblocks_counter, freed);
+        mark_buffer_dirty(bitmap_bh);
+        mark_buffer_dirty(gdesc_bh);
+        brelse(bitmap_bh);
+
+        block += n;
+        count -= n;
+    }
+}
@@ -1,1528 +1,1039 @@
-#include <linux/pagemap.h>
-#include <linux/buffer_head.h>
-
-#include "ext0.h"
-
-static int link_dir(struct inode *inode, struct dentry *dentry, umode_t mode);
-
-static int ext0_create_inode(struct inode *dir, struct dentry *dentry, umode_t mode, struct inode **ret_inode)
-{
-	struct super_block *sb = dir->i_sb;
-	struct inode *inode;
-	struct ext0_super_block *on_disk_sb = EXT0_SB(sb)->s_es;
-	struct ext0_inode_info *in_mem_inode;
-	unsigned long ino;
-
-	inode = new_inode(sb);
-	if (!inode)
-		return -ENOMEM;
-
-	ino = EXT0_GET_INO(EXT0_ROOT_INO); /* Start past root inode */
-
-retry:
-	ino = ext0_find_next_zero_bit(&on_disk_sb->s_inode_bitmap, EXT0_INODE_BITMAP_SIZE, ino);
-
-	if (ino >= le32_to_cpu(on_disk_sb->s_groups_count))
-		return -ENOSPC;
-
-	/* Protect root dir */
-	if (ino == EXT0_GET_INO(EXT0_ROOT_INO))
-	{
-		ino++;
-		goto retry;
-	}
-
-	ext0_test_and_set_bit(ino, (void *)on_disk_sb->s_inode_bitmap);
-
-	inode->i_mode = mode;
-	inode->i_ino = EXT0_MAKE_INO(ino);
-	inode->i_sb = sb;
-	inode->i_blocks = EXT0_FS_MAX_DIRECT_BLOCKS;
-	inode->i_flags = 0;
-	inode->i_state = EXT0_STATE_NEW | I_LINKABLE | I_NEW; /* The fs crashes without the I_NEW flag. Need to investigate */
-	inode->i_size = 0; // sizeof(struct ext0_inode);
-
-	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
-
-	if (S_ISREG(inode->i_mode))
-	{
-		inode->i_op = &ext0_file_inode_operations;
-		inode->i_fop = &ext0_file_operations;
-	}
-	else if (S_ISDIR(inode->i_mode))
-	{
-		inode->i_op = &ext0_dir_inode_operations;
-		inode->i_fop = &ext0_dir_operations;
-	}
-
-	if (inode->i_mapping)
-		inode->i_mapping->a_ops = &ext0_aops;
-
-	in_mem_inode = EXT0_I(inode);
-	in_mem_inode->i_flags = inode->i_flags;
-
-	memset(in_mem_inode->i_data, 0, EXT0_FS_MAX_DIRECT_BLOCKS * sizeof(__u32));
-	in_mem_inode->i_state = inode->i_state;
-	in_mem_inode->i_block_group = EXT0_GET_INO(inode->i_ino);
-
-	mark_inode_dirty(inode);
-	*ret_inode = inode;
-	return 0;
-}
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
-static inline void ext0_put_folio(struct folio *folio, void *addr)
-{
-	folio_release_kmap(folio, addr);
-}
-
-static void *ext0_get_folio(struct inode *dir, unsigned long n, struct folio **foliop)
-{
-	struct address_space *mapping = dir->i_mapping;
-	struct folio *folio = read_mapping_folio(mapping, n, NULL);
-	void *kaddr;
-	if (!IS_ERR(folio))
-	{
-		kaddr = kmap_local_folio(folio, 0);
-		*foliop = folio;
-		return kaddr;
-	}
-	folio_release_kmap(folio, kaddr);
-	return ERR_PTR(-EIO);
-}
-
-static int ext0_new_inode(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
-{
-	struct inode *inode = NULL;
-	int ret;
-
-	unlock_new_inode(inode);
-	inode_inc_link_count(dir);
-	d_instantiate(dentry, inode);
-
-	ret = link_dir(dir, dentry, mode);
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to link inode: %i", ret);
-		return ret;
-	}
-	return 0;
-}
-
-static int ext0_tmpfile(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode)
-{
-	struct inode *inode = NULL;
-	int ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		return ret;
-	}
-	unlock_new_inode(inode);
-	d_tmpfile(dentry, inode);
-	return 0;
-}
-
-static int ext0_mknod(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, dev_t rdev)
-{
-	struct inode *inode = NULL;
-	int ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (!EXT0_IS_ERR(ret))
-	{
-		init_special_inode(inode, inode->i_mode, rdev);
-		mark_inode_dirty(inode);
-		unlock_new_inode(inode);
-		d_instantiate(dentry, inode);
-
-		ret = link_dir(dir, dentry, mode);
-		if (EXT0_IS_ERR(ret))
-		{
-			ext0_debug("Unable to link inode: %i", ret);
-			return ret;
-		}
-	}
-	return ret;
-}
-
-static int ext0_symlink(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, const char *symname)
-{
-	struct inode *inode = NULL;
-	int ret = ext0_create_inode(dir, dentry, S_IFLNK | 0777, &inode);
-	int i = strlen(symname) + 1;
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		return ret;
-	}
-
-	ret = page_symlink(inode, symname, i);
-	if (ret)
-	{
-		inode_dec_link_count(inode);
-		iput(inode);
-		return ret;
-	}
-
-	inode_inc_link_count(inode);
-	mark_inode_dirty(inode);
-	d_instantiate(dentry, inode);
-	return 0;
-}
-
-static int link_dir(struct inode *inode, struct dentry *dentry, umode_t mode)
-{
-	unsigned long npages = dir_pages(dir);
-	struct inode *inode = d_inode(dentry);
-	unsigned long npages = dir_pages(inode);
-	struct ext0_dir_entry *de;
-	unsigned long i;
-	int d_type;
-
-	for (i = 0; i < npages; i++)
-	{
-		unsigned long page_off = 0, page_end;
-		struct folio *folio;
-		char *kaddr = ext0_get_folio(inode, i, &folio);
-
-		// page = ext0_get_page(inode, i);
-		if (!folio)
-		{
-			ext0_debug("Invalid page while reading directory contents: page id=%zu", i);
-			continue;
-		}
-		// kaddr = (char *)page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-
-			/* Ensure we have enough free space */
-			if (!de->inode && ((dentry->d_name.len + EXT0_DIR_SIZE) <= (page_end - page_off)))
-			{
-				de = (struct ext0_dir_entry *)(kaddr + page_off);
-				de->name_len = dentry->d_name.len;
-				de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-				memcpy(de->name, dentry->d_name.name, dentry->d_name.len);
-				de->inode = cpu_to_le32(inode->i_ino);
-
-				if(S_ISREG(mode))
-					d_type = S_IFREG;
-				else if(S_ISDIR(mode))
-					d_type = S_IFDIR;
-
-				de->file_type = d_type;
-
-				dir->i_size += de->rec_len;
-				mark_inode_dirty(dir);
-				return 0;
-			}
-
-			page_off += de->rec_len;
-		}
-
-		ext0_put_page(folio, kaddr);
-	}
-	return -ENOSPC; /* We need to map new pages in */
-}
-
-static int ext0_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode)
-{
-	struct inode *inode = NULL;
-	struct buffer_head *bitmap_bh, *gdesc_bh;
-	struct ext0_block_descriptor *gdesc;
-	struct super_block *sb = dir->i_sb;
-	struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
-	int ret;
-	off_t offset;
-	char *bitmap_data;
-	// struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned chunk_size = sb->s_blocksize;
-	void *kaddr;
-	struct folio *folio = filemap_grab_folio(inode->i_mapping, 0);
-	unsigned long blk_no = 0;
-
-	inode_inc_link_count(dir);
-
-	mode |= S_IFDIR;
-
-	ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (EXT0_IS_ERR(ret) || !inode)
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		inode_dec_link_count(dir);
-		return ret;
-	}
-
-	inode_inc_link_count(inode);
-
-	/* Create default directory contents */
-	// page = grab_cache_page(inode->i_mapping, 0);
-	if (IS_ERR(folio))
-	{
-		ext0_debug("Could not get any pages: %i", (int)0);
-		ret = -ENOMEM;
-		goto err;
-	}
-
-	ret = __block_write_begin(&folio->page, 0, chunk_size, ext0_get_block);
-	if (ret)
-	{
-		ext0_debug("Failed preparing page for write: %i", ret);
-		folio_unlock(folio);
-		goto page_err;
-	}
-
-	kaddr = kmap_local_folio(folio, 0);
-	memset(kaddr, 0, chunk_size);
-
-	de = (struct ext0_dir_entry *)kaddr;
-	de->name_len = 1;
-	de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-	memcpy(de->name, ".", 2);
-	de->inode = cpu_to_le32(inode->i_ino);
-	de->file_type = DT_DIR;
-
-	inode->i_size += de->rec_len;
-
-	de = (struct ext0_dir_entry *)(kaddr + de->rec_len);
-	de->name_len = 2;
-	de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-	memcpy(de->name, "..", 3);
-	de->inode = cpu_to_le32(dir->i_ino);
-	de->file_type = DT_DIR;
-
-	inode->i_size += de->rec_len;
-	mark_inode_dirty(inode);
-
-	kunmap_local(kaddr);
-	block_write_end(NULL, inode->i_mapping, 0, chunk_size, chunk_size, &folio->page, NULL);
-	/* Default directory contents creation done */
-
-	offset = 0;
-	blk_no = ext0_inode_block(dir->i_ino) - 1;
-	if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-		fs_to_dev_block_num(sb, blk_no, &offset);
-
-	gdesc_bh = in_mem_sb->s_group_desc[EXT0_GET_INO(dir->i_ino)];
-	gdesc = (struct ext0_block_descriptor *)(gdesc_bh->b_data + offset);
-
-	offset = 0;
-	blk_no = 0;
-	if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-		blk_no = fs_to_dev_block_num(sb, gdesc->bg_block_bitmap, &offset);
-
-	bitmap_bh = sb_bread(sb, blk_no);
-	if (!bitmap_bh)
-	{
-		ext0_debug("Could not perform I/O for block bitmap: %zu, orig: %i", blk_no, gdesc->bg_block_bitmap);
-		ret = -EIO;
-		goto page_err;
-	}
-	bitmap_data = bitmap_bh->b_data + offset;
-
-	folio_unlock(folio);
-
-	mark_buffer_dirty(bitmap_bh);
-
-	unlock_new_inode(inode);
-	d_instantiate(dentry, inode);
-
-	ret = link_dir(dir, dentry, mode);
-	if (EXT0_IS_ERR(ret))
-	{
-		goto k_err;
-	}
-
-	folio_put(folio);
-
-	return 0;
-
-k_err:
-	kunmap_local(kaddr);
-
-page_err:
-	folio_unlock(folio);
-
-err:
-	inode_dec_link_count(inode);
-	inode_dec_link_count(dir);
-	iput(inode);
-	return ret;
-}
-
-static int ext0_rename(struct mnt_idmap *idmap, struct inode *old_dir, struct dentry *old_dentry,
-					   struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
-{
-	return 0;
-}
-
-static int ext0_unlink(struct inode *dir, struct dentry *dentry)
-{
-	struct page *page = NULL;
-	struct inode *inode = dir;
-	unsigned long npages = dir_pages(dir);
-	struct ext0_dir_entry *de;
-	int ret;
-	unsigned long i;
-
-	for (i = 0; i < npages; i++)
-	{
-		struct folio *folio;
-		char *kaddr = ext0_get_folio(inode, i, &folio);
-		unsigned long page_off = 0, page_end;
-
-		// page = ext0_get_page(inode, i);
-		if (!folio)
-		{
-			ext0_debug("Invalid page for directory entry unlinking: page id=%zu", i);
-			continue;
-		}
-		// kaddr = page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			unsigned long chunk_size;
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-			if (!de->rec_len)
-			{
-				page_off += EXT0_ALIGNMENT;
-				continue;
-			}
-
-			if (!de->inode)
-			{
-				page_off += de->rec_len;
-				continue;
-			}
-
-			if (memcmp(de->name, dentry->d_name.name, dentry->d_name.len) == 0)
-			{
-				chunk_size = page_end - page_off;
-				folio_lock(folio);
-				ret = __block_write_begin(&folio->page, page_off, chunk_size, ext0_get_block);
-				if (ret)
-				{
-					ext0_debug("Failed preparing page for deletion: %i", ret);
-					folio_unlock(folio);
-					ext0_put_page(folio, kaddr);
-					return ret;
-				}
-				de->inode = 0;
-				dir->i_size -= de->rec_len;
-				memset(de, 0, de->rec_len);
-				block_write_end(NULL, inode->i_mapping, page_off, chunk_size, chunk_size, &folio->page, NULL);
-
-				folio_unlock(folio);
-				inode->i_ctime = inode->i_mtime = current_time(inode);
-				goto found;
-			}
-			page_off += de->rec_len;
-		}
-
-		ext0_put_page(folio, kaddr);
-	}
-
-found:
-	inode_dec_link_count(inode);
-	mark_inode_dirty(inode);
-	return 0;
-}
-
-static int ext0_readdir(struct file *file, struct dir_context *ctx)
-{
-	struct inode *inode = file->f_inode;
-	unsigned long npages = dir_pages(inode);
-	// struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned long i;
-
-	for (i = ctx->pos; i < npages; i++)
-	{
-		unsigned long page_off = 0, page_end;
-		struct folio *folio;
-		char *kaddr = ext0_get_folio(inode, i, &folio);
-
-		// page = ext0_get_page(inode, i);
-		if (!folio)
-		{
-			ext0_debug("Invalid page while reading directory contents: page id=%zu", i);
-			ctx->pos += PAGE_SIZE;
-			continue;
-		}
-		// kaddr = (char *)page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-			if (!de->rec_len)
-			{
-				page_off += EXT0_ALIGNMENT; /* Too small jumps. Needs better approach */
-				continue;
-			}
-
-			/* Deleted entry or unoccupied? */
-			if (!de->inode)
-			{
-				page_off += de->rec_len;
-				continue;
-			}
-
-			if (!dir_emit(ctx, de->name, de->name_len, le32_to_cpu(de->inode), le32_to_cpu(de->file_type)))
-			{
-				ext0_put_page(folio, de);
-				return 0;
-			}
-
-			page_off += de->rec_len;
-			ctx->pos += de->rec_len;
-		}
-		ext0_put_page(folio, kaddr);
-	}
-
-	return 0;
-}
-
-static int ext0_inode_by_name(struct dentry *dentry)
-{
-	struct inode *inode = d_inode(dentry->d_parent);
-	unsigned long npages = dir_pages(inode);
-	// struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned long i;
-
-	for (i = 0; i < npages; i++)
-	{
-		unsigned long page_off = 0, page_end;
-		struct folio *folio;
-		char *kaddr = ext0_get_folio(inode, i, &folio);
-
-		// page = ext0_get_page(inode, i);
-		if (!folio)
-		{
-			ext0_debug("Invalid page in directory lookup id=%zu", i);
-			continue;
-		}
-		// kaddr = page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-			if (!de->rec_len)
-			{
-				page_off += EXT0_ALIGNMENT;
-				continue;
-			}
-
-			if (!de->inode)
-			{
-				page_off += de->rec_len;
-				continue;
-			}
-
-			if (memcmp(de->name, dentry->d_name.name, dentry->d_name.len) == 0)
-			{
-				return le32_to_cpu(de->inode);
-			}
-			page_off += de->rec_len;
-		}
-		ext0_put_page(folio, kaddr);
-	}
-	return 0;
-}
-
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
-static inline void ext0_put_page(struct page *page, void *addr)
-{
-	kunmap_local(addr);
-	put_page(page);
-}
-
-static struct page *ext0_get_page(struct inode *dir, unsigned long n, void **kaddr)
-{
-	struct address_space *mapping = dir->i_mapping;
-	struct folio *folio = read_mapping_folio(mapping, n, NULL);
-	if (IS_ERR(folio))
-		return &folio->page;
-	*kaddr = kmap_local_folio(folio, n & (folio_nr_pages(folio) - 1));
-	return &folio->page;
-}
-
-static int ext0_new_inode(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
-{
-	struct inode *inode = NULL;
-	int ret;
-
-	ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		return ret;
-	}
-	unlock_new_inode(inode);
-	inode_inc_link_count(dir);
-	d_instantiate(dentry, inode);
-
-	ret = link_dir(dir, dentry, mode);
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to link inode: %i", ret);
-		return ret;
-	}
-	return 0;
-}
-
-static int ext0_tmpfile(struct user_namespace *mnt_userns, struct inode *dir, struct file *file, umode_t mode)
-{
-	struct inode *inode = NULL;
-	int ret = ext0_create_inode(dir, NULL, mode, &inode);
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		return ret;
-	}
-	d_tmpfile(file, inode);
-	unlock_new_inode(inode);
-	return finish_open_simple(file, 0);
-}
-
-static int ext0_mknod(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, dev_t rdev)
-{
-	struct inode *inode = NULL;
-	int ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (!EXT0_IS_ERR(ret))
-	{
-		init_special_inode(inode, inode->i_mode, rdev);
-		mark_inode_dirty(inode);
-		unlock_new_inode(inode);
-		d_instantiate(dentry, inode);
-
-		ret = link_dir(dir, dentry, mode);
-		if (EXT0_IS_ERR(ret))
-		{
-			ext0_debug("Unable to link inode: %i", ret);
-			return ret;
-		}
-	}
-	return ret;
-}
-
-static int ext0_symlink(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, const char *symname)
-{
-	struct inode *inode = NULL;
-	int ret = ext0_create_inode(dir, dentry, S_IFLNK | 0777, &inode);
-	int i = strlen(symname) + 1;
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		return ret;
-	}
-
-	ret = page_symlink(inode, symname, i);
-	if (ret)
-	{
-		inode_dec_link_count(inode);
-		iput(inode);
-		return ret;
-	}
-
-	inode_inc_link_count(inode);
-	mark_inode_dirty(inode);
-	d_instantiate(dentry, inode);
-	return 0;
-}
-
-static int link_dir(struct inode *dir, struct dentry *dentry, umode_t mode)
-{
-	unsigned long npages = dir_pages(dir);
-	struct inode *inode = d_inode(dentry);
-	struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned long i;
-	int d_type;
-
-	for (i = 0; i < npages; i++)
-	{
-		unsigned long page_off = 0, page_end;
-		void *kaddr;
-
-		page = ext0_get_page(dir, i, &kaddr);
-		if (!page)
-		{
-			ext0_debug("Invalid page while reading directory contents: page id=%zu", i);
-			continue;
-		}
-		// kaddr = (char *)page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-
-			/* Ensure we have enough free space */
-			if (!de->inode && ((dentry->d_name.len + EXT0_DIR_SIZE) <= (page_end - page_off)))
-			{
-				de = (struct ext0_dir_entry *)(kaddr + page_off);
-				de->name_len = dentry->d_name.len;
-				de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-				memcpy(de->name, dentry->d_name.name, dentry->d_name.len);
-				de->inode = cpu_to_le32(inode->i_ino);
-
-				if(S_ISREG(mode))
-					d_type = S_IFREG;
-				else if(S_ISDIR(mode))
-					d_type = S_IFDIR;
-
-				de->file_type = d_type;
-
-				inode->i_size += de->rec_len;
-				mark_inode_dirty(dir);
-				return 0;
-			}
-
-			page_off += de->rec_len;
-		}
-
-		ext0_put_page(page, kaddr);
-	}
-	return -ENOSPC; /* We need to map new pages in */
-}
-
-static int ext0_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
-{
-	struct inode *inode = NULL;
-	struct buffer_head *bitmap_bh, *gdesc_bh;
-	struct ext0_block_descriptor *gdesc;
-	struct super_block *sb = dir->i_sb;
-	struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
-	int ret;
-	off_t offset;
-	char *bitmap_data;
-	struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned chunk_size = sb->s_blocksize;
-	void *kaddr;
-	unsigned long blk_no = 0;
-
-	inode_inc_link_count(dir);
-
-	mode |= S_IFDIR;
-
-	ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (EXT0_IS_ERR(ret) || !inode)
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		inode_dec_link_count(dir);
-		return ret;
-	}
-
-	inode_inc_link_count(inode);
-
-	/* Create default directory contents */
-	page = grab_cache_page(inode->i_mapping, 0);
-	if (!page)
-	{
-		ext0_debug("Could not get any pages: %i", (int)0);
-		ret = -ENOMEM;
-		goto err;
-	}
-
-	ret = __block_write_begin(page, 0, chunk_size, ext0_get_block);
-	if (ret)
-	{
-		ext0_debug("Failed preparing page for write: %i", ret);
-		goto page_err;
-	}
-
-	kaddr = kmap_atomic(page);
-	memset(kaddr, 0, chunk_size);
-
-	de = (struct ext0_dir_entry *)kaddr;
-	de->name_len = 1;
-	de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-	memcpy(de->name, ".", 2);
-	de->inode = cpu_to_le32(inode->i_ino);
-	de->file_type = DT_DIR;
-
-	inode->i_size += de->rec_len;
-
-	de = (struct ext0_dir_entry *)(kaddr + de->rec_len);
-	de->name_len = 2;
-	de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-	memcpy(de->name, "..", 3);
-	de->inode = cpu_to_le32(dir->i_ino);
-	de->file_type = DT_DIR;
-
-	inode->i_size += de->rec_len;
-	mark_inode_dirty(inode);
-
-	kunmap_atomic(kaddr);
-	block_write_end(NULL, inode->i_mapping, 0, chunk_size, chunk_size, page, NULL);
-	/* Default directory contents creation done */
-
-	offset = 0;
-	blk_no = ext0_inode_block(dir->i_ino) - 1;
-	if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-		fs_to_dev_block_num(sb, blk_no, &offset);
-
-	gdesc_bh = in_mem_sb->s_group_desc[EXT0_GET_INO(dir->i_ino)];
-	gdesc = (struct ext0_block_descriptor *)(gdesc_bh->b_data + offset);
-
-	offset = 0;
-	blk_no = 0;
-	if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-		blk_no = fs_to_dev_block_num(sb, gdesc->bg_block_bitmap, &offset);
-
-	bitmap_bh = sb_bread(sb, blk_no);
-	if (!bitmap_bh)
-	{
-		ext0_debug("Could not perform I/O for block bitmap: %zu, orig: %i", blk_no, gdesc->bg_block_bitmap);
-		ret = -EIO;
-		goto page_err;
-	}
-	bitmap_data = bitmap_bh->b_data + offset;
-
-	unlock_page(page);
-
-	mark_buffer_dirty(bitmap_bh);
-
-	unlock_new_inode(inode);
-	d_instantiate(dentry, inode);
-
-	ret = link_dir(dir, dentry, mode);
-	if (EXT0_IS_ERR(ret))
-	{
-		goto k_err;
-	}
-
-	put_page(page);
-
-	return 0;
-
-k_err:
-	kunmap_atomic(kaddr);
-
-page_err:
-	unlock_page(page);
-
-err:
-	inode_dec_link_count(inode);
-	inode_dec_link_count(dir);
-	iput(inode);
-	return ret;
-}
-
-static int ext0_rename(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry,
-					   struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
-{
-	return 0;
-}
-
-static int ext0_unlink(struct inode *dir, struct dentry *dentry)
-{
-	struct page *page = NULL;
-	struct inode *inode = dir;
-	unsigned long npages = dir_pages(dir);
-	struct ext0_dir_entry *de;
-	int ret;
-	unsigned long i;
-	void *page_addr;
-
-	for (i = 0; i < npages; i++)
-	{
-		void *kaddr;
-		unsigned long page_off = 0, page_end;
-
-		page = ext0_get_page(inode, i, &page_addr);
-		if (!page)
-		{
-			ext0_debug("Invalid page for directory entry unlinking: page id=%zu", i);
-			continue;
-		}
-		kaddr = page_addr;
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			unsigned long chunk_size;
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-			if (!de->rec_len)
-			{
-				page_off += EXT0_ALIGNMENT;
-				continue;
-			}
-
-			if (!de->inode)
-			{
-				page_off += de->rec_len;
-				continue;
-			}
-
-			if (memcmp(de->name, dentry->d_name.name, dentry->d_name.len) == 0)
-			{
-				chunk_size = page_end - page_off;
-				lock_page(page);
-				ret = __block_write_begin(page, page_off, chunk_size, ext0_get_block);
-				if (ret)
-				{
-					ext0_debug("Failed preparing page for deletion: %i", ret);
-					unlock_page(page);
-					goto out;
-				}
-				de->inode = 0;
-				dir->i_size -= de->rec_len;
-				memset(de, 0, de->rec_len);
-				block_write_end(NULL, inode->i_mapping, page_off, chunk_size, chunk_size, page, NULL);
-
-				unlock_page(page);
-				inode->i_ctime = inode->i_mtime = current_time(inode);
-			}
-			page_off += de->rec_len;
-		}
-
-		ext0_put_page(page, kaddr);
-	}
-
-	inode_dec_link_count(inode);
-	mark_inode_dirty(inode);
-	return 0;
-out:
-	ext0_put_page(page, page_addr);
-	return ret;
-}
-
-static int ext0_readdir(struct file *file, struct dir_context *ctx)
-{
-	struct inode *inode = file->f_inode;
-	unsigned long npages = dir_pages(inode);
-	struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned long i;
-
-	for (i = ctx->pos; i < npages; i++)
-	{
-		unsigned long page_off = 0, page_end;
-		void *kaddr;
-
-		page = ext0_get_page(inode, i, &kaddr);
-		if (!page)
-		{
-			ext0_debug("Invalid page while reading directory contents: page id=%zu", i);
-			ctx->pos += PAGE_SIZE;
-			continue;
-		}
-		// kaddr = (char *)page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-			if (!de->rec_len)
-			{
-				page_off += EXT0_ALIGNMENT; /* Too small jumps. Needs better approach */
-				continue;
-			}
-
-			/* Deleted entry or unoccupied? */
-			if (!de->inode)
-			{
-				page_off += de->rec_len;
-				continue;
-			}
-
-			if (!dir_emit(ctx, de->name, de->name_len, le32_to_cpu(de->inode), le32_to_cpu(de->file_type)))
-			{
-				ext0_put_page(page, kaddr);
-				return 0;
-			}
-
-			page_off += de->rec_len;
-			ctx->pos += de->rec_len;
-		}
-		ext0_put_page(page, kaddr);
-	}
-
-	return 0;
-}
-
-static int ext0_inode_by_name(struct dentry *dentry)
-{
-	struct inode *inode = d_inode(dentry->d_parent);
-	unsigned long npages = dir_pages(inode);
-	struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned long i;
-
-	for (i = 0; i < npages; i++)
-	{
-		unsigned long page_off = 0, page_end;
-		void *kaddr;
-
-		page = ext0_get_page(inode, i, &kaddr);
-		if (!page)
-		{
-			ext0_debug("Invalid page in directory lookup id=%zu", i);
-			continue;
-		}
-		// kaddr = page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-			if (!de->rec_len)
-			{
-				page_off += EXT0_ALIGNMENT;
-				continue;
-			}
-
-			if (!de->inode)
-			{
-				page_off += de->rec_len;
-				continue;
-			}
-
-			if (memcmp(de->name, dentry->d_name.name, dentry->d_name.len) == 0)
-			{
-				return le32_to_cpu(de->inode);
-			}
-			page_off += de->rec_len;
-		}
-		ext0_put_page(page, kaddr);
-	}
-	return 0;
-}
-
-#else
-static inline void ext0_put_page(struct page *page)
-{
-	kunmap(page);
-	put_page(page);
-}
-
-static struct page *ext0_get_page(struct inode *dir, unsigned long n)
-{
-	struct address_space *mapping = dir->i_mapping;
-	struct page *page = read_mapping_page(mapping, n, NULL);
-	if (!IS_ERR(page))
-		kmap(page);
-	return page;
-}
-
-static int ext0_new_inode(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
-{
-	struct inode *inode = NULL;
-	int ret;
-
-	ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		return ret;
-	}
-	unlock_new_inode(inode);
-	inode_inc_link_count(dir);
-	d_instantiate(dentry, inode);
-
-	ret = link_dir(dir, dentry, mode);
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to link inode: %i", ret);
-		return ret;
-	}
-	return 0;
-}
-
-static int ext0_tmpfile(struct inode *dir, struct dentry *dentry, umode_t mode)
-{
-	struct inode *inode = NULL;
-	int ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		return ret;
-	}
-	unlock_new_inode(inode);
-	d_tmpfile(dentry, inode);
-	return 0;
-}
-
-static int ext0_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, dev_t rdev)
-{
-	struct inode *inode = NULL;
-	int ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (!EXT0_IS_ERR(ret))
-	{
-		init_special_inode(inode, inode->i_mode, rdev);
-		mark_inode_dirty(inode);
-		unlock_new_inode(inode);
-		d_instantiate(dentry, inode);
-
-		ret = link_dir(dir, dentry, mode);
-		if (EXT0_IS_ERR(ret))
-		{
-			ext0_debug("Unable to link inode: %i", ret);
-			return ret;
-		}
-	}
-	return ret;
-}
-
-static int ext0_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
-{
-	struct inode *inode = NULL;
-	int ret = ext0_create_inode(dir, dentry, S_IFLNK | 0777, &inode);
-	int i = strlen(symname) + 1;
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		return ret;
-	}
-
-	ret = page_symlink(inode, symname, i);
-	if (ret)
-	{
-		inode_dec_link_count(inode);
-		iput(inode);
-		return ret;
-	}
-
-	inode_inc_link_count(inode);
-	mark_inode_dirty(inode);
-	d_instantiate(dentry, inode);
-	return 0;
-}
-
-static int link_dir(struct inode *dir, struct dentry *dentry, umode_t mode)
-{
-	unsigned long npages = dir_pages(dir);
-	struct inode *inode = d_inode(dentry);
-	struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned long i;
-	int d_type;
-
-	for (i = 0; i < npages; i++)
-	{
-		unsigned long page_off = 0, page_end;
-		char *kaddr;
-
-		page = ext0_get_page(dir, i);
-		if (!page)
-		{
-			ext0_debug("Invalid page while reading directory contents: page id=%zu", i);
-			continue;
-		}
-		kaddr = (char *)page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-
-			/* Ensure we have enough free space */
-			if (!de->inode && ((dentry->d_name.len + EXT0_DIR_SIZE) <= (page_end - page_off)))
-			{
-				de = (struct ext0_dir_entry *)(kaddr + page_off);
-				de->name_len = dentry->d_name.len;
-				de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-				memcpy(de->name, dentry->d_name.name, dentry->d_name.len);
-				de->inode = cpu_to_le32(inode->i_ino);
-
-				if(S_ISREG(mode))
-					d_type = S_IFREG;
-				else if(S_ISDIR(mode))
-					d_type = S_IFDIR;
-
-				de->file_type = d_type;
-
-				dir->i_size += de->rec_len;
-				mark_inode_dirty(dir);
-				return 0;
-			}
-
-			page_off += de->rec_len;
-		}
-
-		ext0_put_page(page);
-	}
-	return -ENOSPC; /* We need to map new pages in */
-}
-
-static int ext0_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
-{
-	struct inode *inode = NULL;
-	struct buffer_head *bitmap_bh, *gdesc_bh;
-	struct ext0_block_descriptor *gdesc;
-	struct super_block *sb = dir->i_sb;
-	struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
-	int ret;
-	off_t offset;
-	char *bitmap_data;
-	struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned chunk_size = sb->s_blocksize;
-	void *kaddr;
-	unsigned long blk_no = 0;
-
-	inode_inc_link_count(dir); /* Link to parent  */
-
-	mode |= S_IFDIR;
-
-	ret = ext0_create_inode(dir, dentry, mode, &inode);
-	if (EXT0_IS_ERR(ret) || !inode)
-	{
-		ext0_debug("Unable to create inode: %i", ret);
-		inode_dec_link_count(dir);
-		return ret;
-	}
-
-	inode_inc_link_count(inode);
-
-	/* Create default directory contents */
-	page = grab_cache_page(inode->i_mapping, 0);
-	if (!page)
-	{
-		ext0_debug("Could not get any pages: %i", (int)0);
-		ret = -ENOMEM;
-		goto err;
-	}
-
-	ret = __block_write_begin(page, 0, chunk_size, ext0_get_block);
-	if (ret)
-	{
-		ext0_debug("Failed preparing page for write: %i", ret);
-		goto page_err;
-	}
-
-	kaddr = kmap_atomic(page);
-	memset(kaddr, 0, chunk_size);
-
-	de = (struct ext0_dir_entry *)kaddr;
-	de->name_len = 1;
-	de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-	memcpy(de->name, ".", 2);
-	de->inode = cpu_to_le32(inode->i_ino);
-	de->file_type = DT_DIR;
-
-	inode->i_size += de->rec_len;
-
-	de = (struct ext0_dir_entry *)(kaddr + de->rec_len);
-	de->name_len = 2;
-	de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-	memcpy(de->name, "..", 3);
-	de->inode = cpu_to_le32(dir->i_ino);
-	de->file_type = DT_DIR;
-
-	inode->i_size += de->rec_len;
-	mark_inode_dirty(inode);
-
-	kunmap_atomic(kaddr);
-	block_write_end(NULL, inode->i_mapping, 0, chunk_size, chunk_size, page, NULL);
-	/* Default directory contents creation done */
-
-	offset = 0;
-	blk_no = ext0_inode_block(dir->i_ino) - 1;
-	if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-		fs_to_dev_block_num(sb, blk_no, &offset);
-
-	gdesc_bh = in_mem_sb->s_group_desc[EXT0_GET_INO(dir->i_ino)];
-	gdesc = (struct ext0_block_descriptor *)(gdesc_bh->b_data + offset);
-
-	offset = 0;
-	blk_no = 0;
-	if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-		blk_no = fs_to_dev_block_num(sb, gdesc->bg_block_bitmap, &offset);
-
-	bitmap_bh = sb_bread(sb, blk_no);
-	if (!bitmap_bh)
-	{
-		ext0_debug("Could not perform I/O for block bitmap: %zu, orig: %i", blk_no, gdesc->bg_block_bitmap);
-		ret = -EIO;
-		goto page_err;
-	}
-	bitmap_data = bitmap_bh->b_data + offset;
-
-	unlock_page(page);
-
-	mark_buffer_dirty(bitmap_bh);
-
-	unlock_new_inode(inode);
-
-	put_page(page);
-
-	d_instantiate(dentry, inode);
-
-	ret = link_dir(dir, dentry, mode);
-	if (EXT0_IS_ERR(ret))
-	{
-		goto k_err;
-	}
-	return 0;
-
-k_err:
-	kunmap_atomic(kaddr);
-
-page_err:
-	unlock_page(page);
-
-err:
-	inode_dec_link_count(inode);
-	inode_dec_link_count(dir);
-	iput(inode);
-	return ret;
-}
-
-static int ext0_rename(struct inode *old_dir, struct dentry *old_dentry,
-					   struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
-{
-	return 0;
-}
-
-static int ext0_unlink(struct inode *dir, struct dentry *dentry)
-{
-	struct page *page = NULL;
-	struct inode *inode = dir;
-	unsigned long npages = dir_pages(dir);
-	struct ext0_dir_entry *de;
-	int ret;
-	unsigned long i;
-
-	for (i = 0; i < npages; i++)
-	{
-		void *kaddr;
-		unsigned long page_off = 0, page_end;
-
-		page = ext0_get_page(inode, i);
-		if (!page)
-		{
-			ext0_debug("Invalid page for directory entry unlinking: page id=%zu", i);
-			continue;
-		}
-		kaddr = page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			unsigned long chunk_size;
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-			if (!de->rec_len)
-			{
-				page_off += EXT0_ALIGNMENT;
-				continue;
-			}
-
-			if (!de->inode)
-			{
-				page_off += de->rec_len;
-				continue;
-			}
-
-			if (memcmp(de->name, dentry->d_name.name, dentry->d_name.len) == 0)
-			{
-				chunk_size = page_end - page_off;
-				lock_page(page);
-				ret = __block_write_begin(page, page_off, chunk_size, ext0_get_block);
-				if (ret)
-				{
-					ext0_debug("Failed preparing page for deletion: %i", ret);
-					unlock_page(page);
-					goto out;
-				}
-				de->inode = 0;
-				dir->i_size -= de->rec_len;
-				memset(de, 0, de->rec_len);
-
-				block_write_end(NULL, inode->i_mapping, page_off, chunk_size, chunk_size, page, NULL);
-
-				unlock_page(page);
-				inode->i_ctime = inode->i_mtime = current_time(inode);
-			}
-			page_off += de->rec_len;
-		}
-
-		ext0_put_page(page);
-	}
-
-	inode_dec_link_count(inode);
-	mark_inode_dirty(inode);
-	return 0;
-out:
-	ext0_put_page(page);
-	return ret;
-}
-
-static int ext0_readdir(struct file *file, struct dir_context *ctx)
-{
-	struct inode *inode = file->f_inode;
-	unsigned long npages = dir_pages(inode);
-	struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned long i;
-
-	for (i = ctx->pos; i < npages; i++)
-	{
-		unsigned long page_off = 0, page_end;
-		char *kaddr;
-
-		page = ext0_get_page(inode, i);
-		if (!page)
-		{
-			ext0_debug("Invalid page while reading directory contents: page id=%zu", i);
-			ctx->pos += PAGE_SIZE;
-			continue;
-		}
-		kaddr = (char *)page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-			if (!de->rec_len)
-			{
-				page_off += EXT0_ALIGNMENT; /* Too small jumps. Needs better approach */
-				continue;
-			}
-
-			/* Deleted entry or unoccupied? */
-			if (!de->inode)
-			{
-				page_off += de->rec_len;
-				continue;
-			}
-
-			if (!dir_emit(ctx, de->name, de->name_len, le32_to_cpu(de->inode), le32_to_cpu(de->file_type)))
-			{
-				ext0_put_page(page);
-				return 0;
-			}
-
-			page_off += de->rec_len;
-			ctx->pos += de->rec_len;
-		}
-		ext0_put_page(page);
-	}
-
-	return 0;
-}
-
-static int ext0_inode_by_name(struct dentry *dentry)
-{
-	struct inode *inode = d_inode(dentry->d_parent);
-	unsigned long npages = dir_pages(inode);
-	struct page *page;
-	struct ext0_dir_entry *de;
-	unsigned long i;
-
-	for (i = 0; i < npages; i++)
-	{
-		unsigned long page_off = 0, page_end;
-		void *kaddr;
-
-		page = ext0_get_page(inode, i);
-		if (!page)
-		{
-			ext0_debug("Invalid page in directory lookup id=%zu", i);
-			continue;
-		}
-		kaddr = page_address(page);
-
-		page_end = page_off + PAGE_SIZE;
-		while (page_off < page_end)
-		{
-			de = (struct ext0_dir_entry *)(kaddr + page_off);
-			if (!de->rec_len)
-			{
-				page_off += EXT0_ALIGNMENT;
-				continue;
-			}
-
-			if (!de->inode)
-			{
-				page_off += de->rec_len;
-				continue;
-			}
-
-			if (memcmp(de->name, dentry->d_name.name, dentry->d_name.len) == 0)
-			{
-				return le32_to_cpu(de->inode);
-			}
-			page_off += de->rec_len;
-		}
-		ext0_put_page(page);
-	}
-	return 0;
-}
-
-#endif
-
-static struct dentry *ext0_lookup_by_name(struct inode *dir, struct dentry *dentry, unsigned int flags)
-{
-	struct inode *inode;
-	ino_t ino;
-
-	if (dentry->d_name.len > EXT0_NAME_LEN)
-		return ERR_PTR(-ENAMETOOLONG);
-
-	ino = ext0_inode_by_name(dentry);
-	inode = NULL;
-	if (ino)
-	{
-		inode = ext0_iget(dir->i_sb, ino);
-		if (inode == ERR_PTR(-EIO) || inode == ERR_PTR(-ENOMEM))
-		{
-			ext0_debug("deleted inode referenced: %lu", (unsigned long)ino);
-			return ERR_PTR(-EIO);
-		}
-	}
-	return d_splice_alias(inode, dentry);
-}
-
-static int ext0_rmdir(struct inode *dir, struct dentry *dentry)
-{
-	return 0;
-}
-
-static int ext0_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry)
-{
-	struct inode *inode = d_inode(old_dentry);
-	int ret;
-
-	inode->i_ctime = current_time(inode);
-	inode_inc_link_count(inode);
-	d_instantiate(dentry, inode);
-	ret = link_dir(d_inode(dentry->d_parent), dentry, d_inode(dentry)->i_mode); /* Regular file? */
-
-	if (EXT0_IS_ERR(ret))
-	{
-		ext0_debug("Unable to link inode: %i", ret);
-		return ret;
-	}
-	mark_inode_dirty(inode);
-	return 0;
-}
-
-const struct file_operations ext0_dir_operations = {
-	.llseek = generic_file_llseek,
-	.read = generic_read_dir,
-	.iterate_shared = ext0_readdir,
-	.fsync = generic_file_fsync,
-};
-
-const struct inode_operations ext0_dir_inode_operations = {
-	.create = ext0_new_inode,
-	.lookup = ext0_lookup_by_name,
-	.link = ext0_link,
-	.unlink = ext0_unlink,
-	.symlink = ext0_symlink,
-	.mkdir = ext0_mkdir,
-	.rmdir = ext0_rmdir,
-	.mknod = ext0_mknod,
-	.rename = ext0_rename,
-	// .setattr = ext0_setattr,
-	.tmpfile = ext0_tmpfile,
-};
+#include <linux/pagemap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+
+#include "ext0.h"
+
+/*
+ * Directories. Entries are packed in blocks, each entry's rec_len reaching
+ * to the next one so the entries of a block cover all of it. A free entry
+ * has an inode of 0. Blocks are read and written through the buffer cache,
+ * mapped by the directory's extent tree. Small directories are a single
+ * block scanned linearly, larger ones carry a hashed index(see htree.c).
+ */
+
+static int ext0_create_inode(struct inode *dir, struct dentry *dentry, umode_t mode, struct inode **ret_inode)
+{
+	struct super_block *sb = dir->i_sb;
+	struct inode *inode;
+	struct ext0_inode_info *in_mem_inode;
+	ino_t ino;
+	int err;
+
+	ino = ext0_new_ino(dir, mode, &err);
+	if (!ino)
+		return err;
+
+	inode = new_inode(sb);
+	if (!inode)
+	{
+		ext0_free_ino(sb, ino);
+		return -ENOMEM;
+	}
+
+	inode->i_mode = mode;
+	inode->i_ino = ino;
+	inode->i_sb = sb;
+	inode->i_blocks = 0;
+	inode->i_blkbits = sb->s_blocksize_bits;
+	inode->i_flags = 0;
+	inode->i_state = EXT0_STATE_NEW | I_LINKABLE | I_NEW; /* The fs crashes without the I_NEW flag. Need to investigate */
+	inode->i_size = 0; // sizeof(struct ext0_inode);
+
+	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
+
+	if (S_ISREG(inode->i_mode))
+	{
+		inode->i_op = &ext0_file_inode_operations;
+		inode->i_fop = &ext0_file_operations;
+	}
+	else if (S_ISDIR(inode->i_mode))
+	{
+		inode->i_op = &ext0_dir_inode_operations;
+		inode->i_fop = &ext0_dir_operations;
+	}
+	else if (S_ISLNK(inode->i_mode))
+	{
+		inode->i_op = &page_symlink_inode_operations;
+		inode_nohighmem(inode);
+	}
+
+	if (inode->i_mapping)
+		ext0_set_aops(inode);
+
+	in_mem_inode = EXT0_I(inode);
+	in_mem_inode->i_flags = inode->i_flags;
+
+	ext0_ext_tree_init(inode);
+	in_mem_inode->i_state = inode->i_state;
+	in_mem_inode->i_block_group = ext0_inode_group(sb, inode->i_ino);
+
+	mark_inode_dirty(inode);
+	*ret_inode = inode;
+	return 0;
+}
+
+/* Entries must fit in the block and hold their name. A zero rec_len is a gap
+ * left by older versions, which zeroed deleted entries in place. It is
+ * stepped over a word at a time
+ */
+static inline int ext0_dir_entry_ok(struct inode *dir, struct ext0_dir_entry *de, unsigned offset)
+{
+	unsigned rec_len = le16_to_cpu(de->rec_len);
+
+	if (!rec_len)
+		return 1;
+	return EXT0_IS_ALIGNED(rec_len) && rec_len >= ext0_rec_len(dir, de->name_len) && offset + rec_len <= dir->i_sb->s_blocksize;
+}
+
+static inline unsigned ext0_dir_step(struct ext0_dir_entry *de)
+{
+	unsigned rec_len = le16_to_cpu(de->rec_len);
+
+	return rec_len ? rec_len : EXT0_ALIGNMENT;
+}
+
+/* In hashed directories one word compare turns away nearly every entry that
+ * isn't a match, the name is only compared on a hash hit
+ */
+static inline int ext0_match(struct inode *dir, const struct qstr *name, u32 hash, struct ext0_dir_entry *de)
+{
+	if (!de->inode || de->name_len != name->len)
+		return 0;
+	if (ext0_dir_hashed(dir) && *EXT0_DIR_HASH(de) != cpu_to_le32(hash))
+		return 0;
+	return !memcmp(de->name, name->name, name->len);
+}
+
+/* Blocks read ahead at a time by scans over a whole directory */
+#define EXT0_DIR_RA_BLOCKS 16
+
+/* Returns the buffer of directory block @block. Directories have no holes */
+struct buffer_head *ext0_dir_bread(struct inode *dir, unsigned long block, int *err)
+{
+	struct ext0_map_blocks map = {.m_lblk = block, .m_len = 1};
+	struct buffer_head *bh;
+	int ret;
+
+	ret = ext0_ext_map_blocks(dir, &map, 0);
+	if (ret <= 0)
+	{
+		ext0_debug("Unmapped directory block: inode=%lu block=%lu", dir->i_ino, block);
+		*err = ret ? ret : -EIO;
+		return NULL;
+	}
+
+	bh = sb_bread(dir->i_sb, map.m_pblk);
+	if (!bh)
+	{
+		ext0_debug("Could not perform I/O for directory block: %lu", map.m_pblk);
+		*err = -EIO;
+	}
+	return bh;
+}
+
+/*
+ * Free space. While a directory is in memory it keeps, for each of its
+ * blocks, the largest entry the block can still take. A recorded size is
+ * never below the real one: inserts set it to what they found and deletes
+ * raise it to the gap they leave. A block known to be too full for a name is
+ * skipped without being read. Updated under the directory's i_rwsem
+ */
+#define EXT0_DIR_FREE_UNKNOWN U16_MAX
+
+static unsigned ext0_dir_get_free(struct inode *dir, unsigned long block)
+{
+	struct ext0_inode_info *in_mem_inode = EXT0_I(dir);
+
+	if (block >= in_mem_inode->i_dir_nr_free)
+		return EXT0_DIR_FREE_UNKNOWN;
+	return in_mem_inode->i_dir_free[block];
+}
+
+void ext0_dir_set_free(struct inode *dir, unsigned long block, unsigned free)
+{
+	struct ext0_inode_info *in_mem_inode = EXT0_I(dir);
+	unsigned long nr = in_mem_inode->i_dir_nr_free;
+	__u16 *counts;
+
+	if (block >= nr)
+	{
+		unsigned long new_nr = max(block + 1, nr * 2);
+
+		/* Without memory the block just stays unknown */
+		counts = krealloc(in_mem_inode->i_dir_free, new_nr * sizeof(*counts), GFP_NOFS);
+		if (!counts)
+			return;
+		memset(counts + nr, 0xff, (new_nr - nr) * sizeof(*counts));
+		in_mem_inode->i_dir_free = counts;
+		in_mem_inode->i_dir_nr_free = new_nr;
+	}
+	in_mem_inode->i_dir_free[block] = free;
+}
+
+void ext0_dir_forget_free(struct inode *dir)
+{
+	struct ext0_inode_info *in_mem_inode = EXT0_I(dir);
+
+	kfree(in_mem_inode->i_dir_free);
+	in_mem_inode->i_dir_free = NULL;
+	in_mem_inode->i_dir_nr_free = 0;
+}
+
+/* Start reading blocks [@block, @block + @nr) of @dir so that the scans going
+ * through them don't wait on each block in turn
+ */
+static void ext0_dir_readahead(struct inode *dir, unsigned long block, unsigned long nr)
+{
+	unsigned long end = min(block + nr, ext0_dir_blocks(dir));
+	struct ext0_map_blocks map;
+	unsigned i;
+
+	while (block < end)
+	{
+		map.m_lblk = block;
+		map.m_len = end - block;
+		if (ext0_ext_map_blocks(dir, &map, 0) <= 0)
+			break;
+
+		for (i = 0; i < map.m_len; i++)
+			sb_breadahead(dir->i_sb, map.m_pblk + i);
+		block += map.m_len;
+	}
+}
+
+/* Add a block at the end of @dir holding a single empty entry. Returns its
+ * buffer with *block set to its logical number. The block is zeroed in memory
+ * rather than read, so nothing it held before can show up as entries
+ */
+struct buffer_head *ext0_dir_append(struct inode *dir, unsigned long *block, int *err)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ext0_map_blocks map = {.m_lblk = ext0_dir_blocks(dir), .m_len = 1};
+	struct ext0_dir_entry *de;
+	struct buffer_head *bh;
+	int ret;
+
+	ret = ext0_ext_map_blocks(dir, &map, EXT0_GET_BLOCKS_CREATE);
+	if (ret < 0)
+	{
+		*err = ret;
+		return NULL;
+	}
+
+	bh = sb_getblk(sb, map.m_pblk);
+	if (!bh)
+	{
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	de = (struct ext0_dir_entry *)bh->b_data;
+	de->rec_len = cpu_to_le16(sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, dir);
+
+	*block = map.m_lblk;
+	ext0_dir_set_free(dir, *block, sb->s_blocksize);
+	i_size_write(dir, (loff_t)(*block + 1) << sb->s_blocksize_bits);
+	mark_inode_dirty(dir);
+	return bh;
+}
+
+struct ext0_dir_entry *ext0_dir_find_in_block(struct inode *dir, struct buffer_head *bh, const struct qstr *name, u32 hash)
+{
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	unsigned offset = 0;
+
+	while (offset + EXT0_DIR_SIZE <= blocksize)
+	{
+		struct ext0_dir_entry *de = (struct ext0_dir_entry *)(bh->b_data + offset);
+
+		if (!ext0_dir_entry_ok(dir, de, offset))
+		{
+			ext0_debug("Corrupt directory entry: inode=%lu offset=%u", dir->i_ino, offset);
+			break;
+		}
+		if (ext0_match(dir, name, hash, de))
+			return de;
+		offset += ext0_dir_step(de);
+	}
+	return NULL;
+}
+
+/* Call @actor on every live entry of @dir, stopping at the first non-zero
+ * return. Returns that or -errno
+ */
+int ext0_dir_iterate(struct inode *dir, int (*actor)(void *priv, struct ext0_dir_entry *de), void *priv)
+{
+	unsigned long nblocks = ext0_dir_blocks(dir);
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	struct buffer_head *bh;
+	unsigned long i;
+	int ret = 0;
+
+	for (i = 0; i < nblocks && !ret; i++)
+	{
+		unsigned offset = 0;
+
+		if (nblocks > 1 && !(i % EXT0_DIR_RA_BLOCKS))
+			ext0_dir_readahead(dir, i, EXT0_DIR_RA_BLOCKS);
+
+		bh = ext0_dir_bread(dir, i, &ret);
+		if (!bh)
+			break;
+
+		while (offset + EXT0_DIR_SIZE <= blocksize)
+		{
+			struct ext0_dir_entry *de = (struct ext0_dir_entry *)(bh->b_data + offset);
+
+			if (!ext0_dir_entry_ok(dir, de, offset))
+				break;
+			if (de->inode)
+			{
+				ret = actor(priv, de);
+				if (ret)
+					break;
+			}
+			offset += ext0_dir_step(de);
+		}
+		brelse(bh);
+	}
+	return ret;
+}
+
+/* Do the entries of the block chain up exactly to its end? */
+static int ext0_dir_block_packed(struct inode *dir, char *base)
+{
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	unsigned offset = 0;
+
+	while (offset < blocksize)
+	{
+		struct ext0_dir_entry *de = (struct ext0_dir_entry *)(base + offset);
+
+		if (offset + EXT0_DIR_SIZE > blocksize || !le16_to_cpu(de->rec_len) || !ext0_dir_entry_ok(dir, de, offset))
+			return 0;
+		offset += le16_to_cpu(de->rec_len);
+	}
+	return 1;
+}
+
+/* Room an entry could be added into right after @de */
+static inline unsigned ext0_dir_gap(struct inode *dir, struct ext0_dir_entry *de)
+{
+	return le16_to_cpu(de->rec_len) - (de->inode ? ext0_rec_len(dir, de->name_len) : 0);
+}
+
+/* Give free entries and bare gaps to the live entry before them, and make
+ * any space ahead of the first live entry a single free entry. Live entries
+ * never move, so readdir cursors into the block stay valid. Turns blocks
+ * written by older versions into the packed layout. Returns the largest gap
+ * left
+ */
+unsigned ext0_dir_coalesce(struct inode *dir, char *base)
+{
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	struct ext0_dir_entry *de, *prev = NULL, *head = (struct ext0_dir_entry *)base;
+	unsigned offset = 0, prev_offset = 0, largest = 0;
+
+	while (offset + EXT0_DIR_SIZE <= blocksize)
+	{
+		de = (struct ext0_dir_entry *)(base + offset);
+		if (!ext0_dir_entry_ok(dir, de, offset))
+			break;
+
+		if (de->inode && le16_to_cpu(de->rec_len))
+		{
+			if (prev)
+			{
+				prev->rec_len = cpu_to_le16(offset - prev_offset);
+				largest = max(largest, ext0_dir_gap(dir, prev));
+			}
+			else if (offset)
+			{
+				head->inode = 0;
+				head->rec_len = cpu_to_le16(offset);
+				largest = offset;
+			}
+			prev = de;
+			prev_offset = offset;
+		}
+		offset += ext0_dir_step(de);
+	}
+
+	if (!prev)
+	{
+		head->inode = 0;
+		head->rec_len = cpu_to_le16(blocksize);
+		return blocksize;
+	}
+	prev->rec_len = cpu_to_le16(blocksize - prev_offset);
+	return max(largest, ext0_dir_gap(dir, prev));
+}
+
+/* Add an entry to block @block if one of its gaps can take it, -ENOSPC
+ * otherwise
+ */
+int ext0_dir_insert_in_block(struct inode *dir, struct buffer_head *bh, unsigned long block, const struct qstr *name, ino_t ino,
+			     umode_t mode)
+{
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	unsigned need = ext0_rec_len(dir, name->len);
+	unsigned offset, rec_len, used, gap, largest = 0;
+	struct ext0_dir_entry *de, *slot = NULL;
+
+	if (ext0_dir_get_free(dir, block) < need)
+		return -ENOSPC;
+
+	if (!ext0_dir_block_packed(dir, bh->b_data))
+	{
+		ext0_dir_coalesce(dir, bh->b_data);
+		mark_buffer_dirty_inode(bh, dir);
+	}
+
+	for (offset = 0; offset < blocksize; offset += le16_to_cpu(de->rec_len))
+	{
+		de = (struct ext0_dir_entry *)(bh->b_data + offset);
+		gap = ext0_dir_gap(dir, de);
+		if (!slot && gap >= need)
+		{
+			slot = de;
+			gap -= need;
+		}
+		largest = max(largest, gap);
+	}
+
+	ext0_dir_set_free(dir, block, largest);
+	if (!slot)
+		return -ENOSPC;
+
+	de = slot;
+	rec_len = le16_to_cpu(de->rec_len);
+	used = de->inode ? ext0_rec_len(dir, de->name_len) : 0;
+	if (used)
+	{
+		/* Split the slack off the end of a live entry */
+		de->rec_len = cpu_to_le16(used);
+		de = (struct ext0_dir_entry *)((char *)de + used);
+		de->rec_len = cpu_to_le16(rec_len - used);
+	}
+	de->inode = cpu_to_le32(ino);
+	de->name_len = name->len;
+	de->file_type = EXT0_DT(mode);
+	memcpy(de->name, name->name, name->len);
+	if (ext0_dir_hashed(dir))
+		*EXT0_DIR_HASH(de) = cpu_to_le32(ext0_dirhash((const char *)name->name, name->len));
+	mark_buffer_dirty_inode(bh, dir);
+
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/* Free entry @de of block @block. Its space goes to the entry before it, so
+ * holes don't build up and the entries that stay don't move. The first entry
+ * of a block has nothing to merge into and is only marked free
+ */
+static void ext0_delete_entry(struct inode *dir, struct buffer_head *bh, unsigned long block, struct ext0_dir_entry *de)
+{
+	unsigned blocksize = dir->i_sb->s_blocksize;
+	unsigned offset = 0, target = (char *)de - bh->b_data;
+	unsigned free = ext0_dir_get_free(dir, block);
+	struct ext0_dir_entry *prev = NULL, *p;
+
+	while (offset < target && offset + EXT0_DIR_SIZE <= blocksize)
+	{
+		p = (struct ext0_dir_entry *)(bh->b_data + offset);
+		if (!ext0_dir_entry_ok(dir, p, offset))
+			break;
+		prev = p;
+		offset += ext0_dir_step(p);
+	}
+
+	/* Blocks written by older versions can have bare gaps before @de */
+	if (prev && le16_to_cpu(prev->rec_len) && offset == target)
+	{
+		le16_add_cpu(&prev->rec_len, le16_to_cpu(de->rec_len));
+		de = prev;
+	}
+	else
+	{
+		de->inode = 0;
+	}
+	mark_buffer_dirty_inode(bh, dir);
+
+	if (free != EXT0_DIR_FREE_UNKNOWN && ext0_dir_gap(dir, de) > free)
+		ext0_dir_set_free(dir, block, ext0_dir_gap(dir, de));
+}
+
+/* Returns the buffer holding the entry for @name(*res_dir, in block
+ * *res_block), or NULL with *err set to 0 if there is none
+ */
+static struct buffer_head *ext0_find_entry(struct inode *dir, const struct qstr *name, struct ext0_dir_entry **res_dir,
+					   unsigned long *res_block, int *err)
+{
+	unsigned long nblocks = ext0_dir_blocks(dir);
+	u32 hash = ext0_dirhash((const char *)name->name, name->len);
+	struct buffer_head *bh;
+	unsigned long i;
+
+	*err = 0;
+	if (ext0_dir_indexed(dir))
+	{
+		bh = ext0_dx_find_entry(dir, name, hash, res_dir, res_block, err);
+		if (bh || *err != -EIO)
+			return bh;
+		ext0_debug("Bad directory index, falling back to a linear search: inode=%lu", dir->i_ino);
+		*err = 0;
+	}
+
+	for (i = 0; i < nblocks; i++)
+	{
+		if (nblocks > 1 && !(i % EXT0_DIR_RA_BLOCKS))
+			ext0_dir_readahead(dir, i, EXT0_DIR_RA_BLOCKS);
+
+		bh = ext0_dir_bread(dir, i, err);
+		if (!bh)
+			return NULL;
+
+		*res_dir = ext0_dir_find_in_block(dir, bh, name, hash);
+		if (*res_dir)
+		{
+			*res_block = i;
+			return bh;
+		}
+		brelse(bh);
+	}
+	return NULL;
+}
+
+static int __ext0_add_entry(struct inode *dir, const struct qstr *name, ino_t ino, umode_t mode)
+{
+	unsigned long nblocks = ext0_dir_blocks(dir);
+	unsigned need = ext0_rec_len(dir, name->len);
+	struct buffer_head *bh;
+	unsigned long i;
+	int ret;
+
+	if (ext0_dir_indexed(dir))
+		return ext0_dx_add_entry(dir, name, ino, mode);
+
+	if (nblocks == 1)
+	{
+		bh = ext0_dir_bread(dir, 0, &ret);
+		if (!bh)
+			return ret;
+
+		ret = ext0_dir_insert_in_block(dir, bh, 0, name, ino, mode);
+		if (ret == -ENOSPC)
+		{
+			/* The first block is full, index the directory */
+			ret = ext0_dx_make_indexed(dir, bh);
+			if (!ret)
+				ret = ext0_dx_add_entry(dir, name, ino, mode);
+		}
+		brelse(bh);
+		return ret;
+	}
+
+	/* Linear directories of several blocks come from older versions */
+	for (i = 0; i < nblocks; i++)
+	{
+		if (ext0_dir_get_free(dir, i) < need)
+			continue;
+
+		bh = ext0_dir_bread(dir, i, &ret);
+		if (!bh)
+			return ret;
+
+		ret = ext0_dir_insert_in_block(dir, bh, i, name, ino, mode);
+		brelse(bh);
+		if (ret != -ENOSPC)
+			return ret;
+	}
+
+	/* Every block is full, grow the directory by one */
+	bh = ext0_dir_append(dir, &i, &ret);
+	if (!bh)
+		return ret;
+
+	ret = ext0_dir_insert_in_block(dir, bh, i, name, ino, mode);
+	brelse(bh);
+	return ret;
+}
+
+static int ext0_add_entry(struct inode *dir, const struct qstr *name, ino_t ino, umode_t mode)
+{
+	int ret = __ext0_add_entry(dir, name, ino, mode);
+
+	if (!ret)
+		ext0_dc_insert(dir, name, ino, 1);
+	return ret;
+}
+
+/* Write "." and ".." into the first block of a new directory */
+static int ext0_make_empty(struct inode *inode, struct inode *parent)
+{
+	struct qstr dot = QSTR_INIT(".", 1), dotdot = QSTR_INIT("..", 2);
+	struct buffer_head *bh;
+	unsigned long block;
+	int err;
+
+	bh = ext0_dir_append(inode, &block, &err);
+	if (!bh)
+		return err;
+
+	/* ".." takes the rest of the block from "." */
+	err = ext0_dir_insert_in_block(inode, bh, block, &dot, inode->i_ino, S_IFDIR);
+	if (!err)
+		err = ext0_dir_insert_in_block(inode, bh, block, &dotdot, parent->i_ino, S_IFDIR);
+	brelse(bh);
+	return err;
+}
+
+static int ext0_add_nondir(struct inode *dir, struct dentry *dentry, struct inode *inode)
+{
+	int ret = ext0_add_entry(dir, &dentry->d_name, inode->i_ino, inode->i_mode);
+
+	if (EXT0_IS_ERR(ret))
+	{
+		ext0_debug("Unable to link inode: %i", ret);
+		inode_dec_link_count(inode);
+		unlock_new_inode(inode);
+		iput(inode);
+		return ret;
+	}
+	unlock_new_inode(inode);
+	d_instantiate(dentry, inode);
+	return 0;
+}
+
+static int __ext0_new_inode(struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+	struct inode *inode = NULL;
+	int ret;
+
+	ret = ext0_create_inode(dir, dentry, mode, &inode);
+	if (EXT0_IS_ERR(ret))
+	{
+		ext0_debug("Unable to create inode: %i", ret);
+		return ret;
+	}
+	return ext0_add_nondir(dir, dentry, inode);
+}
+
+static int __ext0_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, dev_t rdev)
+{
+	struct inode *inode = NULL;
+	int ret = ext0_create_inode(dir, dentry, mode, &inode);
+	if (EXT0_IS_ERR(ret))
+		return ret;
+
+	init_special_inode(inode, inode->i_mode, rdev);
+	mark_inode_dirty(inode);
+	return ext0_add_nondir(dir, dentry, inode);
+}
+
+static int __ext0_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+{
+	struct inode *inode = NULL;
+	int ret = ext0_create_inode(dir, dentry, S_IFLNK | 0777, &inode);
+	int i = strlen(symname) + 1;
+	if (EXT0_IS_ERR(ret))
+	{
+		ext0_debug("Unable to create inode: %i", ret);
+		return ret;
+	}
+
+	ret = page_symlink(inode, symname, i);
+	if (ret)
+	{
+		inode_dec_link_count(inode);
+		unlock_new_inode(inode);
+		iput(inode);
+		return ret;
+	}
+
+	mark_inode_dirty(inode);
+	return ext0_add_nondir(dir, dentry, inode);
+}
+
+static int __ext0_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+	struct inode *inode = NULL;
+	int ret;
+
+	ret = ext0_create_inode(dir, dentry, S_IFDIR | mode, &inode);
+	if (EXT0_IS_ERR(ret))
+	{
+		ext0_debug("Unable to create inode: %i", ret);
+		return ret;
+	}
+
+	inode_inc_link_count(dir);
+	inode_inc_link_count(inode); /* "." */
+	EXT0_I(inode)->i_flags |= EXT0_DIRENT_HASH_FL;
+
+	ret = ext0_make_empty(inode, dir);
+	if (EXT0_IS_ERR(ret))
+		goto err;
+
+	ret = ext0_add_entry(dir, &dentry->d_name, inode->i_ino, inode->i_mode);
+	if (EXT0_IS_ERR(ret))
+		goto err;
+
+	unlock_new_inode(inode);
+	d_instantiate(dentry, inode);
+	return 0;
+
+err:
+	ext0_debug("Unable to make directory: %i", ret);
+	inode_dec_link_count(inode);
+	inode_dec_link_count(inode);
+	unlock_new_inode(inode);
+	iput(inode);
+	inode_dec_link_count(dir);
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+static int ext0_new_inode(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+{
+	return __ext0_new_inode(dir, dentry, mode);
+}
+
+static int ext0_tmpfile(struct mnt_idmap *idmap, struct inode *dir, struct file *file, umode_t mode)
+{
+	struct inode *inode = NULL;
+	int ret = ext0_create_inode(dir, NULL, mode, &inode);
+	if (EXT0_IS_ERR(ret))
+	{
+		ext0_debug("Unable to create inode: %i", ret);
+		return ret;
+	}
+	d_tmpfile(file, inode);
+	unlock_new_inode(inode);
+	return finish_open_simple(file, 0);
+}
+
+static int ext0_mknod(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, dev_t rdev)
+{
+	return __ext0_mknod(dir, dentry, mode, rdev);
+}
+
+static int ext0_symlink(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, const char *symname)
+{
+	return __ext0_symlink(dir, dentry, symname);
+}
+
+static int ext0_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+	return __ext0_mkdir(dir, dentry, mode);
+}
+
+static int ext0_rename(struct mnt_idmap *idmap, struct inode *old_dir, struct dentry *old_dentry,
+					   struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
+{
+	return 0;
+}
+
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+static int ext0_new_inode(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+{
+	return __ext0_new_inode(dir, dentry, mode);
+}
+
+static int ext0_tmpfile(struct user_namespace *mnt_userns, struct inode *dir, struct file *file, umode_t mode)
+{
+	struct inode *inode = NULL;
+	int ret = ext0_create_inode(dir, NULL, mode, &inode);
+	if (EXT0_IS_ERR(ret))
+	{
+		ext0_debug("Unable to create inode: %i", ret);
+		return ret;
+	}
+	d_tmpfile(file, inode);
+	unlock_new_inode(inode);
+	return finish_open_simple(file, 0);
+}
+
+static int ext0_mknod(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, dev_t rdev)
+{
+	return __ext0_mknod(dir, dentry, mode, rdev);
+}
+
+static int ext0_symlink(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, const char *symname)
+{
+	return __ext0_symlink(dir, dentry, symname);
+}
+
+static int ext0_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+	return __ext0_mkdir(dir, dentry, mode);
+}
+
+static int ext0_rename(struct user_namespace *mnt_userns, struct inode *old_dir, struct dentry *old_dentry,
+					   struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
+{
+	return 0;
+}
+
+#else
+static int ext0_new_inode(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+{
+	return __ext0_new_inode(dir, dentry, mode);
+}
+
+static int ext0_tmpfile(struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+	struct inode *inode = NULL;
+	int ret = ext0_create_inode(dir, dentry, mode, &inode);
+	if (EXT0_IS_ERR(ret))
+	{
+		ext0_debug("Unable to create inode: %i", ret);
+		return ret;
+	}
+	unlock_new_inode(inode);
+	d_tmpfile(dentry, inode);
+	return 0;
+}
+
+static int ext0_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, dev_t rdev)
+{
+	return __ext0_mknod(dir, dentry, mode, rdev);
+}
+
+static int ext0_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+{
+	return __ext0_symlink(dir, dentry, symname);
+}
+
+static int ext0_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+	return __ext0_mkdir(dir, dentry, mode);
+}
+
+static int ext0_rename(struct inode *old_dir, struct dentry *old_dentry,
+					   struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
+{
+	return 0;
+}
+#endif
+
+static int ext0_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ext0_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned long block;
+	int err;
+
+	bh = ext0_find_entry(dir, &dentry->d_name, &de, &block, &err);
+	if (!bh)
+		return err ? err : -ENOENT;
+
+	ext0_delete_entry(dir, bh, block, de);
+	brelse(bh);
+	ext0_dc_remove(dir, &dentry->d_name);
+
+	dir->i_ctime = dir->i_mtime = current_time(dir);
+	mark_inode_dirty(dir);
+
+	inode->i_ctime = dir->i_ctime;
+	inode_dec_link_count(inode);
+	return 0;
+}
+
+/* Start reading the inode table block of @de, for the stat() that tools
+ * like ls -l do right after readdir. Entries created together usually share
+ * a block, so only a change of block costs one of the *left allowed
+ */
+static void ext0_readdir_prefetch(struct super_block *sb, struct ext0_dir_entry *de, unsigned long *last, unsigned long *left)
+{
+	unsigned long block;
+	unsigned offset;
+
+	if (ext0_inode_block(sb, le32_to_cpu(de->inode), &block, &offset) || block == *last)
+		return;
+
+	sb_breadahead(sb, block);
+	*last = block;
+	(*left)--;
+}
+
+/*
+ * ctx->pos is the byte offset of the next entry in the directory. Entries
+ * never move inside their block(see ext0_dir_coalesce), so an offset taken
+ * before a change still points between the same entries after it. A resumed
+ * call walks its block from the start and skips everything below the
+ * offset, which copes with an offset that no longer starts an entry.
+ * Entries only change blocks when a leaf splits or the directory gets its
+ * index, and then always go to a new block at the end of the directory(see
+ * ext0_dx_split_leaf). No entry is missed, but one moved from before the
+ * cursor is returned a second time
+ */
+static int ext0_readdir(struct file *file, struct dir_context *ctx)
+{
+	struct inode *dir = file_inode(file);
+	struct super_block *sb = dir->i_sb;
+	unsigned long nblocks = ext0_dir_blocks(dir);
+	unsigned long block = ctx->pos >> sb->s_blocksize_bits;
+	unsigned long first = block;
+	unsigned start = ctx->pos & (sb->s_blocksize - 1);
+	unsigned long ra_left = EXT0_SB(sb)->s_inode_readahead_blks, ra_last = 0;
+	struct blk_plug plug;
+	int err;
+
+	/* Let the block layer merge the prefetches into few requests */
+	blk_start_plug(&plug);
+	for (; block < nblocks; block++, start = 0)
+	{
+		loff_t base = (loff_t)block << sb->s_blocksize_bits;
+		unsigned offset = 0;
+		struct buffer_head *bh;
+
+		if (nblocks > 1 && (block == first || !(block % EXT0_DIR_RA_BLOCKS)))
+			ext0_dir_readahead(dir, block, EXT0_DIR_RA_BLOCKS);
+
+		bh = ext0_dir_bread(dir, block, &err);
+
+		if (!bh)
+		{
+			ctx->pos = base + sb->s_blocksize;
+			continue;
+		}
+
+		while (offset + EXT0_DIR_SIZE <= sb->s_blocksize)
+		{
+			struct ext0_dir_entry *de = (struct ext0_dir_entry *)(bh->b_data + offset);
+
+			if (!ext0_dir_entry_ok(dir, de, offset))
+			{
+				ext0_debug("Corrupt directory entry: inode=%lu offset=%llu", dir->i_ino, base + offset);
+				break;
+			}
+
+			/* Entries before the cursor were returned already */
+			if (offset >= start && de->inode)
+			{
+				if (ra_left)
+					ext0_readdir_prefetch(sb, de, &ra_last, &ra_left);
+				if (!dir_emit(ctx, de->name, de->name_len, le32_to_cpu(de->inode), de->file_type))
+				{
+					brelse(bh);
+					goto out;
+				}
+			}
+			offset += ext0_dir_step(de);
+			if (offset > start)
+				ctx->pos = base + offset;
+		}
+		brelse(bh);
+		ctx->pos = base + sb->s_blocksize;
+	}
+
+out:
+	blk_finish_plug(&plug);
+	return 0;
+}
+
+static ino_t ext0_inode_by_name(struct inode *dir, const struct qstr *name, int *err)
+{
+	struct ext0_dir_entry *de;
+	struct buffer_head *bh;
+	unsigned long block;
+	ino_t ino;
+
+	*err = 0;
+	if (ext0_dc_lookup(dir, name, &ino))
+		return ino;
+
+	bh = ext0_find_entry(dir, name, &de, &block, err);
+	if (!bh)
+		return 0;
+	ino = le32_to_cpu(de->inode);
+	brelse(bh);
+	ext0_dc_insert(dir, name, ino, 0);
+	return ino;
+}
+
+static struct dentry *ext0_lookup_by_name(struct inode *dir, struct dentry *dentry, unsigned int flags)
+{
+	struct inode *inode;
+	ino_t ino;
+	int err;
+
+	if (dentry->d_name.len > EXT0_NAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	ino = ext0_inode_by_name(dir, &dentry->d_name, &err);
+	if (EXT0_IS_ERR(err))
+		return ERR_PTR(err);
+
+	inode = NULL;
+	if (ino)
+	{
+		inode = ext0_iget(dir->i_sb, ino);
+		if (inode == ERR_PTR(-EIO) || inode == ERR_PTR(-ENOMEM))
+		{
+			ext0_debug("deleted inode referenced: %lu", (unsigned long)ino);
+			return ERR_PTR(-EIO);
+		}
+	}
+	return d_splice_alias(inode, dentry);
+}
+
+static int ext0_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	return 0;
+}
+
+static int ext0_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(old_dentry);
+	int ret;
+
+	inode->i_ctime = current_time(inode);
+	inode_inc_link_count(inode);
+	ihold(inode);
+
+	ret = ext0_add_entry(dir, &dentry->d_name, inode->i_ino, inode->i_mode);
+	if (EXT0_IS_ERR(ret))
+	{
+		ext0_debug("Unable to link inode: %i", ret);
+		inode_dec_link_count(inode);
+		iput(inode);
+		return ret;
+	}
+	d_instantiate(dentry, inode);
+	return 0;
+}
+
+const struct file_operations ext0_dir_operations = {
+	.llseek = generic_file_llseek,
+	.read = generic_read_dir,
+	.iterate_shared = ext0_readdir,
+	.fsync = generic_file_fsync,
+	.unlocked_ioctl = ext0_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	.compat_ioctl = compat_ptr_ioctl,
+#endif
+};
+
+const struct inode_operations ext0_dir_inode_operations = {
+	.create = ext0_new_inode,
+	.lookup = ext0_lookup_by_name,
+	.link = ext0_link,
+	.unlink = ext0_unlink,
+	.symlink = ext0_symlink,
+	.mkdir = ext0_mkdir,
+	.rmdir = ext0_rmdir,
+	.mknod = ext0_mknod,
+	.rename = ext0_rename,
+	// .setattr = ext0_setattr,
+	.tmpfile = ext0_tmpfile,
+};
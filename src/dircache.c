@@ -0,0 +1,398 @@
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+#include "ext0.h"
+
+/*
+ * In-memory name index of a directory, hung off its ext0_inode_info. The
+ * first lookup in an indexed directory reads all of it once to fill a Bloom
+ * filter with every name in it. A hash table(name -> inode) then fills up
+ * as names are found or added. A lookup answered by the table, or ruled out by the
+ * filter, does no directory I/O: a create no longer searches the directory
+ * for the name it is about to add. Link and unlink keep both up to date.
+ * A filter can't forget a name, so the cache is dropped once unlinked names
+ * make up a quarter of it, or once it holds more names than it was sized
+ * for. The next lookup builds it again. Caches sit on an LRU list that a
+ * shrinker trims under memory pressure.
+ */
+
+#define EXT0_DC_BLOOM_PROBES 3
+#define EXT0_DC_BITS_PER_NAME 8  /* Filter bits per name before the cache is rebuilt */
+#define EXT0_DC_MAX_TABLE_BITS 16
+
+struct ext0_dc_name
+{
+    struct hlist_node dn_node;
+    u32 dn_hash;
+    ino_t dn_ino;
+    u8 dn_len;
+    char dn_name[];
+};
+
+struct ext0_dir_cache
+{
+    struct inode *dc_dir;
+    struct list_head dc_lru;
+    int dc_referenced;        /* Looked up since the shrinker last passed by */
+    unsigned long *dc_bloom;
+    unsigned dc_bloom_bits;   /* log2 of the filter size, in bits */
+    unsigned long dc_names;   /* Names in the filter */
+    unsigned long dc_stale;   /* Of those, unlinked since */
+    unsigned dc_table_bits;
+    struct hlist_head dc_table[];
+};
+
+static LIST_HEAD(ext0_dc_lru);
+static DEFINE_SPINLOCK(ext0_dc_lru_lock);
+static unsigned long ext0_dc_count;
+
+static inline unsigned long ext0_dc_bloom_mask(struct ext0_dir_cache *dc)
+{
+    return (1UL << dc->dc_bloom_bits) - 1;
+}
+
+/* Probes are h1 + i * h2, with h2 from an unrelated hash */
+static void ext0_dc_bloom_add(struct ext0_dir_cache *dc, const char *name, unsigned len, u32 hash)
+{
+    u32 h2 = jhash(name, len, 0) | 1;
+    int i;
+
+    for (i = 0; i < EXT0_DC_BLOOM_PROBES; i++)
+        __set_bit((hash + i * h2) & ext0_dc_bloom_mask(dc), dc->dc_bloom);
+}
+
+static int ext0_dc_bloom_test(struct ext0_dir_cache *dc, const char *name, unsigned len, u32 hash)
+{
+    u32 h2 = jhash(name, len, 0) | 1;
+    int i;
+
+    for (i = 0; i < EXT0_DC_BLOOM_PROBES; i++)
+    {
+        if (!test_bit((hash + i * h2) & ext0_dc_bloom_mask(dc), dc->dc_bloom))
+            return 0;
+    }
+    return 1;
+}
+
+static struct ext0_dc_name *ext0_dc_find(struct ext0_dir_cache *dc, const struct qstr *name, u32 hash)
+{
+    struct ext0_dc_name *dn;
+
+    hlist_for_each_entry(dn, &dc->dc_table[hash_32(hash, dc->dc_table_bits)], dn_node)
+    {
+        if (dn->dn_hash == hash && dn->dn_len == name->len && !memcmp(dn->dn_name, name->name, name->len))
+            return dn;
+    }
+    return NULL;
+}
+
+static void ext0_dc_free(struct ext0_dir_cache *dc)
+{
+    struct ext0_dc_name *dn;
+    struct hlist_node *tmp;
+    unsigned long i;
+
+    for (i = 0; i < (1UL << dc->dc_table_bits); i++)
+    {
+        hlist_for_each_entry_safe(dn, tmp, &dc->dc_table[i], dn_node)
+            kfree(dn);
+    }
+    kvfree(dc->dc_bloom);
+    kvfree(dc);
+}
+
+/* Unhook the cache of @dir, the caller frees it. Holds i_dir_cache_lock */
+static struct ext0_dir_cache *ext0_dc_detach(struct inode *dir)
+{
+    struct ext0_dir_cache *dc = EXT0_I(dir)->i_dir_cache;
+
+    if (!dc)
+        return NULL;
+    EXT0_I(dir)->i_dir_cache = NULL;
+
+    spin_lock(&ext0_dc_lru_lock);
+    list_del(&dc->dc_lru);
+    ext0_dc_count--;
+    spin_unlock(&ext0_dc_lru_lock);
+    return dc;
+}
+
+static int ext0_dc_fill(void *priv, struct ext0_dir_entry *de)
+{
+    struct ext0_dir_cache *dc = priv;
+
+    ext0_dc_bloom_add(dc, de->name, de->name_len, ext0_de_hash(dc->dc_dir, de));
+    dc->dc_names++;
+    return 0;
+}
+
+/* Read the whole directory into a new cache. The caller holds i_rwsem, so
+ * the directory doesn't change under us
+ */
+static void ext0_dc_build(struct inode *dir)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(dir);
+    unsigned long bloom_bits, table_bits;
+    struct ext0_dir_cache *dc;
+
+    /* Sized for twice as many names as the directory could hold now */
+    bloom_bits = roundup_pow_of_two(max_t(unsigned long, dir->i_size, dir->i_sb->s_blocksize) * 2 /
+                                    EXT0_DIR_REC_LEN(1) * EXT0_DC_BITS_PER_NAME);
+    table_bits = min_t(unsigned long, ilog2(bloom_bits / EXT0_DC_BITS_PER_NAME) - 2, EXT0_DC_MAX_TABLE_BITS);
+
+    dc = kvzalloc(sizeof(*dc) + (sizeof(struct hlist_head) << table_bits), GFP_KERNEL);
+    if (!dc)
+        return;
+    dc->dc_bloom = kvzalloc(BITS_TO_LONGS(bloom_bits) * sizeof(long), GFP_KERNEL);
+    if (!dc->dc_bloom)
+    {
+        kvfree(dc);
+        return;
+    }
+    dc->dc_dir = dir;
+    dc->dc_bloom_bits = ilog2(bloom_bits);
+    dc->dc_table_bits = table_bits;
+
+    if (ext0_dir_iterate(dir, ext0_dc_fill, dc))
+    {
+        ext0_dc_free(dc);
+        return;
+    }
+
+    spin_lock(&in_mem_inode->i_dir_cache_lock);
+    if (in_mem_inode->i_dir_cache)
+    {
+        /* A parallel lookup got there first */
+        spin_unlock(&in_mem_inode->i_dir_cache_lock);
+        ext0_dc_free(dc);
+        return;
+    }
+    in_mem_inode->i_dir_cache = dc;
+    spin_lock(&ext0_dc_lru_lock);
+    list_add(&dc->dc_lru, &ext0_dc_lru);
+    ext0_dc_count++;
+    spin_unlock(&ext0_dc_lru_lock);
+    spin_unlock(&in_mem_inode->i_dir_cache_lock);
+}
+
+/* Look @name up in the cache of @dir, building it if there is none. Returns
+ * 1 if the cache knows the answer(*ino is 0 for a name that isn't there),
+ * 0 if the directory has to be searched
+ */
+int ext0_dc_lookup(struct inode *dir, const struct qstr *name, ino_t *ino)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(dir);
+    u32 hash = ext0_dirhash((const char *)name->name, name->len);
+    struct ext0_dir_cache *dc;
+    struct ext0_dc_name *dn;
+    int ret = 0;
+
+    /* A single block directory is searched as fast as the cache is built */
+    if (!ext0_dir_indexed(dir))
+        return 0;
+
+    if (!READ_ONCE(in_mem_inode->i_dir_cache))
+        ext0_dc_build(dir);
+
+    spin_lock(&in_mem_inode->i_dir_cache_lock);
+    dc = in_mem_inode->i_dir_cache;
+    if (dc)
+    {
+        dc->dc_referenced = 1;
+        dn = ext0_dc_find(dc, name, hash);
+        if (dn)
+        {
+            *ino = dn->dn_ino;
+            ret = 1;
+        }
+        else if (!ext0_dc_bloom_test(dc, (const char *)name->name, name->len, hash))
+        {
+            *ino = 0;
+            ret = 1;
+        }
+    }
+    spin_unlock(&in_mem_inode->i_dir_cache_lock);
+    return ret;
+}
+
+/* Remember @name -> @ino. @added is set for names new to the directory, the
+ * rest were found on disk after the filter let them through
+ */
+void ext0_dc_insert(struct inode *dir, const struct qstr *name, ino_t ino, int added)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(dir);
+    u32 hash = ext0_dirhash((const char *)name->name, name->len);
+    struct ext0_dir_cache *dc, *drop = NULL;
+    struct ext0_dc_name *dn;
+
+    if (!READ_ONCE(in_mem_inode->i_dir_cache))
+        return;
+
+    /* Without a table entry the name is simply looked up on disk, but a new
+     * name must still go in the filter or it would be reported missing
+     */
+    dn = kmalloc(sizeof(*dn) + name->len, GFP_NOFS);
+    if (dn)
+    {
+        dn->dn_hash = hash;
+        dn->dn_ino = ino;
+        dn->dn_len = name->len;
+        memcpy(dn->dn_name, name->name, name->len);
+    }
+    else if (!added)
+        return;
+
+    spin_lock(&in_mem_inode->i_dir_cache_lock);
+    dc = in_mem_inode->i_dir_cache;
+    if (!dc || ext0_dc_find(dc, name, hash))
+        goto out_free;
+
+    if (added)
+    {
+        if (++dc->dc_names > (1UL << dc->dc_bloom_bits) / EXT0_DC_BITS_PER_NAME)
+        {
+            drop = ext0_dc_detach(dir);
+            goto out_free;
+        }
+        ext0_dc_bloom_add(dc, (const char *)name->name, name->len, hash);
+    }
+    if (dn)
+        hlist_add_head(&dn->dn_node, &dc->dc_table[hash_32(hash, dc->dc_table_bits)]);
+    spin_unlock(&in_mem_inode->i_dir_cache_lock);
+    return;
+
+out_free:
+    spin_unlock(&in_mem_inode->i_dir_cache_lock);
+    kfree(dn);
+    if (drop)
+        ext0_dc_free(drop);
+}
+
+void ext0_dc_remove(struct inode *dir, const struct qstr *name)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(dir);
+    u32 hash = ext0_dirhash((const char *)name->name, name->len);
+    struct ext0_dir_cache *dc, *drop = NULL;
+    struct ext0_dc_name *dn = NULL;
+
+    if (!READ_ONCE(in_mem_inode->i_dir_cache))
+        return;
+
+    spin_lock(&in_mem_inode->i_dir_cache_lock);
+    dc = in_mem_inode->i_dir_cache;
+    if (dc)
+    {
+        dn = ext0_dc_find(dc, name, hash);
+        if (dn)
+            hlist_del(&dn->dn_node);
+        if (++dc->dc_stale * 4 > dc->dc_names)
+            drop = ext0_dc_detach(dir);
+    }
+    spin_unlock(&in_mem_inode->i_dir_cache_lock);
+
+    kfree(dn);
+    if (drop)
+        ext0_dc_free(drop);
+}
+
+/* Called when @dir is evicted */
+void ext0_dc_drop(struct inode *dir)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(dir);
+    struct ext0_dir_cache *dc;
+
+    if (!READ_ONCE(in_mem_inode->i_dir_cache))
+        return;
+
+    spin_lock(&in_mem_inode->i_dir_cache_lock);
+    dc = ext0_dc_detach(dir);
+    spin_unlock(&in_mem_inode->i_dir_cache_lock);
+    if (dc)
+        ext0_dc_free(dc);
+}
+
+static unsigned long ext0_dc_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    return READ_ONCE(ext0_dc_count);
+}
+
+/* Second chance: caches looked up since the last pass go back to the head.
+ * Lock order is i_dir_cache_lock then ext0_dc_lru_lock, hence the trylock
+ */
+static unsigned long ext0_dc_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    struct ext0_dir_cache *dc, *tmp;
+    unsigned long nr = sc->nr_to_scan, freed = 0;
+    LIST_HEAD(dispose);
+
+    spin_lock(&ext0_dc_lru_lock);
+    while (nr-- && !list_empty(&ext0_dc_lru))
+    {
+        struct ext0_inode_info *in_mem_inode;
+
+        dc = list_last_entry(&ext0_dc_lru, struct ext0_dir_cache, dc_lru);
+        in_mem_inode = EXT0_I(dc->dc_dir);
+        if (dc->dc_referenced || !spin_trylock(&in_mem_inode->i_dir_cache_lock))
+        {
+            dc->dc_referenced = 0;
+            list_move(&dc->dc_lru, &ext0_dc_lru);
+            continue;
+        }
+        in_mem_inode->i_dir_cache = NULL;
+        list_move(&dc->dc_lru, &dispose);
+        ext0_dc_count--;
+        spin_unlock(&in_mem_inode->i_dir_cache_lock);
+        freed++;
+    }
+    spin_unlock(&ext0_dc_lru_lock);
+
+    list_for_each_entry_safe(dc, tmp, &dispose, dc_lru)
+        ext0_dc_free(dc);
+    return freed;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *ext0_dc_shrinker;
+
+int __init ext0_dc_init(void)
+{
+    ext0_dc_shrinker = shrinker_alloc(0, "ext0-dircache");
+    if (!ext0_dc_shrinker)
+        return -ENOMEM;
+    ext0_dc_shrinker->count_objects = ext0_dc_shrink_count;
+    ext0_dc_shrinker->scan_objects = ext0_dc_shrink_scan;
+    shrinker_register(ext0_dc_shrinker);
+    return 0;
+}
+
+void ext0_dc_exit(void)
+{
+    shrinker_free(ext0_dc_shrinker);
+}
+#else
+static struct shrinker ext0_dc_shrinker = {
+    .count_objects = ext0_dc_shrink_count,
+    .scan_objects = ext0_dc_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+int __init ext0_dc_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(&ext0_dc_shrinker, "ext0-dircache");
+#else
+    return register_shrinker(&ext0_dc_shrinker);
+#endif
+}
+
+void ext0_dc_exit(void)
+{
+    unregister_shrinker(&ext0_dc_shrinker);
+}
+#endif
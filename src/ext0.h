@@ -1,200 +1,553 @@
-#ifndef _FS_EXT0_FS
-#define _FS_EXT0_FS
-
-#include <linux/fs.h>
-#include <linux/version.h>
-
-#ifdef __KERNEL__
-#include <linux/spinlock_types.h>
-#include <asm/types.h>
-#else
-#include <linux/byteorder/little_endian.h>
-
-/* These macros are unavailble from linux/fs.h in userspace */
-#define DT_UNKNOWN 0
-#define DT_FIFO 1
-#define DT_CHR 2
-#define DT_DIR 4
-#define DT_BLK 6
-#define DT_REG 8
-#define DT_LNK 10
-#define DT_SOCK 12
-#define DT_WHT 14
-
-#endif
-
-#define EXT0_ALIGNMENT 4
-#define EXT0_ALIGN_TO_SIZE(X) (((EXT0_ALIGNMENT - 1) + X) & ~(EXT0_ALIGNMENT - 1))
-#define EXT0_IS_ALIGNED(X) ((X & (EXT0_ALIGNMENT - 1)) == 0)
-
-#define EXT0_FS_MAGIC 0xEF53
-#define EXT0_FS_MAX_DIRECT_BLOCKS 12
-#define EXT0_FS_BLOCK_BITS 10
-#define EXT0_FS_MIN_BLOCK_SIZE (1 << EXT0_FS_BLOCK_BITS)
-#define EXT0_FS_MAX_BLOCK_SIZE (1 << (EXT0_FS_BLOCK_BITS + 3))
-#define EXT0_ROOT_INO 2
-#define EXT0_NAME_LEN 128
-#define EXT0_FS_OVERHEAD_BLOCKS 1        /* first block reserved for boot loader{how these things work} */
-#define EXT0_GROUP_OVERHEAD_BLOCKS_NUM 4 /* superblock -> block descriptor -> inode -> block bitmap */
-#define EXT0_MAX_GROUP 200 /* Default block group number */
-#define EXT0_INODE_BITMAP_SIZE 800 // (EXT0_FS_MIN_BLOCK_SIZE * 8)
-#define EXT0_IS_ERR(err) (err != 0)
-#define EXT0_STATE_NEW 0
-#define EXT0_SUPER_BLOCK 1
-#define EXT0_DIR_SIZE 8 /* Dir entry size without name length */
-#define EXT0_BLOCKS_IN_PAGE (PAGE_SIZE / EXT0_FS_MIN_BLOCK_SIZE)
-
-#define EXT0_MAKE_INO(ino) (ino + 1)
-#define EXT0_GET_INO(ino) (ino - 1)
-// #define EXT0_INODE_BLOCK(ino) (EXT0_GET_INO(ino) * EXT0_GROUP_OVERHEAD_BLOCKS_NUM - 1)
-
-#define DT_UNKNOWN 0
-
-#ifdef __KERNEL__
-#define EXT0_TO_LE32(c) cpu_to_le32(c)
-#define EXT0_TO_CPU(l) le32_to_cpu(l)
-#else
-#define EXT0_TO_LE32(c) __cpu_to_le32(c)
-#define EXT0_TO_CPU(l) __le32_to_cpu(l)
-#endif
-
-#define ext0_debug(f, a...)                             \
-    {                                                   \
-        printk(KERN_INFO "EXT0-fs DEBUG (%s, %d): %s:", \
-               __FILE__, __LINE__, __func__);           \
-        printk(KERN_INFO f, ##a);                       \
-    }
-
-struct ext0_block_descriptor
-{
-    __le32 bg_block_bitmap;
-    __le32 bg_first_block;
-    __le16 bg_free_blocks_count;
-};
-
-struct ext0_dir_entry
-{
-    __le32 inode;   /* Inode number */
-    __le16 rec_len; /* Directory entry length */
-    __u8 name_len;  /* Name length */
-    __u8 file_type;
-    char name[];
-};
-
-struct ext0_super_block
-{
-    __le32 s_inodes_count;
-    __le32 s_blocks_count;
-    __le32 s_blocks_per_group;
-    __le32 s_free_blocks_count;
-    __le32 s_free_inodes_count;
-    __le32 s_first_data_block;
-    __le32 s_inodes_per_group;
-    __le32 s_last_block;
-    __le32 s_groups_count;
-    __le32 s_mtime;
-    __le32 s_wtime;
-    __le16 s_inode_size;
-    __le16 s_block_group_nr;
-    __le16 s_magic;
-    __le16 s_state;
-    __u8 s_uuid[16];
-    char s_volume_name[16];
-    __u8 s_prealloc_blocks;
-    __u8 s_inode_bitmap[EXT0_INODE_BITMAP_SIZE];
-};
-
-struct ext0_inode
-{
-    __le32 i_size;
-    __le32 i_atime;
-    __le32 i_ctime;
-    __le32 i_mtime;
-    __le32 i_dtime;
-    __le32 i_blocks;
-    __le32 i_flags;
-    __le16 i_mode;
-    __le16 i_pad[1];
-    __le32 i_block[EXT0_FS_MAX_DIRECT_BLOCKS];
-};
-
-/* Returns inode logical block number starting at 1.
- * Subtract 1 from returned value to get group descriptor block number
-*/
-static inline unsigned ext0_inode_block(ino_t ino)
-{
-    int temp = EXT0_GET_INO(ino) <= 0 ? EXT0_GROUP_OVERHEAD_BLOCKS_NUM : ino * EXT0_GROUP_OVERHEAD_BLOCKS_NUM;
-    return (temp - 1) + EXT0_FS_OVERHEAD_BLOCKS;
-}
-
-#ifdef __KERNEL__
-
-struct ext0_super_block_info
-{
-    unsigned long s_inodes_per_block;
-    unsigned long s_blocks_per_group;
-    unsigned long s_inodes_per_group;
-    unsigned long s_desc_per_block;
-    unsigned long s_groups_count;
-    unsigned long s_last_block;
-    struct buffer_head *s_sbh;
-    struct buffer_head **s_group_desc;
-    spinlock_t s_lock;
-    struct ext0_super_block *s_es;
-    unsigned long s_mount_opt;
-    unsigned long s_sb_block;
-    unsigned short s_mount_state;
-};
-
-struct ext0_inode_info
-{
-    __u32 i_data[EXT0_FS_MAX_DIRECT_BLOCKS];
-    __u32 i_flags;
-    __u32 i_dtime;
-    __u32 i_block_group;
-    __u16 i_state;
-    struct inode vfs_inode;
-};
-
-static inline struct ext0_super_block_info *EXT0_SB(struct super_block *sb)
-{
-    return sb->s_fs_info;
-}
-
-static inline struct ext0_inode_info *EXT0_I(struct inode *inode)
-{
-    return container_of(inode, struct ext0_inode_info, vfs_inode);
-}
-
-extern int ext0_get_block(struct inode *inode, sector_t iblock,
-                          struct buffer_head *bh_result, int create);
-unsigned fs_to_dev_block_num(struct super_block *sb, unsigned blk_no, off_t *offset);
-
-int ext0_write_inode(struct inode *inode, struct writeback_control *wbc);
-void ext0_evict_inode(struct inode *inode);
-struct inode *ext0_iget(struct super_block *sb, ino_t ino);
-// int ext0_setattr(struct dentry *dentry, struct iattr *iattr);
-
-extern const struct inode_operations ext0_file_inode_operations;
-extern const struct file_operations ext0_file_operations;
-extern const struct address_space_operations ext0_aops;
-
-extern const struct inode_operations ext0_dir_inode_operations;
-extern const struct file_operations ext0_dir_operations;
-
-#define ext0_test_and_set_bit __test_and_set_bit_le
-#define ext0_test_and_clear_bit __test_and_clear_bit_le
-#define ext0_test_bit test_bit_le
-#define ext0_find_first_zero_bit find_first_zero_bit_le
-#define ext0_find_next_zero_bit find_next_zero_bit_le
-#else
-#define BITOP_LE_SWIZZLE 0
-
-static inline int __test_and_set_bit_le(int nr, void *addr)
-{
-	return 0;
-}
-#define ext0_test_and_set_bit __test_and_set_bit_le
-#endif
-
-#endif /* _FS_EXT0_FS */
\ No newline at end of file
+#ifndef _FS_EXT0_FS
+#define _FS_EXT0_FS
+
+#include <linux/fs.h>
+#include <linux/version.h>
+
+#ifdef __KERNEL__
+#include <linux/blockgroup_lock.h>
+#include <linux/llist.h>
+#include <linux/percpu_counter.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock_types.h>
+#include <linux/workqueue.h>
+#include <asm/types.h>
+#else
+#include <linux/byteorder/little_endian.h>
+
+/* These macros are unavailble from linux/fs.h in userspace */
+#define DT_UNKNOWN 0
+#define DT_FIFO 1
+#define DT_CHR 2
+#define DT_DIR 4
+#define DT_BLK 6
+#define DT_REG 8
+#define DT_LNK 10
+#define DT_SOCK 12
+#define DT_WHT 14
+
+#endif
+
+#define EXT0_ALIGNMENT 4
+#define EXT0_ALIGN_TO_SIZE(X) (((EXT0_ALIGNMENT - 1) + X) & ~(EXT0_ALIGNMENT - 1))
+#define EXT0_IS_ALIGNED(X) ((X & (EXT0_ALIGNMENT - 1)) == 0)
+
+#define EXT0_FS_MAGIC 0xEF53
+#define EXT0_FS_MAX_DIRECT_BLOCKS 12
+#define EXT0_FS_BLOCK_BITS 10
+#define EXT0_FS_MIN_BLOCK_SIZE (1 << EXT0_FS_BLOCK_BITS)
+#define EXT0_FS_MAX_LOG_BLOCK_SIZE 2 /* Block size is EXT0_FS_MIN_BLOCK_SIZE << s_log_block_size, up to 4K */
+#define EXT0_FS_MAX_BLOCK_SIZE (EXT0_FS_MIN_BLOCK_SIZE << EXT0_FS_MAX_LOG_BLOCK_SIZE)
+#define EXT0_FS_DEF_BLOCK_SIZE EXT0_FS_MAX_BLOCK_SIZE
+#define EXT0_SUPER_BLOCK_OFFSET 1024 /* Byte offset of the primary superblock, whatever the block size */
+#define EXT0_ROOT_INO 2
+#define EXT0_NAME_LEN 128
+#define EXT0_FS_OVERHEAD_BLOCKS 1        /* first block reserved for boot loader{how these things work} */
+#define EXT0_GROUP_OVERHEAD_BLOCKS_NUM 4 /* superblock -> block descriptor -> block bitmap -> inode bitmap, then the inode table */
+#define EXT0_MAX_BLOCKS_PER_GROUP(blocksize) (8 * (blocksize)) /* As many as one bitmap block can track */
+#define EXT0_MAX_INODES_PER_GROUP(blocksize) (8 * (blocksize))
+#define EXT0_DEF_BLOCKS_PER_INODE 16 /* Default inodes per group is blocks per group / this */
+#define EXT0_MAX_GROUP 200 /* Default block group number */
+#define EXT0_DEF_INODE_READAHEAD_BLKS 32 /* Inode table blocks one readdir call may prefetch, see inode_readahead_blks= */
+#define EXT0_IS_ERR(err) (err != 0)
+#define EXT0_STATE_NEW 0
+#define EXT0_STATE_NLINK_UNKNOWN 0x01 /* Read without a link count, never freed on unlink */
+#define EXT0_DIR_SIZE 8 /* Dir entry size without name length */
+#define EXT0_DIR_REC_LEN(name_len) EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + (name_len))
+#define EXT0_DT(mode) (((mode) & S_IFMT) >> 12) /* Directory entry file_type of an inode mode */
+#define EXT0_BLOCKS_IN_PAGE (PAGE_SIZE / EXT0_FS_MIN_BLOCK_SIZE)
+#define EXT0_N_BLOCKS EXT0_FS_MAX_DIRECT_BLOCKS /* Size of i_block, in __le32 words */
+
+#define EXT0_EXT_MAGIC 0xF30A
+#define EXT0_EXT_MAX_DEPTH 5
+#define EXT0_EXT_MAX_LEN (1 << 15) /* Longest run a single extent may describe */
+#define EXT0_EXT_ROOT_MAX ((EXT0_N_BLOCKS * sizeof(__le32) - sizeof(struct ext0_extent_header)) / sizeof(struct ext0_extent))
+
+#define EXT0_INDEX_FL 0x00001000 /* Directory has a hashed index, i_flags */
+#define EXT0_DIRENT_HASH_FL 0x00020000 /* Directory entries carry their name hash, i_flags */
+#define EXT0_DX_HASH_FNV 1        /* dx_root_info.hash_version */
+#define EXT0_DX_MAX_LEVELS 2      /* Root plus one level of index nodes */
+
+#define EXT0_MAKE_INO(ino) (ino + 1)
+#define EXT0_GET_INO(ino) (ino - 1)
+// #define EXT0_INODE_BLOCK(ino) (EXT0_GET_INO(ino) * EXT0_GROUP_OVERHEAD_BLOCKS_NUM - 1)
+
+#define DT_UNKNOWN 0
+
+#ifdef __KERNEL__
+#define EXT0_TO_LE32(c) cpu_to_le32(c)
+#define EXT0_TO_LE16(c) cpu_to_le16(c)
+#define EXT0_TO_CPU(l) le32_to_cpu(l)
+#else
+#define EXT0_TO_LE32(c) __cpu_to_le32(c)
+#define EXT0_TO_LE16(c) __cpu_to_le16(c)
+#define EXT0_TO_CPU(l) __le32_to_cpu(l)
+#endif
+
+#define ext0_debug(f, a...)                             \
+    {                                                   \
+        printk(KERN_INFO "EXT0-fs DEBUG (%s, %d): %s:", \
+               __FILE__, __LINE__, __func__);           \
+        printk(KERN_INFO f, ##a);                       \
+    }
+
+struct ext0_block_descriptor
+{
+    __le32 bg_block_bitmap;
+    __le32 bg_first_block;
+    __le16 bg_free_blocks_count;
+    __le16 bg_free_inodes_count;
+    __le32 bg_inode_table; /* First block of the group's inode table */
+    __le32 bg_inode_bitmap;
+};
+
+struct ext0_dir_entry
+{
+    __le32 inode;   /* Inode number */
+    __le16 rec_len; /* Directory entry length */
+    __u8 name_len;  /* Name length */
+    __u8 file_type;
+    char name[];
+};
+
+/*
+ * In directories flagged EXT0_DIRENT_HASH_FL every entry(including "." and
+ * "..") carries the hash of its name, little endian, in the word after the
+ * padded name. Lookups compare that word before touching the name. Other
+ * directories use the original layout without it.
+ */
+#define EXT0_DIR_HASH(de) ((__le32 *)((char *)(de) + EXT0_DIR_REC_LEN((de)->name_len)))
+
+/* 32-bit FNV-1a of a name. It is stored on disk(in the index and in hashed
+ * entries), a different function needs a new hash_version. The low bit is
+ * cleared, index entries use it
+ */
+static inline __u32 ext0_dirhash(const char *name, int len)
+{
+    __u32 hash = 2166136261u;
+
+    while (len--)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619;
+    }
+    return hash & ~1;
+}
+
+/*
+ * Hashed directory index(htree). A directory that outgrows its first block
+ * turns that block into the index root. "." and ".." stay in front as
+ * ordinary entries, ".." spanning the rest of the block, so the index is
+ * invisible to a linear scan. The root info follows "." and "..", and the
+ * root's index entries follow the info. Index entries map the lowest name hash of a
+ * leaf block to that block, sorted by hash. The count and limit of a node
+ * overlay the hash of its first entry, which is implicitly 0. Interior
+ * nodes start with an empty entry spanning the whole block.
+ */
+struct ext0_fake_dirent
+{
+    __le32 inode;
+    __le16 rec_len;
+    __u8 name_len;
+    __u8 file_type;
+};
+
+struct ext0_dx_entry
+{
+    __le32 hash; /* Low bit set: the leaf continues the hash run of the one before it */
+    __le32 block; /* Logical block in the directory */
+};
+
+struct ext0_dx_countlimit
+{
+    __le16 limit;
+    __le16 count;
+};
+
+struct ext0_dx_root_info
+{
+    __le32 reserved_zero;
+    __u8 hash_version;
+    __u8 info_length; /* sizeof(struct ext0_dx_root_info) */
+    __u8 indirect_levels; /* Index levels below the root */
+    __u8 unused_flags;
+};
+
+struct ext0_dx_node
+{
+    struct ext0_fake_dirent fake;
+    struct ext0_dx_entry entries[];
+};
+
+/*
+ * Extent tree. The root lives in ext0_inode.i_block and holds up to
+ * EXT0_EXT_ROOT_MAX entries. When it fills up, its contents move into an
+ * index block and the root becomes a single index entry(one level deeper).
+ * Leaves(eh_depth == 0) hold ext0_extent records, every other level holds
+ * ext0_extent_idx records. Both are sorted by logical block.
+ */
+struct ext0_extent_header
+{
+    __le16 eh_magic;
+    __le16 eh_entries; /* Number of valid entries */
+    __le16 eh_max;     /* Capacity of this node */
+    __le16 eh_depth;   /* 0 for leaves */
+};
+
+struct ext0_extent
+{
+    __le32 ee_block; /* First logical block */
+    __le32 ee_start; /* First physical block */
+    __le16 ee_len;   /* Number of blocks */
+    __le16 ee_flags;
+};
+
+/* ee_flags. Unwritten extents(from fallocate) own their blocks but read as
+ * zeros, the blocks turn written when data first goes to them
+ */
+#define EXT0_EXT_UNWRITTEN 0x0001
+
+struct ext0_extent_idx
+{
+    __le32 ei_block; /* Index covers logical blocks from here on */
+    __le32 ei_leaf;  /* Physical block of the next level */
+    __le32 ei_pad;
+};
+
+#define EXT0_FIRST_EXTENT(hdr) ((struct ext0_extent *)((char *)(hdr) + sizeof(struct ext0_extent_header)))
+#define EXT0_FIRST_INDEX(hdr) ((struct ext0_extent_idx *)((char *)(hdr) + sizeof(struct ext0_extent_header)))
+
+struct ext0_super_block
+{
+    __le32 s_inodes_count;
+    __le32 s_blocks_count;
+    __le32 s_blocks_per_group;
+    __le32 s_free_blocks_count;
+    __le32 s_free_inodes_count;
+    __le32 s_first_data_block;
+    __le32 s_inodes_per_group;
+    __le32 s_last_block;
+    __le32 s_groups_count;
+    __le32 s_mtime;
+    __le32 s_wtime;
+    __le32 s_log_block_size;
+    __le16 s_inode_size;
+    __le16 s_block_group_nr;
+    __le16 s_magic;
+    __le16 s_state;
+    __u8 s_uuid[16];
+    char s_volume_name[16];
+    __u8 s_prealloc_blocks;
+};
+
+struct ext0_inode
+{
+    __le32 i_size;
+    __le32 i_atime;
+    __le32 i_ctime;
+    __le32 i_mtime;
+    __le32 i_dtime;
+    __le32 i_blocks;
+    __le32 i_flags;
+    __le16 i_mode;
+    __le16 i_links_count; /* 0 in images from before it was kept, see ext0_iget */
+    __le32 i_block[EXT0_N_BLOCKS]; /* Extent tree root */
+};
+
+/* EXT0_IOC_BULKSTAT: attributes of the allocated inodes from br_ino on, in
+ * inode number order. br_ino comes back as the inode to start the next
+ * call from and br_count as the number of records filled in. Needs
+ * CAP_SYS_ADMIN
+ */
+struct ext0_bstat
+{
+    __u64 bs_ino;
+    __u64 bs_size;
+    __u64 bs_blocks; /* In 512 byte units */
+    __s64 bs_atime;
+    __s64 bs_mtime;
+    __s64 bs_ctime;
+    __u32 bs_mode;
+    __u32 bs_flags;
+};
+
+struct ext0_bulkstat_req
+{
+    __u64 br_ino;
+    __u64 br_buffer; /* Userspace array of br_count struct ext0_bstat */
+    __u32 br_count;
+    __u32 br_pad;
+};
+
+#define EXT0_IOC_BULKSTAT _IOWR('E', 1, struct ext0_bulkstat_req)
+
+/* Blocks taken by an inode table of @inodes_per_group inodes. Inodes never
+ * straddle a block boundary
+ */
+static inline unsigned long ext0_itable_blocks(unsigned long inodes_per_group, unsigned inode_size, unsigned long blocksize)
+{
+    unsigned long per_block = blocksize / inode_size;
+    return (inodes_per_group + per_block - 1) / per_block;
+}
+
+/* Returns the(zero based) first block of @group, which holds its copy of the
+ * superblock. Group 0 starts at s_first_data_block: block 1 with 1K blocks,
+ * block 0 otherwise(the superblock then sits at EXT0_SUPER_BLOCK_OFFSET in it)
+ */
+static inline unsigned long ext0_group_first_block(unsigned long group, unsigned long blocks_per_group,
+                                                   unsigned long first_data_block)
+{
+    return group * blocks_per_group + first_data_block;
+}
+
+/* Returns the(zero based) block holding the descriptor of @group */
+static inline unsigned long ext0_group_desc_block(unsigned long group, unsigned long blocks_per_group,
+                                                  unsigned long first_data_block)
+{
+    return ext0_group_first_block(group, blocks_per_group, first_data_block) + 1;
+}
+
+#ifdef __KERNEL__
+
+/* In-memory per-group allocation state */
+struct ext0_group_info
+{
+    unsigned long gi_next_ino; /* Where the next inode search in the group starts */
+};
+
+struct ext0_super_block_info
+{
+    unsigned long s_inodes_per_block;
+    unsigned long s_blocks_per_group;
+    unsigned long s_inodes_per_group;
+    unsigned long s_itb_per_group; /* Inode table blocks per group */
+    unsigned long s_inode_size;
+    unsigned long s_desc_per_block;
+    unsigned long s_groups_count;
+    unsigned long s_last_block;
+    unsigned long s_first_data_block;
+    unsigned long s_blocks_count;
+    struct buffer_head *s_sbh;
+    struct buffer_head **s_group_desc;
+    struct blockgroup_lock *s_blockgroup_lock; /* Protects the group bitmaps and descriptor counters */
+    struct ext0_group_info *s_group_info;
+    unsigned int __percpu *s_dir_rotor; /* Next group for a new directory, per CPU */
+    struct percpu_counter s_freeblocks_counter;
+    struct percpu_counter s_freeinodes_counter;
+    struct ext0_super_block *s_es;
+    struct super_block *s_sb;
+    struct workqueue_struct *s_reclaim_wq; /* Frees deleted inodes, see inode.c */
+    struct work_struct s_reclaim_work;
+    struct llist_head s_reclaim_list;
+    atomic_t s_reclaim_pending; /* Queued and not freed yet */
+    struct workqueue_struct *s_ioend_wq; /* Completes writeback over unwritten extents, see inode.c */
+    struct work_struct s_ioend_work;
+    spinlock_t s_ioend_lock;
+    struct list_head s_ioend_list;
+    unsigned long s_mount_opt;
+    unsigned long s_inode_readahead_blks;
+    unsigned long s_sb_block;
+    unsigned short s_mount_state;
+};
+
+/* Result of a logical to physical block lookup */
+struct ext0_map_blocks
+{
+    sector_t m_lblk;     /* First logical block */
+    unsigned long m_pblk; /* First physical block */
+    unsigned m_len;       /* In: blocks wanted. Out: blocks mapped(or size of the hole) */
+    unsigned m_flags;
+};
+
+#define EXT0_MAP_MAPPED 0x01
+#define EXT0_MAP_NEW 0x02 /* Blocks were allocated(or turned written) by this call */
+#define EXT0_MAP_UNWRITTEN 0x04 /* Blocks are allocated but read as zeros */
+
+/* ext0_ext_map_blocks flags */
+#define EXT0_GET_BLOCKS_CREATE 0x01 /* Allocate blocks for holes */
+#define EXT0_GET_BLOCKS_NOWAIT 0x02 /* Fail with -EAGAIN instead of blocking */
+#define EXT0_GET_BLOCKS_UNWRITTEN 0x04 /* With CREATE: allocate holes as unwritten extents */
+#define EXT0_GET_BLOCKS_CONVERT 0x08 /* With CREATE: turn unwritten blocks written now */
+
+/* Last extent looked up or allocated, an ec_len of 0 means empty */
+struct ext0_ext_cache
+{
+    __u32 ec_block;
+    __u32 ec_start;
+    __u32 ec_len;
+};
+
+struct ext0_dir_cache;
+
+struct ext0_inode_info
+{
+    __le32 i_data[EXT0_N_BLOCKS]; /* On-disk extent tree root, kept little endian */
+    struct rw_semaphore i_data_sem; /* Protects the extent tree */
+    seqlock_t i_ext_lock;           /* Protects i_cached_ext, readers go lock-free */
+    struct ext0_ext_cache i_cached_ext;
+    struct ext0_dir_cache *i_dir_cache; /* In-memory name index of a directory, may be NULL */
+    spinlock_t i_dir_cache_lock;
+    __u16 *i_dir_free; /* Room left in each directory block, see dir.c */
+    unsigned long i_dir_nr_free;
+    __u32 i_flags;
+    __u32 i_dtime;
+    __u32 i_block_group;
+    __u16 i_state;
+    struct inode vfs_inode;
+};
+
+static inline struct ext0_super_block_info *EXT0_SB(struct super_block *sb)
+{
+    return sb->s_fs_info;
+}
+
+static inline struct ext0_inode_info *EXT0_I(struct inode *inode)
+{
+    return container_of(inode, struct ext0_inode_info, vfs_inode);
+}
+
+static inline spinlock_t *ext0_group_lock_ptr(struct ext0_super_block_info *in_mem_sb, unsigned long group)
+{
+    return bgl_lock_ptr(in_mem_sb->s_blockgroup_lock, group);
+}
+
+/* Blocks in directory @dir. Older images sized directories in bytes written */
+static inline unsigned long ext0_dir_blocks(struct inode *dir)
+{
+    return (dir->i_size + dir->i_sb->s_blocksize - 1) >> dir->i_sb->s_blocksize_bits;
+}
+
+static inline int ext0_dir_indexed(struct inode *dir)
+{
+    return EXT0_I(dir)->i_flags & EXT0_INDEX_FL;
+}
+
+static inline int ext0_dir_hashed(struct inode *dir)
+{
+    return EXT0_I(dir)->i_flags & EXT0_DIRENT_HASH_FL;
+}
+
+/* Space an entry for a @name_len long name takes up in @dir */
+static inline unsigned ext0_rec_len(struct inode *dir, unsigned name_len)
+{
+    return EXT0_DIR_REC_LEN(name_len) + (ext0_dir_hashed(dir) ? sizeof(__le32) : 0);
+}
+
+/* Name hash of a live entry, stored or computed */
+static inline u32 ext0_de_hash(struct inode *dir, struct ext0_dir_entry *de)
+{
+    if (ext0_dir_hashed(dir))
+        return le32_to_cpu(*EXT0_DIR_HASH(de));
+    return ext0_dirhash(de->name, de->name_len);
+}
+
+static inline unsigned long ext0_inode_group(struct super_block *sb, ino_t ino)
+{
+    return EXT0_GET_INO(ino) / EXT0_SB(sb)->s_inodes_per_group;
+}
+
+extern int ext0_get_block(struct inode *inode, sector_t iblock,
+                          struct buffer_head *bh_result, int create);
+struct ext0_block_descriptor *ext0_get_group_desc(struct super_block *sb, unsigned long group, struct buffer_head **bhp);
+
+/* balloc.c */
+unsigned long ext0_inode_goal(struct inode *inode);
+unsigned long ext0_new_blocks(struct inode *inode, unsigned long goal, unsigned long *count, int *err);
+void ext0_free_blocks(struct super_block *sb, unsigned long block, unsigned long count);
+
+/* ialloc.c */
+ino_t ext0_new_ino(struct inode *dir, umode_t mode, int *err);
+void ext0_free_ino(struct super_block *sb, ino_t ino);
+int ext0_inode_block_unused(struct super_block *sb, ino_t ino);
+
+/* dir.c */
+struct buffer_head *ext0_dir_bread(struct inode *dir, unsigned long block, int *err);
+struct buffer_head *ext0_dir_append(struct inode *dir, unsigned long *block, int *err);
+struct ext0_dir_entry *ext0_dir_find_in_block(struct inode *dir, struct buffer_head *bh, const struct qstr *name, u32 hash);
+int ext0_dir_iterate(struct inode *dir, int (*actor)(void *priv, struct ext0_dir_entry *de), void *priv);
+int ext0_dir_insert_in_block(struct inode *dir, struct buffer_head *bh, unsigned long block, const struct qstr *name, ino_t ino,
+                             umode_t mode);
+unsigned ext0_dir_coalesce(struct inode *dir, char *base);
+void ext0_dir_set_free(struct inode *dir, unsigned long block, unsigned free);
+void ext0_dir_forget_free(struct inode *dir);
+
+/* ioctl.c */
+long ext0_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+/* dircache.c */
+int ext0_dc_lookup(struct inode *dir, const struct qstr *name, ino_t *ino);
+void ext0_dc_insert(struct inode *dir, const struct qstr *name, ino_t ino, int added);
+void ext0_dc_remove(struct inode *dir, const struct qstr *name);
+void ext0_dc_drop(struct inode *dir);
+int ext0_dc_init(void);
+void ext0_dc_exit(void);
+
+/* htree.c */
+struct buffer_head *ext0_dx_find_entry(struct inode *dir, const struct qstr *name, u32 hash, struct ext0_dir_entry **res_dir,
+                                       unsigned long *res_block, int *err);
+int ext0_dx_add_entry(struct inode *dir, const struct qstr *name, ino_t ino, umode_t mode);
+int ext0_dx_make_indexed(struct inode *dir, struct buffer_head *bh);
+
+/* extents.c */
+void ext0_ext_tree_init(struct inode *inode);
+int ext0_ext_map_blocks(struct inode *inode, struct ext0_map_blocks *map, int flags);
+int ext0_ext_convert_range(struct inode *inode, sector_t start, sector_t end);
+int ext0_ext_punch(struct inode *inode, sector_t start, sector_t end);
+void ext0_ext_free_root(struct super_block *sb, ino_t ino, __le32 *root, int forget);
+
+int ext0_inode_block(struct super_block *sb, ino_t ino, unsigned long *block, unsigned *offset);
+int ext0_reclaim_init(struct super_block *sb);
+int ext0_reclaim_flush(struct super_block *sb);
+void ext0_reclaim_exit(struct ext0_super_block_info *in_mem_sb);
+int ext0_ioend_init(struct super_block *sb);
+void ext0_ioend_exit(struct ext0_super_block_info *in_mem_sb);
+void ext0_set_aops(struct inode *inode);
+int ext0_write_inode(struct inode *inode, struct writeback_control *wbc);
+void ext0_evict_inode(struct inode *inode);
+struct inode *ext0_iget(struct super_block *sb, ino_t ino);
+// int ext0_setattr(struct dentry *dentry, struct iattr *iattr);
+
+extern const struct inode_operations ext0_file_inode_operations;
+extern const struct file_operations ext0_file_operations;
+extern const struct address_space_operations ext0_aops;
+
+/* Regular file data goes through iomap where the folio based iomap API is
+ * there. ext0_aops(buffer heads) serves symlinks, and everything on older
+ * kernels
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+#define EXT0_IOMAP
+extern const struct iomap_ops ext0_iomap_ops;
+extern const struct address_space_operations ext0_iomap_aops;
+#define ext0_file_aops ext0_iomap_aops
+#else
+#define ext0_file_aops ext0_aops
+#endif
+
+extern const struct inode_operations ext0_dir_inode_operations;
+extern const struct file_operations ext0_dir_operations;
+
+#define ext0_test_and_set_bit __test_and_set_bit_le
+#define ext0_test_and_clear_bit __test_and_clear_bit_le
+#define ext0_test_bit test_bit_le
+#define ext0_find_first_zero_bit find_first_zero_bit_le
+#define ext0_find_next_zero_bit find_next_zero_bit_le
+#define ext0_find_next_bit find_next_bit_le
+#define ext0_set_bit __set_bit_le
+#define ext0_test_and_set_bit_atomic test_and_set_bit_le
+#define ext0_test_and_clear_bit_atomic test_and_clear_bit_le
+#else
+#define BITOP_LE_SWIZZLE 0
+
+static inline int __test_and_set_bit_le(int nr, void *addr)
+{
+	unsigned char *p = (unsigned char *)addr + (nr >> 3);
+	int old = (*p >> (nr & 7)) & 1;
+
+	*p |= 1 << (nr & 7);
+	return old;
+}
+#define ext0_test_and_set_bit __test_and_set_bit_le
+#endif
+
+#endif /* _FS_EXT0_FS */
@@ -0,0 +1,938 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+
+#include "ext0.h"
+
+#define EXT0_EXT_MAX_LBLK 0xFFFFFFFFUL
+
+struct ext0_ext_path
+{
+    unsigned long p_block; /* Physical block of this node. 0 for the in-inode root */
+    struct buffer_head *p_bh;
+    struct ext0_extent_header *p_hdr;
+    struct ext0_extent_idx *p_idx; /* Index followed from this node */
+    struct ext0_extent *p_ext;     /* Closest extent at or before the block looked up */
+};
+
+#define EXT0_LAST_EXTENT(hdr) (EXT0_FIRST_EXTENT(hdr) + le16_to_cpu((hdr)->eh_entries) - 1)
+#define EXT0_LAST_INDEX(hdr) (EXT0_FIRST_INDEX(hdr) + le16_to_cpu((hdr)->eh_entries) - 1)
+#define EXT0_HAS_FREE_SLOT(hdr) (le16_to_cpu((hdr)->eh_entries) < le16_to_cpu((hdr)->eh_max))
+
+static inline struct ext0_extent_header *ext_inode_hdr(struct inode *inode)
+{
+    return (struct ext0_extent_header *)EXT0_I(inode)->i_data;
+}
+
+static inline unsigned ext0_ext_space_block(struct inode *inode)
+{
+    return (inode->i_sb->s_blocksize - sizeof(struct ext0_extent_header)) / sizeof(struct ext0_extent);
+}
+
+/*
+ * Extent cache. Block mapping reads go to i_cached_ext first, under the
+ * read side of i_ext_lock only, and fall back to walking the tree under
+ * i_data_sem. Only written extents are cached. Extents are added, grown or
+ * turned written without their blocks moving, so a cached mapping stays
+ * valid until a punch(which empties the cache) or the tree is thrown away.
+ */
+static void ext0_ext_cache_set(struct inode *inode, unsigned long block, unsigned long start, unsigned len)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(inode);
+
+    write_seqlock(&in_mem_inode->i_ext_lock);
+    in_mem_inode->i_cached_ext.ec_block = block;
+    in_mem_inode->i_cached_ext.ec_start = start;
+    in_mem_inode->i_cached_ext.ec_len = len;
+    write_sequnlock(&in_mem_inode->i_ext_lock);
+}
+
+static int ext0_ext_cache_lookup(struct inode *inode, struct ext0_map_blocks *map)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(inode);
+    struct ext0_ext_cache ec;
+    unsigned seq;
+
+    do
+    {
+        seq = read_seqbegin(&in_mem_inode->i_ext_lock);
+        ec = in_mem_inode->i_cached_ext;
+    } while (read_seqretry(&in_mem_inode->i_ext_lock, seq));
+
+    if (!ec.ec_len || map->m_lblk < ec.ec_block || map->m_lblk >= (sector_t)ec.ec_block + ec.ec_len)
+        return 0;
+
+    map->m_pblk = ec.ec_start + (map->m_lblk - ec.ec_block);
+    map->m_len = min_t(unsigned, map->m_len, ec.ec_block + ec.ec_len - map->m_lblk);
+    map->m_flags = EXT0_MAP_MAPPED;
+    return map->m_len;
+}
+
+void ext0_ext_tree_init(struct inode *inode)
+{
+    struct ext0_extent_header *eh = ext_inode_hdr(inode);
+
+    ext0_ext_cache_set(inode, 0, 0, 0);
+
+    memset(EXT0_I(inode)->i_data, 0, sizeof(EXT0_I(inode)->i_data));
+    eh->eh_magic = cpu_to_le16(EXT0_EXT_MAGIC);
+    eh->eh_entries = 0;
+    eh->eh_max = cpu_to_le16(EXT0_EXT_ROOT_MAX);
+    eh->eh_depth = 0;
+}
+
+static int ext0_ext_check(ino_t ino, struct ext0_extent_header *eh, int depth)
+{
+    if (le16_to_cpu(eh->eh_magic) != EXT0_EXT_MAGIC ||
+        le16_to_cpu(eh->eh_depth) != depth ||
+        le16_to_cpu(eh->eh_entries) > le16_to_cpu(eh->eh_max) ||
+        (depth && !eh->eh_entries))
+    {
+        ext0_debug("Corrupt extent node: inode=%lu depth=%i", (unsigned long)ino, depth);
+        return -EIO;
+    }
+    return 0;
+}
+
+static void ext0_ext_drop_path(struct ext0_ext_path *path, int depth)
+{
+    int i;
+
+    for (i = 0; i <= depth; i++)
+    {
+        if (path[i].p_bh)
+            brelse(path[i].p_bh);
+        path[i].p_bh = NULL;
+    }
+}
+
+/* Changes to a node go to its buffer, or to the inode for the root */
+static void ext0_ext_dirty(struct inode *inode, struct ext0_ext_path *p)
+{
+    if (p->p_bh)
+        mark_buffer_dirty_inode(p->p_bh, inode);
+    else
+        mark_inode_dirty(inode);
+}
+
+/* Last index whose ei_block <= block(or the first one) */
+static void ext0_ext_binsearch_idx(struct ext0_ext_path *p, sector_t block)
+{
+    struct ext0_extent_idx *l = EXT0_FIRST_INDEX(p->p_hdr) + 1;
+    struct ext0_extent_idx *r = EXT0_LAST_INDEX(p->p_hdr);
+    struct ext0_extent_idx *m;
+
+    while (l <= r)
+    {
+        m = l + (r - l) / 2;
+        if (block < le32_to_cpu(m->ei_block))
+            r = m - 1;
+        else
+            l = m + 1;
+    }
+    p->p_idx = l - 1;
+}
+
+/* Last extent whose ee_block <= block(or the first one). NULL on empty leaves */
+static void ext0_ext_binsearch(struct ext0_ext_path *p, sector_t block)
+{
+    struct ext0_extent *l = EXT0_FIRST_EXTENT(p->p_hdr) + 1;
+    struct ext0_extent *r = EXT0_LAST_EXTENT(p->p_hdr);
+    struct ext0_extent *m;
+
+    if (!p->p_hdr->eh_entries)
+    {
+        p->p_ext = NULL;
+        return;
+    }
+
+    while (l <= r)
+    {
+        m = l + (r - l) / 2;
+        if (block < le32_to_cpu(m->ee_block))
+            r = m - 1;
+        else
+            l = m + 1;
+    }
+    p->p_ext = l - 1;
+}
+
+/* Walk from the root down to the leaf that covers @block. Returns the
+ * depth of the tree, buffers held in @path must be released with
+ * ext0_ext_drop_path()
+ */
+static int ext0_ext_find_extent(struct inode *inode, sector_t block, struct ext0_ext_path *path)
+{
+    struct ext0_extent_header *eh = ext_inode_hdr(inode);
+    int depth = le16_to_cpu(eh->eh_depth);
+    int i, ret;
+
+    if (depth > EXT0_EXT_MAX_DEPTH)
+    {
+        ext0_debug("Extent tree too deep: inode=%lu depth=%i", inode->i_ino, depth);
+        return -EIO;
+    }
+
+    memset(path, 0, sizeof(struct ext0_ext_path) * (depth + 1));
+    ret = ext0_ext_check(inode->i_ino, eh, depth);
+    if (EXT0_IS_ERR(ret))
+        return ret;
+
+    path[0].p_hdr = eh;
+    for (i = 0; i < depth; i++)
+    {
+        struct buffer_head *bh;
+
+        ext0_ext_binsearch_idx(&path[i], block);
+        path[i + 1].p_block = le32_to_cpu(path[i].p_idx->ei_leaf);
+
+        bh = sb_bread(inode->i_sb, path[i + 1].p_block);
+        if (!bh)
+        {
+            ext0_debug("Could not perform I/O for extent block: %lu", path[i + 1].p_block);
+            ext0_ext_drop_path(path, i);
+            return -EIO;
+        }
+        path[i + 1].p_bh = bh;
+        path[i + 1].p_hdr = (struct ext0_extent_header *)bh->b_data;
+
+        ret = ext0_ext_check(inode->i_ino, path[i + 1].p_hdr, depth - i - 1);
+        if (EXT0_IS_ERR(ret))
+        {
+            ext0_ext_drop_path(path, i + 1);
+            return ret;
+        }
+    }
+
+    ext0_ext_binsearch(&path[depth], block);
+    return depth;
+}
+
+/* First logical block after @block that is already mapped */
+static sector_t ext0_ext_next_allocated_block(struct ext0_ext_path *path, int depth, sector_t block)
+{
+    struct ext0_ext_path *p = &path[depth];
+
+    if (p->p_ext)
+    {
+        if (block < le32_to_cpu(p->p_ext->ee_block))
+            return le32_to_cpu(p->p_ext->ee_block);
+        if (p->p_ext != EXT0_LAST_EXTENT(p->p_hdr))
+            return le32_to_cpu(p->p_ext[1].ee_block);
+    }
+
+    while (--depth >= 0)
+    {
+        if (path[depth].p_idx != EXT0_LAST_INDEX(path[depth].p_hdr))
+            return le32_to_cpu(path[depth].p_idx[1].ei_block);
+    }
+    return EXT0_EXT_MAX_LBLK;
+}
+
+/* Pick a physical block close to the neighbouring data of @block */
+static unsigned long ext0_ext_find_goal(struct inode *inode, struct ext0_ext_path *path, int depth, sector_t block)
+{
+    struct ext0_extent *ex = path[depth].p_ext;
+
+    if (ex)
+    {
+        unsigned long ee_block = le32_to_cpu(ex->ee_block);
+        unsigned long ee_start = le32_to_cpu(ex->ee_start);
+
+        if (block > ee_block)
+            return ee_start + (block - ee_block);
+        if (ee_start > ee_block - block)
+            return ee_start - (ee_block - block);
+    }
+
+    if (path[depth].p_block)
+        return path[depth].p_block;
+
+    return ext0_inode_goal(inode);
+}
+
+static int ext0_ext_can_merge(struct ext0_extent *left, struct ext0_extent *right)
+{
+    unsigned left_len = le16_to_cpu(left->ee_len);
+
+    if (left_len + le16_to_cpu(right->ee_len) > EXT0_EXT_MAX_LEN || left->ee_flags != right->ee_flags)
+        return 0;
+    return le32_to_cpu(left->ee_block) + left_len == le32_to_cpu(right->ee_block) &&
+           le32_to_cpu(left->ee_start) + left_len == le32_to_cpu(right->ee_start);
+}
+
+/* The first key of a leaf changed. Carry it up while it is the first key of
+ * each parent as well
+ */
+static void ext0_ext_correct_indexes(struct inode *inode, struct ext0_ext_path *path, int depth)
+{
+    __le32 border = EXT0_FIRST_EXTENT(path[depth].p_hdr)->ee_block;
+    int k;
+
+    for (k = depth - 1; k >= 0; k--)
+    {
+        path[k].p_idx->ei_block = border;
+        ext0_ext_dirty(inode, &path[k]);
+        if (path[k].p_idx != EXT0_FIRST_INDEX(path[k].p_hdr))
+            break;
+    }
+}
+
+/* Get a zeroed block to hold a new tree node */
+static struct buffer_head *ext0_ext_new_node(struct inode *inode, unsigned long goal, unsigned long *block,
+                                             struct ext0_extent_header **hdr, int *err)
+{
+    struct buffer_head *bh;
+    unsigned long count = 1;
+
+    *block = ext0_new_blocks(inode, goal, &count, err);
+    if (!*block)
+        return NULL;
+
+    /* The whole block is ours, no need to read it */
+    bh = sb_getblk(inode->i_sb, *block);
+    if (!bh)
+    {
+        ext0_debug("Unable to get buffer for new extent block: %lu", *block);
+        ext0_free_blocks(inode->i_sb, *block, 1);
+        *err = -ENOMEM;
+        return NULL;
+    }
+
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    *hdr = (struct ext0_extent_header *)bh->b_data;
+    (*hdr)->eh_magic = cpu_to_le16(EXT0_EXT_MAGIC);
+    (*hdr)->eh_max = cpu_to_le16(ext0_ext_space_block(inode));
+
+    inode->i_blocks += 1 << (inode->i_blkbits - 9);
+    return bh;
+}
+
+/* The root is full: push its entries down into a new block and make the
+ * root a single index pointing at it
+ */
+static int ext0_ext_grow_indepth(struct inode *inode)
+{
+    struct ext0_extent_header *root = ext_inode_hdr(inode);
+    struct ext0_extent_header *neh;
+    struct ext0_extent_idx *ix;
+    struct buffer_head *bh;
+    unsigned long block;
+    int depth = le16_to_cpu(root->eh_depth);
+    __le32 border;
+    int err = 0;
+
+    if (depth >= EXT0_EXT_MAX_DEPTH)
+    {
+        ext0_debug("Extent tree full: inode=%lu", inode->i_ino);
+        return -ENOSPC;
+    }
+
+    bh = ext0_ext_new_node(inode, ext0_inode_goal(inode), &block, &neh, &err);
+    if (!bh)
+        return err;
+
+    memcpy(EXT0_FIRST_EXTENT(neh), EXT0_FIRST_EXTENT(root), le16_to_cpu(root->eh_entries) * sizeof(struct ext0_extent));
+    neh->eh_entries = root->eh_entries;
+    neh->eh_depth = root->eh_depth;
+    mark_buffer_dirty_inode(bh, inode);
+    brelse(bh);
+
+    if (depth)
+        border = EXT0_FIRST_INDEX(root)->ei_block;
+    else
+        border = root->eh_entries ? EXT0_FIRST_EXTENT(root)->ee_block : 0;
+
+    ix = EXT0_FIRST_INDEX(root);
+    ix->ei_block = border;
+    ix->ei_leaf = cpu_to_le32(block);
+    ix->ei_pad = 0;
+    root->eh_entries = cpu_to_le16(1);
+    root->eh_depth = cpu_to_le16(depth + 1);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/* Split the full node at level @at in two and hook the new right half into
+ * the parent, which must have a free slot. Appends to the last leaf keep the
+ * old leaf full and start an empty one, every other split goes down the middle.
+ */
+static int ext0_ext_split(struct inode *inode, struct ext0_ext_path *path, int at, int depth, sector_t block)
+{
+    struct ext0_ext_path *p = &path[at], *parent = &path[at - 1];
+    struct ext0_extent_header *eh = p->p_hdr, *neh;
+    struct ext0_extent_idx *ix;
+    struct buffer_head *bh;
+    unsigned long newblock;
+    unsigned entries = le16_to_cpu(eh->eh_entries), m;
+    __le32 border;
+    int err = 0;
+
+    bh = ext0_ext_new_node(inode, p->p_block, &newblock, &neh, &err);
+    if (!bh)
+        return err;
+
+    if (at == depth)
+    {
+        if (block > le32_to_cpu(EXT0_LAST_EXTENT(eh)->ee_block))
+        {
+            m = entries;
+            border = cpu_to_le32(block);
+        }
+        else
+        {
+            m = entries / 2;
+            border = EXT0_FIRST_EXTENT(eh)[m].ee_block;
+        }
+        memcpy(EXT0_FIRST_EXTENT(neh), EXT0_FIRST_EXTENT(eh) + m, (entries - m) * sizeof(struct ext0_extent));
+    }
+    else
+    {
+        m = entries / 2;
+        border = EXT0_FIRST_INDEX(eh)[m].ei_block;
+        memcpy(EXT0_FIRST_INDEX(neh), EXT0_FIRST_INDEX(eh) + m, (entries - m) * sizeof(struct ext0_extent_idx));
+    }
+
+    neh->eh_entries = cpu_to_le16(entries - m);
+    neh->eh_depth = cpu_to_le16(depth - at);
+    mark_buffer_dirty_inode(bh, inode);
+    brelse(bh);
+
+    eh->eh_entries = cpu_to_le16(m);
+    ext0_ext_dirty(inode, p);
+
+    ix = parent->p_idx + 1;
+    memmove(ix + 1, ix, (EXT0_LAST_INDEX(parent->p_hdr) + 1 - ix) * sizeof(struct ext0_extent_idx));
+    ix->ei_block = border;
+    ix->ei_leaf = cpu_to_le32(newblock);
+    ix->ei_pad = 0;
+    le16_add_cpu(&parent->p_hdr->eh_entries, 1);
+    ext0_ext_dirty(inode, parent);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/* Add @newext to the tree, merging it with its neighbours where possible */
+static int ext0_ext_insert_extent(struct inode *inode, struct ext0_extent *newext)
+{
+    struct ext0_ext_path path[EXT0_EXT_MAX_DEPTH + 1];
+    struct ext0_extent_header *eh;
+    struct ext0_extent *ex, *next, *pos;
+    sector_t block = le32_to_cpu(newext->ee_block);
+    int depth, i, err;
+
+repeat:
+    depth = ext0_ext_find_extent(inode, block, path);
+    if (depth < 0)
+        return depth;
+
+    eh = path[depth].p_hdr;
+    ex = path[depth].p_ext;
+    next = NULL;
+    if (ex && block < le32_to_cpu(ex->ee_block))
+    {
+        next = ex;
+        ex = NULL;
+    }
+    else if (ex && ex != EXT0_LAST_EXTENT(eh))
+        next = ex + 1;
+
+    if (ex && ext0_ext_can_merge(ex, newext))
+    {
+        le16_add_cpu(&ex->ee_len, le16_to_cpu(newext->ee_len));
+        goto out;
+    }
+
+    if (next && ext0_ext_can_merge(newext, next))
+    {
+        next->ee_block = newext->ee_block;
+        next->ee_start = newext->ee_start;
+        le16_add_cpu(&next->ee_len, le16_to_cpu(newext->ee_len));
+        if (next == EXT0_FIRST_EXTENT(eh))
+            ext0_ext_correct_indexes(inode, path, depth);
+        goto out;
+    }
+
+    if (!EXT0_HAS_FREE_SLOT(eh))
+    {
+        /* Find the lowest level with room and split the node below it */
+        for (i = depth - 1; i >= 0 && !EXT0_HAS_FREE_SLOT(path[i].p_hdr); i--)
+            ;
+
+        if (i < 0)
+            err = ext0_ext_grow_indepth(inode);
+        else
+            err = ext0_ext_split(inode, path, i + 1, depth, block);
+
+        ext0_ext_drop_path(path, depth);
+        if (EXT0_IS_ERR(err))
+            return err;
+        goto repeat;
+    }
+
+    if (!ex)
+        pos = next ? next : EXT0_FIRST_EXTENT(eh);
+    else
+        pos = ex + 1;
+
+    memmove(pos + 1, pos, (EXT0_LAST_EXTENT(eh) + 1 - pos) * sizeof(struct ext0_extent));
+    *pos = *newext;
+    le16_add_cpu(&eh->eh_entries, 1);
+    if (pos == EXT0_FIRST_EXTENT(eh))
+        ext0_ext_correct_indexes(inode, path, depth);
+
+out:
+    ext0_ext_dirty(inode, &path[depth]);
+    ext0_ext_drop_path(path, depth);
+    return 0;
+}
+
+static void ext0_ext_remove_entry(struct ext0_ext_path *p)
+{
+    struct ext0_extent_header *eh = p->p_hdr;
+
+    memmove(p->p_ext, p->p_ext + 1, (EXT0_LAST_EXTENT(eh) - p->p_ext) * sizeof(struct ext0_extent));
+    le16_add_cpu(&eh->eh_entries, -1);
+}
+
+/* Set the length and flags of the extent starting at @block */
+static int ext0_ext_trim(struct inode *inode, sector_t block, unsigned len, __le16 flags)
+{
+    struct ext0_ext_path path[EXT0_EXT_MAX_DEPTH + 1];
+    struct ext0_extent *ex;
+    int depth;
+
+    depth = ext0_ext_find_extent(inode, block, path);
+    if (depth < 0)
+        return depth;
+
+    ex = path[depth].p_ext;
+    ex->ee_len = cpu_to_le16(len);
+    ex->ee_flags = flags;
+    ext0_ext_dirty(inode, &path[depth]);
+    ext0_ext_drop_path(path, depth);
+    return 0;
+}
+
+/*
+ * Mark blocks [@lblk, @lblk + @len) of one unwritten extent written. A range
+ * at either end of the extent is handed to a written neighbour in the same
+ * leaf when possible, so writing through preallocated space sequentially
+ * keeps growing one extent. Otherwise the extent is split. The pieces after the first are inserted while the
+ * extent still covers them and the extent is cut down last, a failed insert
+ * leaves the tree as it was.
+ */
+static int ext0_ext_convert(struct inode *inode, sector_t lblk, unsigned len)
+{
+    struct ext0_ext_path path[EXT0_EXT_MAX_DEPTH + 1];
+    struct ext0_extent_header *eh;
+    struct ext0_extent *ex, *prev, *next, piece, tail;
+    unsigned long ee_block, ee_start;
+    unsigned ee_len;
+    int depth, err;
+
+    depth = ext0_ext_find_extent(inode, lblk, path);
+    if (depth < 0)
+        return depth;
+
+    eh = path[depth].p_hdr;
+    ex = path[depth].p_ext;
+    ee_block = le32_to_cpu(ex->ee_block);
+    ee_start = le32_to_cpu(ex->ee_start);
+    ee_len = le16_to_cpu(ex->ee_len);
+    prev = ex != EXT0_FIRST_EXTENT(eh) ? ex - 1 : NULL;
+    next = ex != EXT0_LAST_EXTENT(eh) ? ex + 1 : NULL;
+
+    piece.ee_block = cpu_to_le32(lblk);
+    piece.ee_start = cpu_to_le32(ee_start + (lblk - ee_block));
+    piece.ee_len = cpu_to_le16(len);
+    piece.ee_flags = 0;
+
+    if (lblk == ee_block && prev && ext0_ext_can_merge(prev, &piece))
+    {
+        le16_add_cpu(&prev->ee_len, len);
+        if (len == ee_len)
+            ext0_ext_remove_entry(&path[depth]);
+        else
+        {
+            ex->ee_block = cpu_to_le32(ee_block + len);
+            ex->ee_start = cpu_to_le32(ee_start + len);
+            ex->ee_len = cpu_to_le16(ee_len - len);
+        }
+        goto out;
+    }
+
+    if (lblk + len == ee_block + ee_len && next && ext0_ext_can_merge(&piece, next))
+    {
+        next->ee_block = piece.ee_block;
+        next->ee_start = piece.ee_start;
+        le16_add_cpu(&next->ee_len, len);
+        if (len == ee_len)
+            ext0_ext_remove_entry(&path[depth]);
+        else
+            ex->ee_len = cpu_to_le16(ee_len - len);
+        goto out;
+    }
+
+    if (len == ee_len)
+    {
+        ex->ee_flags = 0;
+        goto out;
+    }
+    ext0_ext_drop_path(path, depth);
+
+    if (lblk + len < ee_block + ee_len)
+    {
+        tail.ee_block = cpu_to_le32(lblk + len);
+        tail.ee_start = cpu_to_le32(ee_start + (lblk + len - ee_block));
+        tail.ee_len = cpu_to_le16(ee_block + ee_len - lblk - len);
+        tail.ee_flags = cpu_to_le16(EXT0_EXT_UNWRITTEN);
+        err = ext0_ext_insert_extent(inode, &tail);
+        if (EXT0_IS_ERR(err))
+            return err;
+    }
+
+    if (lblk == ee_block)
+        return ext0_ext_trim(inode, ee_block, len, 0);
+
+    err = ext0_ext_insert_extent(inode, &piece);
+    if (EXT0_IS_ERR(err))
+    {
+        /* Give the extent back the range, it stops where the tail starts */
+        ext0_ext_trim(inode, ee_block, lblk + len - ee_block, cpu_to_le16(EXT0_EXT_UNWRITTEN));
+        return err;
+    }
+    return ext0_ext_trim(inode, ee_block, lblk - ee_block, cpu_to_le16(EXT0_EXT_UNWRITTEN));
+
+out:
+    ext0_ext_dirty(inode, &path[depth]);
+    ext0_ext_drop_path(path, depth);
+    return 0;
+}
+
+/* Look up @map->m_lblk. Returns the number of blocks mapped, or 0 for a hole
+ * in which case m_len is trimmed to the size of the hole
+ */
+static int ext0_ext_lookup(struct inode *inode, struct ext0_map_blocks *map, unsigned long *goal)
+{
+    struct ext0_ext_path path[EXT0_EXT_MAX_DEPTH + 1];
+    struct ext0_extent *ex;
+    sector_t next;
+    int depth;
+
+    depth = ext0_ext_find_extent(inode, map->m_lblk, path);
+    if (depth < 0)
+        return depth;
+
+    map->m_flags = 0;
+    ex = path[depth].p_ext;
+    if (ex)
+    {
+        unsigned long ee_block = le32_to_cpu(ex->ee_block);
+        unsigned ee_len = le16_to_cpu(ex->ee_len);
+
+        if (map->m_lblk >= ee_block && map->m_lblk < ee_block + ee_len)
+        {
+            map->m_pblk = le32_to_cpu(ex->ee_start) + (map->m_lblk - ee_block);
+            map->m_len = min_t(unsigned, map->m_len, ee_block + ee_len - map->m_lblk);
+            map->m_flags = EXT0_MAP_MAPPED;
+            if (le16_to_cpu(ex->ee_flags) & EXT0_EXT_UNWRITTEN)
+                map->m_flags |= EXT0_MAP_UNWRITTEN;
+            else
+                ext0_ext_cache_set(inode, ee_block, le32_to_cpu(ex->ee_start), ee_len);
+            ext0_ext_drop_path(path, depth);
+            return map->m_len;
+        }
+    }
+
+    next = ext0_ext_next_allocated_block(path, depth, map->m_lblk);
+    map->m_len = min_t(sector_t, map->m_len, next - map->m_lblk);
+    if (goal)
+        *goal = ext0_ext_find_goal(inode, path, depth, map->m_lblk);
+    ext0_ext_drop_path(path, depth);
+    return 0;
+}
+
+/* Map up to @map->m_len blocks starting at @map->m_lblk. With
+ * EXT0_GET_BLOCKS_CREATE, holes are filled with newly allocated blocks,
+ * flagged EXT0_MAP_NEW for the caller to zero what it does not write.
+ * EXT0_GET_BLOCKS_UNWRITTEN allocates unwritten extents instead. Unwritten
+ * blocks come back as they are, to be turned written once their data is on
+ * disk(see ext0_ext_convert_range), unless EXT0_GET_BLOCKS_CONVERT asks for
+ * that to happen now, flagged EXT0_MAP_NEW as well. With
+ * EXT0_GET_BLOCKS_NOWAIT, returns -EAGAIN rather than wait for the tree lock
+ * or for a read. Returns the number of blocks mapped, 0 for a hole(when not
+ * creating) or a negative error
+ */
+int ext0_ext_map_blocks(struct inode *inode, struct ext0_map_blocks *map, int flags)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(inode);
+    struct ext0_extent newex;
+    unsigned long goal = 0, block, count;
+    int ret, err = 0;
+
+    ret = ext0_ext_cache_lookup(inode, map);
+    if (ret)
+        return ret;
+
+    if (!(flags & EXT0_GET_BLOCKS_NOWAIT))
+        down_read(&in_mem_inode->i_data_sem);
+    else if (!down_read_trylock(&in_mem_inode->i_data_sem))
+        return -EAGAIN;
+
+    /* Only a tree held in the inode itself is walked without reading blocks */
+    if ((flags & EXT0_GET_BLOCKS_NOWAIT) && ext_inode_hdr(inode)->eh_depth)
+        ret = -EAGAIN;
+    else
+        ret = ext0_ext_lookup(inode, map, NULL);
+    up_read(&in_mem_inode->i_data_sem);
+    if (ret < 0 || !(flags & EXT0_GET_BLOCKS_CREATE))
+        return ret;
+    if (ret > 0 && (!(map->m_flags & EXT0_MAP_UNWRITTEN) || !(flags & EXT0_GET_BLOCKS_CONVERT)))
+        return ret;
+
+    /* Allocating reads bitmaps and may split tree nodes */
+    if (flags & EXT0_GET_BLOCKS_NOWAIT)
+        return -EAGAIN;
+
+    down_write(&in_mem_inode->i_data_sem);
+
+    /* Someone may have filled the hole while we were unlocked */
+    ret = ext0_ext_lookup(inode, map, &goal);
+    if (ret < 0)
+        goto out;
+    if (ret > 0)
+    {
+        if (!(map->m_flags & EXT0_MAP_UNWRITTEN) || !(flags & EXT0_GET_BLOCKS_CONVERT))
+            goto out;
+
+        ret = ext0_ext_convert(inode, map->m_lblk, map->m_len);
+        if (EXT0_IS_ERR(ret))
+            goto out;
+        map->m_flags = EXT0_MAP_MAPPED | EXT0_MAP_NEW;
+        ret = map->m_len;
+        goto out;
+    }
+
+    count = min_t(unsigned long, map->m_len, EXT0_EXT_MAX_LEN);
+    block = ext0_new_blocks(inode, goal, &count, &err);
+    if (!block)
+    {
+        ret = err;
+        goto out;
+    }
+
+    newex.ee_block = cpu_to_le32(map->m_lblk);
+    newex.ee_start = cpu_to_le32(block);
+    newex.ee_len = cpu_to_le16(count);
+    newex.ee_flags = flags & EXT0_GET_BLOCKS_UNWRITTEN ? cpu_to_le16(EXT0_EXT_UNWRITTEN) : 0;
+    ret = ext0_ext_insert_extent(inode, &newex);
+    if (EXT0_IS_ERR(ret))
+    {
+        ext0_free_blocks(inode->i_sb, block, count);
+        goto out;
+    }
+
+    inode->i_blocks += count << (inode->i_blkbits - 9);
+    mark_inode_dirty(inode);
+
+    map->m_pblk = block;
+    map->m_len = count;
+    map->m_flags = EXT0_MAP_MAPPED | EXT0_MAP_NEW;
+    if (flags & EXT0_GET_BLOCKS_UNWRITTEN)
+        map->m_flags |= EXT0_MAP_UNWRITTEN;
+    else
+        ext0_ext_cache_set(inode, map->m_lblk, block, count);
+    ret = count;
+
+out:
+    up_write(&in_mem_inode->i_data_sem);
+    return ret;
+}
+
+/* Turn the unwritten blocks in [@start, @end) written, called once their data
+ * is on disk. Holes and written blocks in the range are left as they are
+ */
+int ext0_ext_convert_range(struct inode *inode, sector_t start, sector_t end)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(inode);
+    struct ext0_map_blocks map;
+    int ret, err = 0;
+
+    down_write(&in_mem_inode->i_data_sem);
+    while (start < end)
+    {
+        map.m_lblk = start;
+        map.m_len = min_t(sector_t, end - start, UINT_MAX);
+        ret = ext0_ext_lookup(inode, &map, NULL);
+        if (ret < 0)
+        {
+            err = ret;
+            break;
+        }
+
+        if (ret && (map.m_flags & EXT0_MAP_UNWRITTEN))
+        {
+            err = ext0_ext_convert(inode, map.m_lblk, map.m_len);
+            if (EXT0_IS_ERR(err))
+                break;
+        }
+        start += map.m_len;
+    }
+    up_write(&in_mem_inode->i_data_sem);
+    return err;
+}
+
+/* Free the blocks mapped in [@start, @end) and leave a hole there. A hole
+ * inside an extent splits it, the part after the hole is inserted before the
+ * extent is cut down. Leaves emptied on the way stay in the tree, lookups and
+ * inserts step over them
+ */
+int ext0_ext_punch(struct inode *inode, sector_t start, sector_t end)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(inode);
+    struct ext0_ext_path path[EXT0_EXT_MAX_DEPTH + 1];
+    struct ext0_extent *ex, tail;
+    unsigned long ee_block, ee_start;
+    unsigned ee_len, from, to;
+    int depth, err = 0;
+
+    down_write(&in_mem_inode->i_data_sem);
+
+    /* The cached extent may reach into the range */
+    ext0_ext_cache_set(inode, 0, 0, 0);
+
+    while (start < end)
+    {
+        depth = ext0_ext_find_extent(inode, start, path);
+        if (depth < 0)
+        {
+            err = depth;
+            break;
+        }
+
+        ex = path[depth].p_ext;
+        if (!ex || start < le32_to_cpu(ex->ee_block) ||
+            start >= le32_to_cpu(ex->ee_block) + le16_to_cpu(ex->ee_len))
+        {
+            start = ext0_ext_next_allocated_block(path, depth, start);
+            ext0_ext_drop_path(path, depth);
+            continue;
+        }
+
+        ee_block = le32_to_cpu(ex->ee_block);
+        ee_start = le32_to_cpu(ex->ee_start);
+        ee_len = le16_to_cpu(ex->ee_len);
+        from = start - ee_block;
+        to = min_t(sector_t, end, ee_block + ee_len) - ee_block;
+
+        if (from && to < ee_len)
+        {
+            tail.ee_block = cpu_to_le32(ee_block + to);
+            tail.ee_start = cpu_to_le32(ee_start + to);
+            tail.ee_len = cpu_to_le16(ee_len - to);
+            tail.ee_flags = ex->ee_flags;
+            ext0_ext_drop_path(path, depth);
+
+            err = ext0_ext_insert_extent(inode, &tail);
+            if (!err)
+                err = ext0_ext_trim(inode, ee_block, from, tail.ee_flags);
+            if (EXT0_IS_ERR(err))
+                break;
+        }
+        else
+        {
+            if (!from && to == ee_len)
+                ext0_ext_remove_entry(&path[depth]);
+            else if (!from)
+            {
+                ex->ee_block = cpu_to_le32(ee_block + to);
+                ex->ee_start = cpu_to_le32(ee_start + to);
+                ex->ee_len = cpu_to_le16(ee_len - to);
+            }
+            else
+                ex->ee_len = cpu_to_le16(from);
+            ext0_ext_dirty(inode, &path[depth]);
+            ext0_ext_drop_path(path, depth);
+        }
+
+        ext0_free_blocks(inode->i_sb, ee_start + from, to - from);
+        inode->i_blocks -= (blkcnt_t)(to - from) << (inode->i_blkbits - 9);
+        start = ee_block + to;
+    }
+
+    mark_inode_dirty(inode);
+    up_write(&in_mem_inode->i_data_sem);
+    return err;
+}
+
+/* Drop the buffer cache copies of blocks about to be freed */
+static void ext0_forget_blocks(struct super_block *sb, unsigned long block, unsigned len)
+{
+    struct buffer_head *bh;
+
+    for (; len; block++, len--)
+    {
+        bh = sb_find_get_block(sb, block);
+        if (bh)
+            bforget(bh);
+    }
+}
+
+static void ext0_ext_free_node(struct super_block *sb, ino_t ino, struct ext0_extent_header *eh, int depth, int forget)
+{
+    unsigned i, entries = le16_to_cpu(eh->eh_entries);
+
+    if (!depth)
+    {
+        struct ext0_extent *ex = EXT0_FIRST_EXTENT(eh);
+
+        for (i = 0; i < entries; i++, ex++)
+        {
+            if (forget)
+                ext0_forget_blocks(sb, le32_to_cpu(ex->ee_start), le16_to_cpu(ex->ee_len));
+            ext0_free_blocks(sb, le32_to_cpu(ex->ee_start), le16_to_cpu(ex->ee_len));
+        }
+        return;
+    }
+
+    for (i = 0; i < entries; i++)
+    {
+        unsigned long block = le32_to_cpu(EXT0_FIRST_INDEX(eh)[i].ei_leaf);
+        struct buffer_head *bh;
+
+        bh = sb_bread(sb, block);
+        if (!bh)
+        {
+            ext0_debug("Could not perform I/O for extent block: %lu", block);
+            continue;
+        }
+
+        if (!ext0_ext_check(ino, (struct ext0_extent_header *)bh->b_data, depth - 1))
+            ext0_ext_free_node(sb, ino, (struct ext0_extent_header *)bh->b_data, depth - 1, forget);
+
+        /* The block may be reused for file data, a dirty copy left in the
+         * buffer cache must not be written over it later
+         */
+        bforget(bh);
+        ext0_free_blocks(sb, block, 1);
+    }
+}
+
+/* Release every block of the tree rooted at @root, data and tree nodes
+ * alike. @root is a copy of the i_block array of inode @ino, which is gone
+ * from the inode cache by now(see ext0_evict_inode). With @forget the data
+ * blocks went through the buffer cache(directories, see ext0_dir_bread) and
+ * their buffers are dropped like those of tree nodes
+ */
+void ext0_ext_free_root(struct super_block *sb, ino_t ino, __le32 *root, int forget)
+{
+    struct ext0_extent_header *eh = (struct ext0_extent_header *)root;
+    int depth = le16_to_cpu(eh->eh_depth);
+
+    if (depth <= EXT0_EXT_MAX_DEPTH && !ext0_ext_check(ino, eh, depth))
+        ext0_ext_free_node(sb, ino, eh, depth, forget);
+}
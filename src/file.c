@@ -1,40 +1,365 @@
-#include <linux/fs.h>
-#include <linux/buffer_head.h>
-
-#include "ext0.h"
-
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(4, 18, 0)
-static int ext0_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
-{
-    return generic_block_fiemap(inode, fieinfo, start, len, ext0_get_block);
-}
-
-const struct inode_operations ext0_file_inode_operations = {
-    // .setattr = ext0_setattr,
-    .fiemap = ext0_fiemap,
-};
-#else
-// #include <linux/iomap.h>
-// static int ext0_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
-// {
-//     int ret;
-// 	inode_lock(inode);
-// 	len = min_t(u64, len, i_size_read(inode));
-// 	ret = iomap_fiemap(inode, fieinfo, start, len, &ext0_iomap_ops);
-// 	inode_unlock(inode);
-// 	return ret;
-// }
-const struct inode_operations ext0_file_inode_operations = {};
-#endif
-
-const struct file_operations ext0_file_operations = {
-    .llseek = generic_file_llseek,
-    .read_iter = generic_file_read_iter,
-    .write_iter = generic_file_write_iter,
-    .mmap = generic_file_mmap,
-    .open = generic_file_open,
-    .fsync = generic_file_fsync,
-    .get_unmapped_area = thp_get_unmapped_area,
-    .splice_read = generic_file_splice_read,
-    .splice_write = iter_file_splice_write,
-};
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/falloc.h>
+#include <linux/iomap.h>
+#include <linux/sched/signal.h>
+
+#include "ext0.h"
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(4, 18, 0)
+static int ext0_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+    return generic_block_fiemap(inode, fieinfo, start, len, ext0_get_block);
+}
+
+const struct inode_operations ext0_file_inode_operations = {
+    // .setattr = ext0_setattr,
+    .fiemap = ext0_fiemap,
+};
+#elif defined(EXT0_IOMAP)
+/* Not clamped to i_size: blocks preallocated past EOF(FALLOC_FL_KEEP_SIZE) are
+ * reported as unwritten extents, the rest maps as holes
+ */
+static int ext0_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+    int ret;
+
+    inode_lock(inode);
+    ret = iomap_fiemap(inode, fieinfo, start, len, &ext0_iomap_ops);
+    inode_unlock(inode);
+    return ret;
+}
+
+const struct inode_operations ext0_file_inode_operations = {
+    .fiemap = ext0_fiemap,
+};
+#else
+const struct inode_operations ext0_file_inode_operations = {};
+#endif
+
+#ifdef EXT0_IOMAP
+/*
+ * O_DIRECT goes straight between the user buffer and the blocks mapped by
+ * ext0_iomap_ops. iomap writes back and drops the page cache over the range
+ * first, so buffered users and mmap see what was written. Holes written to
+ * are allocated like for buffered writes, iomap zeroes the parts of new
+ * blocks outside the request. Requests must be aligned to the device's
+ * logical block size.
+ */
+static ssize_t ext0_dio_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (!iov_iter_count(to))
+        return 0;
+
+    if (iocb->ki_flags & IOCB_NOWAIT)
+    {
+        if (!inode_trylock_shared(inode))
+            return -EAGAIN;
+    }
+    else
+        inode_lock_shared(inode);
+
+    ret = iomap_dio_rw(iocb, to, &ext0_iomap_ops, NULL, 0, NULL, 0);
+    inode_unlock_shared(inode);
+
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+static ssize_t ext0_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    if (iocb->ki_flags & IOCB_DIRECT)
+        return ext0_dio_read_iter(iocb, to);
+    return generic_file_read_iter(iocb, to);
+}
+
+/* Preallocated blocks that were written turn written here, once the data is
+ * on disk. Extending writes wait for completion(see ext0_dio_write_iter), the
+ * inode lock is still held when i_size moves
+ */
+static int ext0_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, unsigned flags)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    int err;
+
+    if (error)
+        return error;
+
+    if (size && (flags & IOMAP_DIO_UNWRITTEN))
+    {
+        err = ext0_ext_convert_range(inode, iocb->ki_pos >> inode->i_blkbits,
+                                     DIV_ROUND_UP(iocb->ki_pos + size, i_blocksize(inode)));
+        if (EXT0_IS_ERR(err))
+            return err;
+    }
+
+    if (size && iocb->ki_pos + size > i_size_read(inode))
+    {
+        i_size_write(inode, iocb->ki_pos + size);
+        mark_inode_dirty(inode);
+    }
+    return 0;
+}
+
+static const struct iomap_dio_ops ext0_dio_write_ops = {
+    .end_io = ext0_dio_write_end_io,
+};
+
+static ssize_t ext0_buffered_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+    return iomap_file_buffered_write(iocb, from, &ext0_iomap_ops, NULL);
+#else
+    return iomap_file_buffered_write(iocb, from, &ext0_iomap_ops);
+#endif
+}
+
+static ssize_t ext0_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct address_space *mapping = iocb->ki_filp->f_mapping;
+    struct inode *inode = mapping->host;
+    unsigned dio_flags = 0;
+    bool unaligned;
+    loff_t pos;
+    ssize_t ret;
+    int err;
+
+    /* i_size is only moved once the data is on disk, past EOF we wait for it.
+     * A write that does not cover whole blocks has iomap zero the rest of
+     * new ones, and that zeroing could land on top of another direct write
+     * into the same block: drain those first and do not overlap with the
+     * next one either
+     */
+    unaligned = (iocb->ki_pos | iov_iter_count(from)) & (i_blocksize(inode) - 1);
+    if (unaligned || iocb->ki_pos + iov_iter_count(from) > i_size_read(inode))
+    {
+        if (iocb->ki_flags & IOCB_NOWAIT)
+            return -EAGAIN;
+        if (unaligned)
+            inode_dio_wait(inode);
+        dio_flags |= IOMAP_DIO_FORCE_WAIT;
+    }
+
+    ret = iomap_dio_rw(iocb, from, &ext0_iomap_ops, &ext0_dio_write_ops, dio_flags, NULL, 0);
+    if (ret != -ENOTBLK || (iocb->ki_flags & IOCB_NOWAIT))
+        return ret;
+
+    /* Cached pages over the range could not be dropped, go through them and
+     * write them out instead
+     */
+    pos = iocb->ki_pos;
+    ret = ext0_buffered_write_iter(iocb, from);
+    if (ret <= 0)
+        return ret;
+
+    err = filemap_write_and_wait_range(mapping, pos, pos + ret - 1);
+    if (err)
+        return err;
+    invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT, (pos + ret - 1) >> PAGE_SHIFT);
+    return ret;
+}
+
+static ssize_t ext0_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (iocb->ki_flags & IOCB_NOWAIT)
+    {
+        if (!inode_trylock(inode))
+            return -EAGAIN;
+    }
+    else
+        inode_lock(inode);
+
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto out;
+
+    /* Fails with -EAGAIN for NOWAIT callers when it would have to block */
+    ret = kiocb_modified(iocb);
+    if (ret)
+        goto out;
+
+    if (iocb->ki_flags & IOCB_DIRECT)
+        ret = ext0_dio_write_iter(iocb, from);
+    else
+        ret = ext0_buffered_write_iter(iocb, from);
+
+out:
+    inode_unlock(inode);
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
+
+/*
+ * fallocate. Preallocated blocks go in as unwritten extents and read as
+ * zeros until written(see ext0_ext_map_blocks). PUNCH_HOLE frees the whole
+ * blocks in the range and zeroes the partial ones at its edges, ZERO_RANGE
+ * does the same and preallocates the freed blocks again. The invalidate lock
+ * keeps page faults from bringing back the pages being dropped.
+ */
+static int ext0_zero_range(struct inode *inode, loff_t pos, loff_t len)
+{
+    /* Past EOF there is nothing to zero */
+    len = min_t(loff_t, len, i_size_read(inode) - pos);
+    if (len <= 0)
+        return 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+    return iomap_zero_range(inode, pos, len, NULL, &ext0_iomap_ops, NULL);
+#else
+    return iomap_zero_range(inode, pos, len, NULL, &ext0_iomap_ops);
+#endif
+}
+
+static int ext0_alloc_range(struct inode *inode, sector_t lblk, sector_t end)
+{
+    struct ext0_map_blocks map;
+    int ret;
+
+    while (lblk < end)
+    {
+        map.m_lblk = lblk;
+        map.m_len = min_t(sector_t, end - lblk, UINT_MAX);
+        ret = ext0_ext_map_blocks(inode, &map, EXT0_GET_BLOCKS_CREATE | EXT0_GET_BLOCKS_UNWRITTEN);
+        if (ret < 0)
+            return ret;
+        lblk += map.m_len;
+
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        cond_resched();
+    }
+    return 0;
+}
+
+/* Returns the whole blocks of [@offset, @end) in @start and @stop */
+static int ext0_punch_range(struct inode *inode, loff_t offset, loff_t end, sector_t *start, sector_t *stop)
+{
+    unsigned blkbits = inode->i_blkbits;
+    loff_t first = round_up(offset, i_blocksize(inode));
+    loff_t last = round_down(end, i_blocksize(inode));
+    int ret;
+
+    if (first >= last)
+    {
+        /* Inside a single block, or across just one block boundary */
+        *start = *stop = 0;
+        return ext0_zero_range(inode, offset, end - offset);
+    }
+
+    ret = ext0_zero_range(inode, offset, first - offset);
+    if (!ret)
+        ret = ext0_zero_range(inode, last, end - last);
+    if (ret)
+        return ret;
+
+    truncate_pagecache_range(inode, first, last - 1);
+    *start = first >> blkbits;
+    *stop = last >> blkbits;
+    return ext0_ext_punch(inode, *start, *stop);
+}
+
+static long ext0_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    unsigned blkbits = inode->i_blkbits;
+    loff_t end = offset + len;
+    sector_t start, stop;
+    int ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+        return -EOPNOTSUPP;
+    if (!S_ISREG(inode->i_mode))
+        return -EOPNOTSUPP;
+
+    inode_lock(inode);
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+    {
+        ret = inode_newsize_ok(inode, end);
+        if (ret)
+            goto out;
+    }
+
+    ret = file_modified(file);
+    if (ret)
+        goto out;
+
+    /* Direct I/O in flight may still be writing to the blocks */
+    inode_dio_wait(inode);
+    filemap_invalidate_lock(inode->i_mapping);
+
+    if (mode & FALLOC_FL_PUNCH_HOLE)
+        ret = ext0_punch_range(inode, offset, end, &start, &stop);
+    else if (mode & FALLOC_FL_ZERO_RANGE)
+    {
+        /* The edges inside the file are zeroed in place, everything else in
+         * the blocks the range touches(past EOF too) ends up preallocated
+         */
+        ret = ext0_punch_range(inode, offset, end, &start, &stop);
+        if (!ret)
+            ret = ext0_alloc_range(inode, offset >> blkbits, DIV_ROUND_UP(end, i_blocksize(inode)));
+    }
+    else
+        ret = ext0_alloc_range(inode, offset >> blkbits, DIV_ROUND_UP(end, i_blocksize(inode)));
+
+    filemap_invalidate_unlock(inode->i_mapping);
+    if (ret)
+        goto out;
+
+    if (!(mode & (FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) && end > i_size_read(inode))
+    {
+        i_size_write(inode, end);
+        mark_inode_dirty(inode);
+    }
+
+out:
+    inode_unlock(inode);
+    return ret;
+}
+
+/* IOCB_NOWAIT callers(io_uring, RWF_NOWAIT) get -EAGAIN wherever we would
+ * block on a lock or on I/O: page cache misses in the generic read path,
+ * the inode lock above, and in ext0_ext_map_blocks a busy tree lock, a tree
+ * that needs reading or blocks that need allocating
+ */
+static int ext0_file_open(struct inode *inode, struct file *filp)
+{
+    filp->f_mode |= FMODE_NOWAIT;
+#ifdef FMODE_BUF_WASYNC
+    filp->f_mode |= FMODE_BUF_WASYNC;
+#endif
+#ifdef FMODE_CAN_ODIRECT
+    filp->f_mode |= FMODE_CAN_ODIRECT;
+#endif
+    return generic_file_open(inode, filp);
+}
+#endif
+
+const struct file_operations ext0_file_operations = {
+    .llseek = generic_file_llseek,
+#ifdef EXT0_IOMAP
+    .read_iter = ext0_file_read_iter,
+    .write_iter = ext0_file_write_iter,
+    .open = ext0_file_open,
+    .fallocate = ext0_fallocate,
+#else
+    .read_iter = generic_file_read_iter,
+    .write_iter = generic_file_write_iter,
+    .open = generic_file_open,
+#endif
+    .mmap = generic_file_mmap,
+    .fsync = generic_file_fsync,
+    .unlocked_ioctl = ext0_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
+    .get_unmapped_area = thp_get_unmapped_area,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+};
@@ -0,0 +1,513 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "ext0.h"
+
+/*
+ * Hashed directory index. Block 0 of an indexed directory is the root(see
+ * struct ext0_dx_root_info), pointing either at leaf blocks or at one level of
+ * index nodes that point at leaves. A lookup reads the root, maybe a node
+ * and one leaf whatever the size of the directory. Leaves are ordinary
+ * directory blocks holding the entries whose hash falls in their range,
+ * unsorted. A full leaf is split in two by hash. Directory modifications
+ * are serialized by the VFS(i_rwsem), so is everything here.
+ */
+
+struct ext0_dx_frame
+{
+    struct buffer_head *bh;
+    struct ext0_dx_entry *entries;
+    struct ext0_dx_entry *at; /* Entry that was followed down */
+};
+
+/* Entry of a leaf being split */
+struct ext0_dx_map
+{
+    u32 hash;
+    u16 offs;
+    u16 size;
+};
+
+static inline unsigned dx_get_count(struct ext0_dx_entry *entries)
+{
+    return le16_to_cpu(((struct ext0_dx_countlimit *)entries)->count);
+}
+
+static inline unsigned dx_get_limit(struct ext0_dx_entry *entries)
+{
+    return le16_to_cpu(((struct ext0_dx_countlimit *)entries)->limit);
+}
+
+static inline void dx_set_count(struct ext0_dx_entry *entries, unsigned count)
+{
+    ((struct ext0_dx_countlimit *)entries)->count = cpu_to_le16(count);
+}
+
+static inline void dx_set_limit(struct ext0_dx_entry *entries, unsigned limit)
+{
+    ((struct ext0_dx_countlimit *)entries)->limit = cpu_to_le16(limit);
+}
+
+static inline u32 dx_get_hash(struct ext0_dx_entry *entry)
+{
+    return le32_to_cpu(entry->hash);
+}
+
+static inline unsigned long dx_get_block(struct ext0_dx_entry *entry)
+{
+    return le32_to_cpu(entry->block);
+}
+
+/* The root info follows "." and "..", whose size depends on the entry layout */
+static inline struct ext0_dx_root_info *dx_root_info(struct inode *dir, struct buffer_head *bh)
+{
+    return (struct ext0_dx_root_info *)(bh->b_data + ext0_rec_len(dir, 1) + ext0_rec_len(dir, 2));
+}
+
+static inline struct ext0_dx_entry *dx_root_entries(struct ext0_dx_root_info *info)
+{
+    return (struct ext0_dx_entry *)(info + 1);
+}
+
+static inline unsigned dx_root_limit(struct inode *dir)
+{
+    return (dir->i_sb->s_blocksize - ext0_rec_len(dir, 1) - ext0_rec_len(dir, 2) - sizeof(struct ext0_dx_root_info)) /
+           sizeof(struct ext0_dx_entry);
+}
+
+static inline unsigned dx_node_limit(struct inode *dir)
+{
+    return (dir->i_sb->s_blocksize - sizeof(struct ext0_fake_dirent)) / sizeof(struct ext0_dx_entry);
+}
+
+static void ext0_dx_release(struct ext0_dx_frame *frames, int levels)
+{
+    int i;
+
+    for (i = 0; i <= levels; i++)
+        brelse(frames[i].bh);
+}
+
+/* Last entry whose hash is not above @hash. The first entry covers hash 0 */
+static struct ext0_dx_entry *ext0_dx_search(struct ext0_dx_entry *entries, unsigned count, u32 hash)
+{
+    struct ext0_dx_entry *l = entries + 1, *r = entries + count - 1, *m;
+
+    while (l <= r)
+    {
+        m = l + (r - l) / 2;
+        if (dx_get_hash(m) > hash)
+            r = m - 1;
+        else
+            l = m + 1;
+    }
+    return l - 1;
+}
+
+/* Walk the index down to the leaf covering @hash, filling frames[0..levels].
+ * Returns the number of levels below the root or -errno
+ */
+static int ext0_dx_probe(struct inode *dir, u32 hash, struct ext0_dx_frame *frames)
+{
+    struct ext0_dx_root_info *info;
+    struct ext0_dx_entry *entries;
+    struct buffer_head *bh;
+    unsigned count, limit;
+    int levels, level, err;
+
+    bh = ext0_dir_bread(dir, 0, &err);
+    if (!bh)
+        return err;
+
+    info = dx_root_info(dir, bh);
+    levels = info->indirect_levels;
+    if (info->reserved_zero || info->hash_version != EXT0_DX_HASH_FNV ||
+        info->info_length != sizeof(*info) || levels >= EXT0_DX_MAX_LEVELS)
+    {
+        ext0_debug("Bad index root: inode=%lu", dir->i_ino);
+        brelse(bh);
+        return -EIO;
+    }
+
+    entries = dx_root_entries(info);
+    limit = dx_root_limit(dir);
+    for (level = 0;; level++)
+    {
+        count = dx_get_count(entries);
+        if (dx_get_limit(entries) != limit || !count || count > limit)
+        {
+            ext0_debug("Bad index node: inode=%lu level=%d count=%u", dir->i_ino, level, count);
+            brelse(bh);
+            ext0_dx_release(frames, level - 1);
+            return -EIO;
+        }
+
+        frames[level].bh = bh;
+        frames[level].entries = entries;
+        frames[level].at = ext0_dx_search(entries, count, hash);
+        if (level == levels)
+            return levels;
+
+        bh = ext0_dir_bread(dir, dx_get_block(frames[level].at), &err);
+        if (!bh)
+        {
+            ext0_dx_release(frames, level);
+            return err;
+        }
+        entries = ((struct ext0_dx_node *)bh->b_data)->entries;
+        limit = dx_node_limit(dir);
+    }
+}
+
+/* Step to the next leaf if it continues the run of @hash, colliding names
+ * may straddle a split. Returns 1 if it does, 0 if not or -errno
+ */
+static int ext0_dx_next_leaf(struct inode *dir, u32 hash, struct ext0_dx_frame *frames, int levels)
+{
+    struct ext0_dx_frame *frame;
+    struct buffer_head *bh;
+    int level, err;
+
+    for (level = levels; level >= 0; level--)
+    {
+        frame = &frames[level];
+        if (frame->at + 1 < frame->entries + dx_get_count(frame->entries))
+            break;
+    }
+    if (level < 0 || dx_get_hash(frames[level].at + 1) != (hash | 1))
+        return 0;
+
+    frames[level].at++;
+    while (++level <= levels)
+    {
+        bh = ext0_dir_bread(dir, dx_get_block(frames[level - 1].at), &err);
+        if (!bh)
+            return err;
+        brelse(frames[level].bh);
+        frames[level].bh = bh;
+        frames[level].entries = frames[level].at = ((struct ext0_dx_node *)bh->b_data)->entries;
+    }
+    return 1;
+}
+
+struct buffer_head *ext0_dx_find_entry(struct inode *dir, const struct qstr *name, u32 hash, struct ext0_dir_entry **res_dir,
+                                       unsigned long *res_block, int *err)
+{
+    struct ext0_dx_frame frames[EXT0_DX_MAX_LEVELS];
+    struct buffer_head *bh;
+    int levels, ret;
+
+    levels = ext0_dx_probe(dir, hash, frames);
+    if (levels < 0)
+    {
+        *err = levels;
+        return NULL;
+    }
+
+    do
+    {
+        *res_block = dx_get_block(frames[levels].at);
+        bh = ext0_dir_bread(dir, *res_block, err);
+        if (!bh)
+            goto out;
+
+        *res_dir = ext0_dir_find_in_block(dir, bh, name, hash);
+        if (*res_dir)
+            goto out;
+        brelse(bh);
+        bh = NULL;
+
+        ret = ext0_dx_next_leaf(dir, hash, frames, levels);
+    } while (ret == 1);
+    *err = ret;
+
+out:
+    ext0_dx_release(frames, levels);
+    return bh;
+}
+
+/* Add an index entry right after frame->at */
+static void ext0_dx_insert(struct inode *dir, struct ext0_dx_frame *frame, u32 hash, unsigned long block)
+{
+    unsigned count = dx_get_count(frame->entries);
+    struct ext0_dx_entry *new = frame->at + 1;
+
+    memmove(new + 1, new, (frame->entries + count - new) * sizeof(*new));
+    new->hash = cpu_to_le32(hash);
+    new->block = cpu_to_le32(block);
+    dx_set_count(frame->entries, count + 1);
+    mark_buffer_dirty_inode(frame->bh, dir);
+}
+
+/* Make room for one more entry in the index node above the leaves. A full
+ * root moves its entries down into a new node, a full node is split in two
+ */
+static int ext0_dx_make_room(struct inode *dir, struct ext0_dx_frame *frames, int *levels)
+{
+    struct ext0_dx_frame *frame = &frames[*levels];
+    unsigned count = dx_get_count(frame->entries);
+    struct ext0_dx_entry *entries;
+    struct buffer_head *bh;
+    unsigned long block;
+    unsigned half;
+    int err;
+
+    if (count < dx_get_limit(frame->entries))
+        return 0;
+
+    if (*levels == 0)
+    {
+        bh = ext0_dir_append(dir, &block, &err);
+        if (!bh)
+            return err;
+
+        entries = ((struct ext0_dx_node *)bh->b_data)->entries;
+        memcpy(entries, frame->entries, count * sizeof(*entries));
+        dx_set_limit(entries, dx_node_limit(dir));
+
+        frames[1].bh = bh;
+        frames[1].entries = entries;
+        frames[1].at = entries + (frame->at - frame->entries);
+
+        dx_set_count(frame->entries, 1);
+        frame->entries[0].block = cpu_to_le32(block);
+        frame->at = frame->entries;
+        dx_root_info(dir, frame->bh)->indirect_levels = 1;
+        mark_buffer_dirty_inode(frame->bh, dir);
+        mark_buffer_dirty_inode(bh, dir);
+
+        /* Nodes hold a few more entries than the root */
+        *levels = 1;
+        return 0;
+    }
+
+    if (dx_get_count(frames[0].entries) >= dx_get_limit(frames[0].entries))
+    {
+        ext0_debug("Directory index full: inode=%lu", dir->i_ino);
+        return -ENOSPC;
+    }
+
+    bh = ext0_dir_append(dir, &block, &err);
+    if (!bh)
+        return err;
+
+    half = count / 2;
+    entries = ((struct ext0_dx_node *)bh->b_data)->entries;
+    memcpy(entries, frame->entries + half, (count - half) * sizeof(*entries));
+    ext0_dx_insert(dir, &frames[0], dx_get_hash(frame->entries + half), block);
+    dx_set_count(entries, count - half);
+    dx_set_limit(entries, dx_node_limit(dir));
+    dx_set_count(frame->entries, half);
+    mark_buffer_dirty_inode(frame->bh, dir);
+    mark_buffer_dirty_inode(bh, dir);
+
+    if (frame->at >= frame->entries + half)
+    {
+        frame->at = entries + (frame->at - (frame->entries + half));
+        frame->entries = entries;
+        brelse(frame->bh);
+        frame->bh = bh;
+        frames[0].at++;
+    }
+    else
+    {
+        brelse(bh);
+    }
+    return 0;
+}
+
+static int ext0_dx_map_cmp(const void *a, const void *b)
+{
+    u32 ha = ((const struct ext0_dx_map *)a)->hash, hb = ((const struct ext0_dx_map *)b)->hash;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+/* Split the full leaf *bhp in two by hash. The half @hash falls in moves to
+ * a new block, packed, so the name being added has room there. The other
+ * half stays where it is: moving entries within a block could carry them
+ * from after a readdir cursor to before it. On return *bhp is the new block
+ * and *blockp its number
+ */
+static int ext0_dx_split_leaf(struct inode *dir, struct ext0_dx_frame *frame, u32 hash, struct buffer_head **bhp,
+                              unsigned long *blockp)
+{
+    unsigned blocksize = dir->i_sb->s_blocksize;
+    struct buffer_head *bh = *bhp, *new_bh;
+    struct ext0_dir_entry *de, *last = NULL;
+    struct ext0_dx_map *map;
+    unsigned offset, to = 0, n = 0, split, i, end, size, room;
+    unsigned long old_block = dx_get_block(frame->at), block;
+    u32 split_hash;
+    int err;
+
+    map = kmalloc_array(blocksize / EXT0_DIR_REC_LEN(1), sizeof(*map), GFP_NOFS);
+    if (!map)
+        return -ENOMEM;
+
+    /* Leaves are always in the packed layout, see ext0_dir_insert_in_block */
+    for (offset = 0; offset < blocksize; offset += le16_to_cpu(de->rec_len))
+    {
+        de = (struct ext0_dir_entry *)(bh->b_data + offset);
+        if (!de->inode)
+            continue;
+        map[n].hash = ext0_de_hash(dir, de);
+        map[n].offs = offset;
+        map[n].size = ext0_rec_len(dir, de->name_len);
+        n++;
+    }
+
+    err = -ENOSPC;
+    if (n < 2)
+        goto out;
+
+    sort(map, n, sizeof(*map), ext0_dx_map_cmp, NULL);
+
+    /* Split by bytes rather than entries, like ext4's dx_split, so that with
+     * names of mixed lengths each half still ends up with about half the
+     * block free. Both halves keep at least one entry
+     */
+    for (split = n, size = 0; split > 1; split--)
+    {
+        if (size + map[split - 1].size / 2 > blocksize / 2)
+            break;
+        size += map[split - 1].size;
+    }
+    split_hash = map[split].hash;
+    if (map[split - 1].hash == split_hash)
+        split_hash |= 1;
+
+    new_bh = ext0_dir_append(dir, &block, &err);
+    if (!new_bh)
+        goto out;
+
+    i = hash >= split_hash ? split : 0;
+    end = hash >= split_hash ? n : split;
+    for (; i < end; i++)
+    {
+        de = (struct ext0_dir_entry *)(bh->b_data + map[i].offs);
+        last = (struct ext0_dir_entry *)(new_bh->b_data + to);
+        memcpy(last, de, map[i].size);
+        last->rec_len = cpu_to_le16(map[i].size);
+        to += map[i].size;
+        de->inode = 0;
+    }
+    le16_add_cpu(&last->rec_len, blocksize - to);
+    ext0_dir_set_free(dir, block, blocksize - to);
+
+    room = ext0_dir_coalesce(dir, bh->b_data);
+    ext0_dir_set_free(dir, old_block, room);
+    mark_buffer_dirty_inode(bh, dir);
+    mark_buffer_dirty_inode(new_bh, dir);
+
+    if (hash >= split_hash)
+    {
+        ext0_dx_insert(dir, frame, split_hash, block);
+    }
+    else
+    {
+        /* The new block takes over the lower range, the old leaf the upper */
+        frame->at->block = cpu_to_le32(block);
+        ext0_dx_insert(dir, frame, split_hash, old_block);
+    }
+
+    brelse(bh);
+    *bhp = new_bh;
+    *blockp = block;
+    err = 0;
+
+out:
+    kfree(map);
+    return err;
+}
+
+int ext0_dx_add_entry(struct inode *dir, const struct qstr *name, ino_t ino, umode_t mode)
+{
+    struct ext0_dx_frame frames[EXT0_DX_MAX_LEVELS];
+    u32 hash = ext0_dirhash((const char *)name->name, name->len);
+    struct buffer_head *bh;
+    unsigned long block;
+    int levels, err;
+
+    levels = ext0_dx_probe(dir, hash, frames);
+    if (levels < 0)
+        return levels;
+
+    block = dx_get_block(frames[levels].at);
+    bh = ext0_dir_bread(dir, block, &err);
+    if (!bh)
+        goto out;
+
+    err = ext0_dir_insert_in_block(dir, bh, block, name, ino, mode);
+    if (err != -ENOSPC)
+        goto out_bh;
+
+    err = ext0_dx_make_room(dir, frames, &levels);
+    if (err)
+        goto out_bh;
+
+    err = ext0_dx_split_leaf(dir, &frames[levels], hash, &bh, &block);
+    if (!err)
+        err = ext0_dir_insert_in_block(dir, bh, block, name, ino, mode);
+
+out_bh:
+    brelse(bh);
+out:
+    ext0_dx_release(frames, levels);
+    return err;
+}
+
+/* Index a directory whose single block is full. Everything after "." and
+ * ".." moves to a new leaf and block 0 becomes the root, listing that leaf
+ */
+int ext0_dx_make_indexed(struct inode *dir, struct buffer_head *bh)
+{
+    unsigned blocksize = dir->i_sb->s_blocksize;
+    unsigned dot_len = ext0_rec_len(dir, 1);
+    struct ext0_dx_root_info *info;
+    struct ext0_dx_entry *entries;
+    struct ext0_dir_entry *de, *dot, *dotdot;
+    struct buffer_head *leaf_bh;
+    unsigned long block;
+    unsigned start, offset;
+    int err;
+
+    /* The block is packed(ext0_dir_insert_in_block saw it full) */
+    dot = (struct ext0_dir_entry *)bh->b_data;
+    dotdot = (struct ext0_dir_entry *)(bh->b_data + le16_to_cpu(dot->rec_len));
+    start = dot_len + le16_to_cpu(dotdot->rec_len);
+    if (dot->name_len != 1 || dot->name[0] != '.' || le16_to_cpu(dot->rec_len) != dot_len ||
+        dotdot->name_len != 2 || memcmp(dotdot->name, "..", 2) || start >= blocksize)
+    {
+        ext0_debug("Directory does not start with . and ..: inode=%lu", dir->i_ino);
+        return -EIO;
+    }
+
+    leaf_bh = ext0_dir_append(dir, &block, &err);
+    if (!leaf_bh)
+        return err;
+
+    memcpy(leaf_bh->b_data, bh->b_data + start, blocksize - start);
+    for (offset = 0; offset < blocksize - start; offset += le16_to_cpu(de->rec_len))
+        de = (struct ext0_dir_entry *)(leaf_bh->b_data + offset);
+    le16_add_cpu(&de->rec_len, start);
+    mark_buffer_dirty_inode(leaf_bh, dir);
+    brelse(leaf_bh);
+
+    dotdot->rec_len = cpu_to_le16(blocksize - dot_len);
+    info = dx_root_info(dir, bh);
+    memset(info, 0, bh->b_data + blocksize - (char *)info);
+    info->hash_version = EXT0_DX_HASH_FNV;
+    info->info_length = sizeof(*info);
+    entries = dx_root_entries(info);
+    dx_set_limit(entries, dx_root_limit(dir));
+    dx_set_count(entries, 1);
+    entries[0].block = cpu_to_le32(block);
+    mark_buffer_dirty_inode(bh, dir);
+
+    EXT0_I(dir)->i_flags |= EXT0_INDEX_FL;
+    mark_inode_dirty(dir);
+    return 0;
+}
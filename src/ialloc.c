@@ -0,0 +1,221 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+
+#include "ext0.h"
+
+/*
+ * Inode allocation. Every group has an inode bitmap(gdesc->bg_inode_bitmap)
+ * with one bit per slot of its inode table. Bits are claimed and released
+ * with atomic bitops, so the only lock taken is the group lock around
+ * bg_free_inodes_count. Allocating or freeing an inode only dirties the
+ * bitmap and descriptor of its group. s_freeinodes_counter keeps the
+ * filesystem wide count, sync_fs folds it into s_free_inodes_count.
+ */
+
+static struct buffer_head *ext0_read_inode_bitmap(struct super_block *sb, struct ext0_block_descriptor *gdesc)
+{
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, le32_to_cpu(gdesc->bg_inode_bitmap));
+    if (!bh)
+        ext0_debug("Could not perform I/O for inode bitmap: %u", le32_to_cpu(gdesc->bg_inode_bitmap));
+    return bh;
+}
+
+/* Directories are spread over the groups: each CPU walks its own rotor so
+ * parallel mkdirs land in different groups. Everything else goes next to
+ * its parent.
+ */
+static unsigned long ext0_find_group(struct inode *dir, umode_t mode)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(dir->i_sb);
+    unsigned long group;
+
+    if (S_ISDIR(mode))
+    {
+        unsigned int *rotor = get_cpu_ptr(in_mem_sb->s_dir_rotor);
+
+        group = *rotor % in_mem_sb->s_groups_count;
+        *rotor = group + 1;
+        put_cpu_ptr(in_mem_sb->s_dir_rotor);
+        return group;
+    }
+
+    group = EXT0_I(dir)->i_block_group;
+    return group < in_mem_sb->s_groups_count ? group : 0;
+}
+
+/* Claim the first free bit in [start, end). Losing a race for a bit just
+ * moves us on to the next free one. Returns -1 if there is none.
+ */
+static long ext0_claim_bit(void *bitmap, unsigned long start, unsigned long end)
+{
+    unsigned long bit = start;
+
+    while ((bit = ext0_find_next_zero_bit(bitmap, end, bit)) < end)
+    {
+        if (!ext0_test_and_set_bit_atomic(bit, bitmap))
+            return bit;
+        bit++;
+    }
+    return -1;
+}
+
+/* Claim a free inode in @group, searching from the group's hint. Returns the
+ * bit claimed or -1 if the group is full.
+ */
+static long ext0_claim_inode(struct super_block *sb, unsigned long group, struct buffer_head *bitmap_bh)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    struct ext0_group_info *gi = &in_mem_sb->s_group_info[group];
+    unsigned long start = READ_ONCE(gi->gi_next_ino);
+    long bit;
+
+    if (start >= in_mem_sb->s_inodes_per_group)
+        start = 0;
+
+    bit = ext0_claim_bit(bitmap_bh->b_data, start, in_mem_sb->s_inodes_per_group);
+    if (bit < 0)
+        bit = ext0_claim_bit(bitmap_bh->b_data, 0, start);
+    if (bit >= 0)
+        WRITE_ONCE(gi->gi_next_ino, bit + 1);
+    return bit;
+}
+
+/* Claim a free inode for a new @mode child of @dir. Returns the inode
+ * number or 0 with *err set.
+ */
+ino_t ext0_new_ino(struct inode *dir, umode_t mode, int *err)
+{
+    struct super_block *sb = dir->i_sb;
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    unsigned long group, i;
+    int retried = 0;
+
+retry:
+    group = ext0_find_group(dir, mode);
+
+    for (i = 0; i < in_mem_sb->s_groups_count; i++)
+    {
+        struct ext0_block_descriptor *gdesc;
+        struct buffer_head *gdesc_bh, *bitmap_bh;
+        long bit;
+
+        /* Unlocked peek, the bitmap has the final say */
+        gdesc = ext0_get_group_desc(sb, group, &gdesc_bh);
+        if (!gdesc || !le16_to_cpu(READ_ONCE(gdesc->bg_free_inodes_count)))
+            goto next;
+
+        bitmap_bh = ext0_read_inode_bitmap(sb, gdesc);
+        if (!bitmap_bh)
+        {
+            *err = -EIO;
+            return 0;
+        }
+
+        bit = ext0_claim_inode(sb, group, bitmap_bh);
+        if (bit >= 0)
+        {
+            spin_lock(ext0_group_lock_ptr(in_mem_sb, group));
+            le16_add_cpu(&gdesc->bg_free_inodes_count, -1);
+            spin_unlock(ext0_group_lock_ptr(in_mem_sb, group));
+
+            percpu_counter_dec(&in_mem_sb->s_freeinodes_counter);
+            mark_buffer_dirty(bitmap_bh);
+            mark_buffer_dirty(gdesc_bh);
+            brelse(bitmap_bh);
+            *err = 0;
+            return EXT0_MAKE_INO(group * in_mem_sb->s_inodes_per_group + bit);
+        }
+        brelse(bitmap_bh);
+
+    next:
+        group = (group + 1) % in_mem_sb->s_groups_count;
+    }
+
+    /* Deleted inodes are only freed once their blocks are */
+    if (!retried && ext0_reclaim_flush(sb))
+    {
+        retried = 1;
+        goto retry;
+    }
+
+    *err = -ENOSPC;
+    return 0;
+}
+
+void ext0_free_ino(struct super_block *sb, ino_t ino)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    struct ext0_block_descriptor *gdesc;
+    struct buffer_head *gdesc_bh, *bitmap_bh;
+    unsigned long group, bit;
+
+    if (ino <= EXT0_ROOT_INO || ino > le32_to_cpu(in_mem_sb->s_es->s_inodes_count))
+    {
+        ext0_debug("Freeing reserved or nonexistent inode: %lu", (unsigned long)ino);
+        return;
+    }
+
+    group = ext0_inode_group(sb, ino);
+    gdesc = ext0_get_group_desc(sb, group, &gdesc_bh);
+    if (!gdesc)
+        return;
+
+    bitmap_bh = ext0_read_inode_bitmap(sb, gdesc);
+    if (!bitmap_bh)
+        return;
+
+    bit = EXT0_GET_INO(ino) % in_mem_sb->s_inodes_per_group;
+
+    if (ext0_test_and_clear_bit_atomic(bit, bitmap_bh->b_data))
+    {
+        spin_lock(ext0_group_lock_ptr(in_mem_sb, group));
+        le16_add_cpu(&gdesc->bg_free_inodes_count, 1);
+        spin_unlock(ext0_group_lock_ptr(in_mem_sb, group));
+
+        percpu_counter_inc(&in_mem_sb->s_freeinodes_counter);
+        mark_buffer_dirty(bitmap_bh);
+        mark_buffer_dirty(gdesc_bh);
+    }
+    else
+        ext0_debug("Bit already cleared for inode: %lu", (unsigned long)ino);
+    brelse(bitmap_bh);
+}
+
+/* Are all the inodes that share @ino's inode table block, other than @ino,
+ * free? Only answers yes when the group's bitmap is in memory already, this
+ * is a shortcut that must not cost a read
+ */
+int ext0_inode_block_unused(struct super_block *sb, ino_t ino)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    struct ext0_block_descriptor *gdesc;
+    struct buffer_head *bitmap_bh;
+    unsigned long bit, first, end, i;
+    int unused = 0;
+
+    gdesc = ext0_get_group_desc(sb, ext0_inode_group(sb, ino), NULL);
+    if (!gdesc)
+        return 0;
+
+    bitmap_bh = sb_find_get_block(sb, le32_to_cpu(gdesc->bg_inode_bitmap));
+    if (!bitmap_bh)
+        return 0;
+
+    if (buffer_uptodate(bitmap_bh))
+    {
+        bit = EXT0_GET_INO(ino) % in_mem_sb->s_inodes_per_group;
+        first = bit - bit % in_mem_sb->s_inodes_per_block;
+        end = min(first + in_mem_sb->s_inodes_per_block, in_mem_sb->s_inodes_per_group);
+
+        unused = 1;
+        for (i = first; i < end && unused; i++)
+        {
+            if (i != bit && ext0_test_bit(i, bitmap_bh->b_data))
+                unused = 0;
+        }
+    }
+    brelse(bitmap_bh);
+    return unused;
+}
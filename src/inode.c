@@ -1,292 +1,765 @@
-#include <linux/buffer_head.h>
-#include <linux/mpage.h>
-#include <linux/string.h>
-#include <linux/vfs.h>
-#include <linux/writeback.h>
-
-#include "ext0.h"
-
-static void ext0_write_failed(struct address_space *mapping, loff_t to)
-{
-    struct inode *inode = mapping->host;
-
-    if (to > inode->i_size)
-    {
-        truncate_pagecache(inode, inode->i_size);
-        // ext0_truncate(inode);
-    }
-}
-
-static int ext0_writepage(struct page *page, struct writeback_control *wbc)
-{
-    return block_write_full_page(page, ext0_get_block, wbc);
-}
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
-
-static int ext0_read_folio(struct file *file, struct folio *folio)
-{
-    return mpage_read_folio(folio, ext0_get_block);
-}
-
-static int ext0_write_begin(struct file *file, struct address_space *mapping,
-                            loff_t pos, unsigned len, struct page **pagep, void **fsdata)
-{
-    int ret;
-    ret = block_write_begin(mapping, pos, len, pagep, ext0_get_block);
-    if (EXT0_IS_ERR(ret))
-        ext0_write_failed(mapping, pos + len);
-    return ret;
-}
-
-#else
-
-static int ext0_write_begin(struct file *file, struct address_space *mapping,
-                            loff_t pos, unsigned len, unsigned flags,
-                            struct page **pagep, void **fsdata)
-{
-    int ret;
-    ret = block_write_begin(mapping, pos, len, flags, pagep, ext0_get_block);
-    if (EXT0_IS_ERR(ret))
-        ext0_write_failed(mapping, pos + len);
-    return ret;
-}
-
-static int ext0_readpage(struct file *file, struct page *page)
-{
-    return mpage_readpage(page, ext0_get_block);
-}
-
-static int ext0_readpages(struct file *file, struct address_space *mapping,
-                          struct list_head *pages, unsigned nr_pages)
-{
-    return mpage_readpages(mapping, pages, nr_pages, ext0_get_block);
-}
-#endif
-
-static int ext0_write_end(struct file *file, struct address_space *mapping,
-                          loff_t pos, unsigned len, unsigned copied,
-                          struct page *page, void *fsdata);
-static sector_t ext0_bmap(struct address_space *mapping, sector_t block);
-static int ext0_writepages(struct address_space *mapping, struct writeback_control *wbc);
-
-int ext0_get_block(struct inode *inode, sector_t iblock,
-                   struct buffer_head *bh_result, int create)
-{
-    struct super_block *sb = inode->i_sb;
-    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
-    struct ext0_block_descriptor *gdesc;
-    struct buffer_head *bh;
-    unsigned blk_no;
-    off_t offset = 0;
-    unsigned long phys_start;
-
-    blk_no = ext0_inode_block(inode->i_ino) - 1;
-    if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-        blk_no = fs_to_dev_block_num(sb, blk_no, &offset);
-
-    bh = in_mem_sb->s_group_desc[EXT0_GET_INO(inode->i_ino)];
-    gdesc = (struct ext0_block_descriptor *)(bh->b_data + offset);
-
-    spin_lock(&in_mem_sb->s_lock);
-
-    phys_start = gdesc->bg_first_block + iblock - 1;
-    if (!create)
-    {
-        map_bh(bh_result, sb, phys_start);
-        spin_unlock(&in_mem_sb->s_lock);
-        return 0;
-    }
-
-    if (inode->i_blocks < (iblock + 1))
-    {
-        ext0_debug("Invalid block number: %llu", (unsigned long long)iblock);
-        spin_unlock(&in_mem_sb->s_lock);
-        return -ENOSPC;
-    }
-
-    map_bh(bh_result, sb, phys_start);
-    set_buffer_new(bh_result);
-    spin_unlock(&in_mem_sb->s_lock);
-    return 0;
-}
-
-const struct address_space_operations ext0_aops = {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
-    .read_folio = ext0_read_folio,
-    .dirty_folio = block_dirty_folio,
-    .invalidate_folio = block_invalidate_folio,
-    .error_remove_folio = generic_error_remove_folio,
-    .migrate_folio = buffer_migrate_folio,
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
-    .read_folio = ext0_read_folio,
-    .dirty_folio = block_dirty_folio,
-    .invalidate_folio = block_invalidate_folio,
-    .error_remove_page = generic_error_remove_page,
-    .migrate_folio = buffer_migrate_folio,
-#else
-    .readpage = ext0_readpage,
-    .readpages = ext0_readpages,
-    .writepage = ext0_writepage,
-    .error_remove_page = generic_error_remove_page,
-    .migratepage = buffer_migrate_page,
-#endif
-
-    .writepage = ext0_writepage,
-    .write_begin = ext0_write_begin,
-    .write_end = ext0_write_end,
-    .bmap = ext0_bmap,
-    .writepages = ext0_writepages,
-    .is_partially_uptodate = block_is_partially_uptodate,
-};
-
-static int ext0_write_end(struct file *file, struct address_space *mapping,
-                          loff_t pos, unsigned len, unsigned copied,
-                          struct page *page, void *fsdata)
-{
-    int ret;
-    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-    if (EXT0_IS_ERR(ret))
-        ext0_write_failed(mapping, pos + len);
-    return ret;
-}
-
-static sector_t ext0_bmap(struct address_space *mapping, sector_t block)
-{
-    return generic_block_bmap(mapping, block, ext0_get_block);
-}
-
-static int ext0_writepages(struct address_space *mapping, struct writeback_control *wbc)
-{
-    return mpage_writepages(mapping, wbc, ext0_get_block);
-}
-
-static struct ext0_inode *ext0_get_inode(struct super_block *sb, ino_t ino, struct buffer_head **ptr)
-{
-    struct ext0_inode *on_disk_inode;
-    struct buffer_head *bh;
-    off_t offset;
-    unsigned long blk_no;
-
-    offset = 0;
-    blk_no = ext0_inode_block(ino);
-    if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-        blk_no = fs_to_dev_block_num(sb, blk_no, &offset);
-
-    bh = sb_bread(sb, blk_no);
-    if (!bh)
-        return ERR_PTR(-EIO);
-    on_disk_inode = (struct ext0_inode *)(bh->b_data + offset);
-
-    *ptr = bh;
-    return on_disk_inode;
-}
-
-int ext0_write_inode(struct inode *inode, struct writeback_control *wbc)
-{
-    int do_sync = wbc->sync_mode == WB_SYNC_ALL;
-    struct ext0_inode_info *in_mem_inode = EXT0_I(inode);
-    struct super_block *sb = inode->i_sb;
-    struct buffer_head *bh;
-    struct ext0_inode *on_disk_inode = ext0_get_inode(sb, inode->i_ino, &bh);
-    unsigned long i;
-
-    on_disk_inode->i_flags = cpu_to_le32(in_mem_inode->i_flags);
-    if (!on_disk_inode->i_dtime)
-        on_disk_inode->i_dtime = cpu_to_le32(in_mem_inode->i_dtime);
-    on_disk_inode->i_size = cpu_to_le32(inode->i_size);
-    on_disk_inode->i_blocks = cpu_to_le32(inode->i_blocks);
-    on_disk_inode->i_atime = cpu_to_le32(inode->i_atime.tv_sec);
-    on_disk_inode->i_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
-    on_disk_inode->i_mtime = cpu_to_le32(inode->i_mtime.tv_sec);
-    on_disk_inode->i_mode = cpu_to_le16(inode->i_mode);
-
-    for (i = 0; i < EXT0_FS_MAX_DIRECT_BLOCKS; i++)
-    {
-        on_disk_inode->i_block[i] = in_mem_inode->i_data[i];
-    }
-
-    mark_buffer_dirty(bh);
-    if (do_sync)
-        sync_dirty_buffer(bh);
-    brelse(bh);
-    return 0;
-}
-
-void ext0_evict_inode(struct inode *inode)
-{
-    struct ext0_inode_info *in_mem_inode = EXT0_I(inode);
-    struct writeback_control wbc;
-    struct super_block *sb = inode->i_sb;
-    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
-    struct ext0_super_block *on_disk_sb = EXT0_SB(sb)->s_es;
-
-    ext0_test_and_clear_bit(EXT0_GET_INO(inode->i_ino), (void *)on_disk_sb->s_inode_bitmap);
-
-    in_mem_inode->i_dtime = ktime_get_real_seconds();
-    wbc.sync_mode = 1;
-    ext0_write_inode(inode, &wbc);
-    mark_buffer_dirty(in_mem_sb->s_sbh);
-
-    memset(in_mem_inode->i_data, 0, EXT0_FS_MAX_DIRECT_BLOCKS * sizeof(__le32));
-    truncate_inode_pages_final(inode->i_mapping);
-    clear_inode(inode);
-}
-
-struct inode *ext0_iget(struct super_block *sb, ino_t ino)
-{
-    struct inode *inode;
-    struct ext0_inode *on_disk_inode;
-    struct ext0_inode_info *in_mem_inode;
-    unsigned long i;
-    struct buffer_head *bh;
-
-    inode = iget_locked(sb, ino);
-    if (!inode)
-        return ERR_PTR(-ENOMEM);
-    if (!(inode->i_state & I_NEW))
-        return inode;
-
-    in_mem_inode = EXT0_I(inode);
-    on_disk_inode = ext0_get_inode(sb, ino, &bh);
-    if (!on_disk_inode)
-        return ERR_PTR(-EIO);
-
-    in_mem_inode->i_flags = le32_to_cpu(on_disk_inode->i_flags);
-    in_mem_inode->i_block_group = ino;
-
-    for (i = 0; i < EXT0_FS_MAX_DIRECT_BLOCKS; i++)
-    {
-        in_mem_inode->i_data[i] = le32_to_cpu(on_disk_inode->i_block[i]);
-    }
-
-    inode->i_mode = le32_to_cpu(on_disk_inode->i_mode);
-    inode->i_size = le32_to_cpu(on_disk_inode->i_size);
-    inode->i_atime.tv_sec = le32_to_cpu(on_disk_inode->i_atime);
-    inode->i_ctime.tv_sec = le32_to_cpu(on_disk_inode->i_ctime);
-    inode->i_mtime.tv_sec = le32_to_cpu(on_disk_inode->i_mtime);
-    inode->i_flags = in_mem_inode->i_flags;
-    inode->i_blocks = le32_to_cpu(on_disk_inode->i_blocks);
-    inode->i_sb = sb;
-    inode->i_ino = ino;
-    in_mem_inode->i_dtime = 0;
-    inode->i_blkbits = EXT0_FS_BLOCK_BITS;
-
-    if (S_ISREG(inode->i_mode))
-    {
-        inode->i_op = &ext0_file_inode_operations;
-        inode->i_mapping->a_ops = &ext0_aops;
-        inode->i_fop = &ext0_file_operations;
-    }
-    else if (S_ISDIR(inode->i_mode))
-    {
-        inode->i_op = &ext0_dir_inode_operations;
-        inode->i_mapping->a_ops = &ext0_aops;
-        inode->i_fop = &ext0_dir_operations;
-    }
-
-    brelse(bh);
-    unlock_new_inode(inode);
-
-    return inode;
-}
+#include <linux/buffer_head.h>
+#include <linux/iomap.h>
+#include <linux/mpage.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vfs.h>
+#include <linux/writeback.h>
+
+#include "ext0.h"
+
+static void ext0_write_failed(struct address_space *mapping, loff_t to)
+{
+    struct inode *inode = mapping->host;
+
+    if (to > inode->i_size)
+    {
+        truncate_pagecache(inode, inode->i_size);
+        // ext0_truncate(inode);
+    }
+}
+
+static int ext0_writepage(struct page *page, struct writeback_control *wbc)
+{
+    return block_write_full_page(page, ext0_get_block, wbc);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+
+static int ext0_read_folio(struct file *file, struct folio *folio)
+{
+    return mpage_read_folio(folio, ext0_get_block);
+}
+
+/* ext0_get_block maps as much of a run as one extent covers, so each bio
+ * spans a whole extent of the readahead window
+ */
+static void ext0_readahead(struct readahead_control *rac)
+{
+    mpage_readahead(rac, ext0_get_block);
+}
+
+static int ext0_write_begin(struct file *file, struct address_space *mapping,
+                            loff_t pos, unsigned len, struct page **pagep, void **fsdata)
+{
+    int ret;
+    ret = block_write_begin(mapping, pos, len, pagep, ext0_get_block);
+    if (EXT0_IS_ERR(ret))
+        ext0_write_failed(mapping, pos + len);
+    return ret;
+}
+
+#else
+
+static int ext0_write_begin(struct file *file, struct address_space *mapping,
+                            loff_t pos, unsigned len, unsigned flags,
+                            struct page **pagep, void **fsdata)
+{
+    int ret;
+    ret = block_write_begin(mapping, pos, len, flags, pagep, ext0_get_block);
+    if (EXT0_IS_ERR(ret))
+        ext0_write_failed(mapping, pos + len);
+    return ret;
+}
+
+static int ext0_readpage(struct file *file, struct page *page)
+{
+    return mpage_readpage(page, ext0_get_block);
+}
+
+static int ext0_readpages(struct file *file, struct address_space *mapping,
+                          struct list_head *pages, unsigned nr_pages)
+{
+    return mpage_readpages(mapping, pages, nr_pages, ext0_get_block);
+}
+#endif
+
+static int ext0_write_end(struct file *file, struct address_space *mapping,
+                          loff_t pos, unsigned len, unsigned copied,
+                          struct page *page, void *fsdata);
+static sector_t ext0_bmap(struct address_space *mapping, sector_t block);
+static int ext0_writepages(struct address_space *mapping, struct writeback_control *wbc);
+
+int ext0_get_block(struct inode *inode, sector_t iblock,
+                   struct buffer_head *bh_result, int create)
+{
+    struct ext0_map_blocks map;
+    int ret;
+
+    map.m_lblk = iblock;
+    map.m_len = bh_result->b_size >> inode->i_blkbits;
+    if (!map.m_len)
+        map.m_len = 1;
+
+    /* There is no I/O completion hook here, written blocks are converted up front */
+    ret = ext0_ext_map_blocks(inode, &map, create ? EXT0_GET_BLOCKS_CREATE | EXT0_GET_BLOCKS_CONVERT : 0);
+    if (ret <= 0)
+        return ret;
+
+    /* Unwritten blocks read as zeros, leave the buffer unmapped like a hole */
+    if (map.m_flags & EXT0_MAP_UNWRITTEN)
+        return 0;
+
+    map_bh(bh_result, inode->i_sb, map.m_pblk);
+    bh_result->b_size = (size_t)map.m_len << inode->i_blkbits;
+    if (map.m_flags & EXT0_MAP_NEW)
+        set_buffer_new(bh_result);
+    return 0;
+}
+
+const struct address_space_operations ext0_aops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    .read_folio = ext0_read_folio,
+    .readahead = ext0_readahead,
+    .dirty_folio = block_dirty_folio,
+    .invalidate_folio = block_invalidate_folio,
+    .error_remove_folio = generic_error_remove_folio,
+    .migrate_folio = buffer_migrate_folio,
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+    .read_folio = ext0_read_folio,
+    .readahead = ext0_readahead,
+    .dirty_folio = block_dirty_folio,
+    .invalidate_folio = block_invalidate_folio,
+    .error_remove_page = generic_error_remove_page,
+    .migrate_folio = buffer_migrate_folio,
+#else
+    .readpage = ext0_readpage,
+    .readpages = ext0_readpages,
+    .writepage = ext0_writepage,
+    .error_remove_page = generic_error_remove_page,
+    .migratepage = buffer_migrate_page,
+#endif
+
+    .writepage = ext0_writepage,
+    .write_begin = ext0_write_begin,
+    .write_end = ext0_write_end,
+    .bmap = ext0_bmap,
+    .writepages = ext0_writepages,
+    .is_partially_uptodate = block_is_partially_uptodate,
+};
+
+static int ext0_write_end(struct file *file, struct address_space *mapping,
+                          loff_t pos, unsigned len, unsigned copied,
+                          struct page *page, void *fsdata)
+{
+    int ret;
+    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    if (EXT0_IS_ERR(ret))
+        ext0_write_failed(mapping, pos + len);
+    return ret;
+}
+
+static sector_t ext0_bmap(struct address_space *mapping, sector_t block)
+{
+    return generic_block_bmap(mapping, block, ext0_get_block);
+}
+
+static int ext0_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    return mpage_writepages(mapping, wbc, ext0_get_block);
+}
+
+#ifdef EXT0_IOMAP
+
+/*
+ * Regular file data goes through iomap. Each call maps as much of the range
+ * as one extent(or one hole) covers, so large reads and writes build
+ * multi-page bios with a single lookup per extent instead of one
+ * ext0_get_block call and one buffer_head per block. Buffered writes
+ * allocate their blocks in ext0_iomap_begin, iomap zeroes the parts of new
+ * blocks that are not written. Unwritten extents are reported as such, to
+ * reads and writes alike: iomap reads them as zeros and zeroes what a write
+ * does not cover, and they only turn written when the I/O to them completes
+ * (see ext0_ioend_work). Direct writes allocate holes as unwritten too, so
+ * a buffered read racing with them sees zeros and not what the disk held
+ * before. Zeroing(IOMAP_ZERO) leaves holes and unwritten blocks alone.
+ */
+static int ext0_iomap_begin(struct inode *inode, loff_t offset, loff_t length, unsigned flags,
+                            struct iomap *iomap, struct iomap *srcmap)
+{
+    unsigned blkbits = inode->i_blkbits;
+    sector_t first = offset >> blkbits, last = (offset + length - 1) >> blkbits;
+    struct ext0_map_blocks map;
+    int map_flags = 0, ret;
+
+    map.m_lblk = first;
+    map.m_len = min_t(sector_t, last - first + 1, UINT_MAX);
+
+    if ((flags & IOMAP_WRITE) && !(flags & IOMAP_ZERO))
+        map_flags |= EXT0_GET_BLOCKS_CREATE;
+    if (flags & IOMAP_DIRECT)
+        map_flags |= EXT0_GET_BLOCKS_UNWRITTEN;
+    if (flags & IOMAP_NOWAIT)
+        map_flags |= EXT0_GET_BLOCKS_NOWAIT;
+
+    ret = ext0_ext_map_blocks(inode, &map, map_flags);
+    if (ret < 0)
+        return ret;
+
+    iomap->bdev = inode->i_sb->s_bdev;
+    iomap->offset = (u64)map.m_lblk << blkbits;
+    iomap->length = (u64)map.m_len << blkbits;
+    iomap->flags = 0;
+
+    if (!ret)
+    {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        return 0;
+    }
+
+    iomap->type = map.m_flags & EXT0_MAP_UNWRITTEN ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+    iomap->addr = (u64)map.m_pblk << blkbits;
+    if (map.m_flags & EXT0_MAP_NEW)
+        iomap->flags |= IOMAP_F_NEW;
+    return 0;
+}
+
+static int ext0_iomap_end(struct inode *inode, loff_t offset, loff_t length, ssize_t written, unsigned flags,
+                          struct iomap *iomap)
+{
+    /* iomap_write_end moved i_size */
+    if (iomap->flags & IOMAP_F_SIZE_CHANGED)
+        mark_inode_dirty(inode);
+
+    if ((flags & IOMAP_WRITE) && written < length)
+    {
+        /* Blocks allocated for the write that it did not get to would show
+         * whatever the disk held there, give them back. Preallocated ones
+         * are never IOMAP_F_NEW and stay
+         */
+        if (iomap->flags & IOMAP_F_NEW)
+            ext0_ext_punch(inode, round_up(offset + written, i_blocksize(inode)) >> inode->i_blkbits,
+                           round_up(offset + length, i_blocksize(inode)) >> inode->i_blkbits);
+        ext0_write_failed(inode->i_mapping, offset + length);
+    }
+    return 0;
+}
+
+const struct iomap_ops ext0_iomap_ops = {
+    .iomap_begin = ext0_iomap_begin,
+    .iomap_end = ext0_iomap_end,
+};
+
+/* Writeback keeps the last mapping in @wpc and only maps again past it. Blocks
+ * written through write(2) were allocated by ext0_iomap_begin, a hole here
+ * comes from a write through mmap and gets just the blocks being written.
+ * Unwritten blocks are written to as they are, their ioend converts them
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static int ext0_writeback_map(struct iomap_writepage_ctx *wpc, struct inode *inode, loff_t offset, unsigned len)
+#else
+static int ext0_writeback_map(struct iomap_writepage_ctx *wpc, struct inode *inode, loff_t offset)
+#endif
+{
+    loff_t end = round_up(i_size_read(inode), i_blocksize(inode));
+    int ret;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+    unsigned len = i_blocksize(inode);
+#endif
+
+    if (offset >= wpc->iomap.offset && offset < wpc->iomap.offset + wpc->iomap.length)
+        return 0;
+
+    ret = ext0_iomap_begin(inode, offset, max_t(loff_t, end - offset, len), 0, &wpc->iomap, NULL);
+    if (!ret && wpc->iomap.type == IOMAP_HOLE)
+        ret = ext0_iomap_begin(inode, offset, len, IOMAP_WRITE, &wpc->iomap, NULL);
+    return ret;
+}
+
+/*
+ * Unwritten extents become written only once their data is on disk, so an
+ * I/O error or a crash in between leaves them reading as zeros rather than
+ * as whatever the blocks held. Writeback ioends over unwritten blocks end on
+ * s_ioend_wq, where the extent tree can be changed, before iomap ends
+ * writeback on their folios. Direct I/O converts from its ->end_io(see
+ * file.c), which iomap already runs in process context.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define EXT0_IOEND_BIO(ioend) (&(ioend)->io_bio)
+#else
+#define EXT0_IOEND_BIO(ioend) ((ioend)->io_bio)
+#endif
+
+static void ext0_ioend_work(struct work_struct *work)
+{
+    struct ext0_super_block_info *in_mem_sb = container_of(work, struct ext0_super_block_info, s_ioend_work);
+    struct iomap_ioend *ioend;
+    struct inode *inode;
+    LIST_HEAD(list);
+    int err;
+
+    spin_lock_irq(&in_mem_sb->s_ioend_lock);
+    list_splice_init(&in_mem_sb->s_ioend_list, &list);
+    spin_unlock_irq(&in_mem_sb->s_ioend_lock);
+
+    while (!list_empty(&list))
+    {
+        ioend = list_first_entry(&list, struct iomap_ioend, io_list);
+        list_del_init(&ioend->io_list);
+        inode = ioend->io_inode;
+
+        err = blk_status_to_errno(EXT0_IOEND_BIO(ioend)->bi_status);
+        if (!err)
+            err = ext0_ext_convert_range(inode, ioend->io_offset >> inode->i_blkbits,
+                                         DIV_ROUND_UP(ioend->io_offset + ioend->io_size, i_blocksize(inode)));
+        iomap_finish_ioends(ioend, err);
+        cond_resched();
+    }
+}
+
+static void ext0_end_bio(struct bio *bio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+    struct iomap_ioend *ioend = iomap_ioend_from_bio(bio);
+#else
+    struct iomap_ioend *ioend = bio->bi_private;
+#endif
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(ioend->io_inode->i_sb);
+    unsigned long flags;
+
+    spin_lock_irqsave(&in_mem_sb->s_ioend_lock, flags);
+    list_add_tail(&ioend->io_list, &in_mem_sb->s_ioend_list);
+    spin_unlock_irqrestore(&in_mem_sb->s_ioend_lock, flags);
+    queue_work(in_mem_sb->s_ioend_wq, &in_mem_sb->s_ioend_work);
+}
+
+static int ext0_prepare_ioend(struct iomap_ioend *ioend, int status)
+{
+    if (!status && ioend->io_type == IOMAP_UNWRITTEN)
+        EXT0_IOEND_BIO(ioend)->bi_end_io = ext0_end_bio;
+    return status;
+}
+
+static const struct iomap_writeback_ops ext0_writeback_ops = {
+    .map_blocks = ext0_writeback_map,
+    .prepare_ioend = ext0_prepare_ioend,
+};
+
+static int ext0_iomap_read_folio(struct file *file, struct folio *folio)
+{
+    return iomap_read_folio(folio, &ext0_iomap_ops);
+}
+
+static void ext0_iomap_readahead(struct readahead_control *rac)
+{
+    iomap_readahead(rac, &ext0_iomap_ops);
+}
+
+static int ext0_iomap_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    struct iomap_writepage_ctx wpc = {};
+
+    return iomap_writepages(mapping, wbc, &wpc, &ext0_writeback_ops);
+}
+
+static sector_t ext0_iomap_bmap(struct address_space *mapping, sector_t block)
+{
+    return iomap_bmap(mapping, block, &ext0_iomap_ops);
+}
+
+const struct address_space_operations ext0_iomap_aops = {
+    .read_folio = ext0_iomap_read_folio,
+    .readahead = ext0_iomap_readahead,
+    .writepages = ext0_iomap_writepages,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+    .dirty_folio = iomap_dirty_folio,
+#else
+    .dirty_folio = filemap_dirty_folio,
+#endif
+    .release_folio = iomap_release_folio,
+    .invalidate_folio = iomap_invalidate_folio,
+    .bmap = ext0_iomap_bmap,
+    .migrate_folio = filemap_migrate_folio,
+    .is_partially_uptodate = iomap_is_partially_uptodate,
+#ifndef FMODE_CAN_ODIRECT
+    .direct_IO = noop_direct_IO, /* O_DIRECT goes through iomap_dio_rw, see file.c */
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    .error_remove_folio = generic_error_remove_folio,
+#else
+    .error_remove_page = generic_error_remove_page,
+#endif
+};
+
+#endif /* EXT0_IOMAP */
+
+int ext0_ioend_init(struct super_block *sb)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+
+    spin_lock_init(&in_mem_sb->s_ioend_lock);
+    INIT_LIST_HEAD(&in_mem_sb->s_ioend_list);
+#ifdef EXT0_IOMAP
+    INIT_WORK(&in_mem_sb->s_ioend_work, ext0_ioend_work);
+
+    /* Writeback waits on it to end, it must make progress under memory pressure */
+    in_mem_sb->s_ioend_wq = alloc_workqueue("ext0-ioend/%s", WQ_MEM_RECLAIM, 0, sb->s_id);
+    if (!in_mem_sb->s_ioend_wq)
+        return -ENOMEM;
+#endif
+    return 0;
+}
+
+void ext0_ioend_exit(struct ext0_super_block_info *in_mem_sb)
+{
+    if (!in_mem_sb->s_ioend_wq)
+        return;
+    destroy_workqueue(in_mem_sb->s_ioend_wq);
+    in_mem_sb->s_ioend_wq = NULL;
+}
+
+/* Regular files use ext0_file_aops. On the iomap path their page cache may
+ * hold folios larger than a page: readahead, writes and writeback then work
+ * on fewer, bigger folios and mmap can map them with huge pages(see
+ * thp_get_unmapped_area in file.c). Directories are read through the block
+ * device's buffer cache, their own mapping holds nothing
+ */
+void ext0_set_aops(struct inode *inode)
+{
+    if (!S_ISREG(inode->i_mode))
+    {
+        inode->i_mapping->a_ops = &ext0_aops;
+        return;
+    }
+
+    inode->i_mapping->a_ops = &ext0_file_aops;
+#ifdef EXT0_IOMAP
+    mapping_set_large_folios(inode->i_mapping);
+#endif
+}
+
+/* Inodes are packed s_inodes_per_block to a block in their group's inode
+ * table. Finds the block holding @ino and where in it @ino starts
+ */
+int ext0_inode_block(struct super_block *sb, ino_t ino, unsigned long *block, unsigned *offset)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    struct ext0_block_descriptor *gdesc;
+    unsigned long index;
+
+    if (ino < EXT0_ROOT_INO || ino > le32_to_cpu(in_mem_sb->s_es->s_inodes_count))
+    {
+        ext0_debug("Inode number out of range: %lu", (unsigned long)ino);
+        return -EINVAL;
+    }
+
+    gdesc = ext0_get_group_desc(sb, ext0_inode_group(sb, ino), NULL);
+    if (!gdesc)
+        return -EIO;
+
+    index = EXT0_GET_INO(ino) % in_mem_sb->s_inodes_per_group;
+    *block = le32_to_cpu(gdesc->bg_inode_table) + index / in_mem_sb->s_inodes_per_block;
+    *offset = (index % in_mem_sb->s_inodes_per_block) * in_mem_sb->s_inode_size;
+    return 0;
+}
+
+/* Neighbours of @ino share the returned buffer */
+static struct ext0_inode *ext0_get_inode(struct super_block *sb, ino_t ino, struct buffer_head **ptr)
+{
+    struct buffer_head *bh;
+    unsigned long blk_no;
+    unsigned offset;
+    int ret;
+
+    ret = ext0_inode_block(sb, ino, &blk_no, &offset);
+    if (ret)
+        return ERR_PTR(ret);
+
+    bh = sb_bread(sb, blk_no);
+    if (!bh)
+        return ERR_PTR(-EIO);
+
+    *ptr = bh;
+    return (struct ext0_inode *)(bh->b_data + offset);
+}
+
+/* Like ext0_get_inode, for an inode about to be written out whole. When no
+ * other inode of its table block is in use the block holds nothing worth
+ * reading, so it is zeroed in memory instead
+ */
+static struct ext0_inode *ext0_get_inode_for_write(struct super_block *sb, ino_t ino, struct buffer_head **ptr)
+{
+    struct buffer_head *bh;
+    unsigned long blk_no;
+    unsigned offset;
+    int ret;
+
+    ret = ext0_inode_block(sb, ino, &blk_no, &offset);
+    if (ret)
+        return ERR_PTR(ret);
+
+    bh = sb_getblk(sb, blk_no);
+    if (!bh)
+        return ERR_PTR(-ENOMEM);
+
+    if (!buffer_uptodate(bh))
+    {
+        lock_buffer(bh);
+        if (!buffer_uptodate(bh) && ext0_inode_block_unused(sb, ino))
+        {
+            memset(bh->b_data, 0, sb->s_blocksize);
+            set_buffer_uptodate(bh);
+        }
+        unlock_buffer(bh);
+    }
+
+    if (!buffer_uptodate(bh))
+    {
+        brelse(bh);
+        bh = sb_bread(sb, blk_no);
+        if (!bh)
+            return ERR_PTR(-EIO);
+    }
+
+    *ptr = bh;
+    return (struct ext0_inode *)(bh->b_data + offset);
+}
+
+/*
+ * Inode table blocks stay in the buffer cache and writing an inode only
+ * copies it into its block. During sync(2)(wbc->for_sync) the blocks are
+ * left dirty: the blockdev flush that follows ->sync_fs writes them all in
+ * one batch, instead of one synchronous write per inode. Other WB_SYNC_ALL
+ * callers, such as fsync, still wait for the block
+ */
+int ext0_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    int do_sync = wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync;
+    struct ext0_inode_info *in_mem_inode = EXT0_I(inode);
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *bh;
+    struct ext0_inode *on_disk_inode = ext0_get_inode_for_write(sb, inode->i_ino, &bh);
+
+    if (IS_ERR(on_disk_inode))
+        return PTR_ERR(on_disk_inode);
+
+    on_disk_inode->i_flags = cpu_to_le32(in_mem_inode->i_flags);
+    if (!on_disk_inode->i_dtime)
+        on_disk_inode->i_dtime = cpu_to_le32(in_mem_inode->i_dtime);
+    on_disk_inode->i_size = cpu_to_le32(inode->i_size);
+    on_disk_inode->i_blocks = cpu_to_le32(inode->i_blocks);
+    on_disk_inode->i_atime = cpu_to_le32(inode->i_atime.tv_sec);
+    on_disk_inode->i_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
+    on_disk_inode->i_mtime = cpu_to_le32(inode->i_mtime.tv_sec);
+    on_disk_inode->i_mode = cpu_to_le16(inode->i_mode);
+    if (!(in_mem_inode->i_state & EXT0_STATE_NLINK_UNKNOWN))
+        on_disk_inode->i_links_count = cpu_to_le16(inode->i_nlink);
+
+    memcpy(on_disk_inode->i_block, in_mem_inode->i_data, sizeof(on_disk_inode->i_block));
+
+    mark_buffer_dirty(bh);
+    if (do_sync)
+        sync_dirty_buffer(bh);
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Deleted inodes are reclaimed in the background. Eviction only marks the
+ * inode deleted in its table block and queues its number with a copy of its
+ * extent root. The worker frees the blocks of everything queued so far, then
+ * the inode numbers, so unlink and cache reclaim never wait on the disk. The
+ * inode number stays allocated until its blocks are back, it cannot be
+ * handed out with blocks still attached. The allocators flush the queue
+ * before giving up with ENOSPC and sync_fs flushes it before folding the
+ * free counts.
+ */
+struct ext0_reclaim
+{
+    struct llist_node r_node;
+    ino_t r_ino;
+    int r_forget; /* Directory, its blocks live in the buffer cache */
+    __le32 r_root[EXT0_N_BLOCKS];
+};
+
+static void ext0_reclaim_one(struct super_block *sb, ino_t ino, __le32 *root, int forget)
+{
+    ext0_ext_free_root(sb, ino, root, forget);
+    ext0_free_ino(sb, ino);
+}
+
+static void ext0_reclaim_work(struct work_struct *work)
+{
+    struct ext0_super_block_info *in_mem_sb = container_of(work, struct ext0_super_block_info, s_reclaim_work);
+    struct ext0_reclaim *r, *next;
+    struct llist_node *list;
+
+    /* Oldest first, blocks of files deleted together tend to be close */
+    list = llist_reverse_order(llist_del_all(&in_mem_sb->s_reclaim_list));
+    llist_for_each_entry_safe(r, next, list, r_node)
+    {
+        ext0_reclaim_one(in_mem_sb->s_sb, r->r_ino, r->r_root, r->r_forget);
+        atomic_dec(&in_mem_sb->s_reclaim_pending);
+        kfree(r);
+        cond_resched();
+    }
+}
+
+static void ext0_reclaim_queue(struct inode *inode)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(inode->i_sb);
+    struct ext0_reclaim *r;
+
+    r = kmalloc(sizeof(*r), GFP_NOFS);
+    if (!r)
+    {
+        ext0_reclaim_one(inode->i_sb, inode->i_ino, EXT0_I(inode)->i_data, S_ISDIR(inode->i_mode));
+        return;
+    }
+
+    r->r_ino = inode->i_ino;
+    r->r_forget = S_ISDIR(inode->i_mode);
+    memcpy(r->r_root, EXT0_I(inode)->i_data, sizeof(r->r_root));
+    atomic_inc(&in_mem_sb->s_reclaim_pending);
+    llist_add(&r->r_node, &in_mem_sb->s_reclaim_list);
+
+    /* A no-op while the work is pending, it picks this one up too */
+    queue_work(in_mem_sb->s_reclaim_wq, &in_mem_sb->s_reclaim_work);
+}
+
+/* Waits for the inodes queued so far to be freed. Returns 0 if there were none */
+int ext0_reclaim_flush(struct super_block *sb)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+
+    if (!atomic_read(&in_mem_sb->s_reclaim_pending))
+        return 0;
+    flush_work(&in_mem_sb->s_reclaim_work);
+    return 1;
+}
+
+int ext0_reclaim_init(struct super_block *sb)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+
+    in_mem_sb->s_sb = sb;
+    init_llist_head(&in_mem_sb->s_reclaim_list);
+    atomic_set(&in_mem_sb->s_reclaim_pending, 0);
+    INIT_WORK(&in_mem_sb->s_reclaim_work, ext0_reclaim_work);
+
+    /* Evictions from memory reclaim queue work here, it must make progress */
+    in_mem_sb->s_reclaim_wq = alloc_workqueue("ext0-reclaim/%s", WQ_MEM_RECLAIM, 1, sb->s_id);
+    if (!in_mem_sb->s_reclaim_wq)
+        return -ENOMEM;
+    return 0;
+}
+
+void ext0_reclaim_exit(struct ext0_super_block_info *in_mem_sb)
+{
+    if (!in_mem_sb->s_reclaim_wq)
+        return;
+    flush_work(&in_mem_sb->s_reclaim_work);
+    destroy_workqueue(in_mem_sb->s_reclaim_wq);
+    in_mem_sb->s_reclaim_wq = NULL;
+}
+
+/* Clean inodes are simply dropped. Dirty ones are copied to their table
+ * block, which goes out with the next writeback of the block device
+ */
+void ext0_evict_inode(struct inode *inode)
+{
+    struct ext0_inode_info *in_mem_inode = EXT0_I(inode);
+    struct writeback_control wbc = {.sync_mode = WB_SYNC_NONE};
+
+    truncate_inode_pages_final(inode->i_mapping);
+    if (S_ISDIR(inode->i_mode))
+    {
+        ext0_dc_drop(inode);
+        ext0_dir_forget_free(inode);
+    }
+
+    /* Last link gone: the data, extent blocks and inode slot go back in the
+     * background. A guessed link count may have missed other names, those
+     * inodes are kept
+     */
+    if (!inode->i_nlink && !(in_mem_inode->i_state & EXT0_STATE_NLINK_UNKNOWN))
+    {
+        in_mem_inode->i_dtime = ktime_get_real_seconds();
+        ext0_write_inode(inode, &wbc);
+        ext0_reclaim_queue(inode);
+    }
+    else if (inode->i_state & (I_DIRTY_SYNC | I_DIRTY_DATASYNC))
+        ext0_write_inode(inode, &wbc);
+
+    memset(in_mem_inode->i_data, 0, sizeof(in_mem_inode->i_data));
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+}
+
+struct inode *ext0_iget(struct super_block *sb, ino_t ino)
+{
+    struct inode *inode;
+    struct ext0_inode *on_disk_inode;
+    struct ext0_inode_info *in_mem_inode;
+    struct buffer_head *bh;
+
+    inode = iget_locked(sb, ino);
+    if (!inode)
+        return ERR_PTR(-ENOMEM);
+    if (!(inode->i_state & I_NEW))
+        return inode;
+
+    in_mem_inode = EXT0_I(inode);
+    on_disk_inode = ext0_get_inode(sb, ino, &bh);
+    if (IS_ERR(on_disk_inode))
+    {
+        iget_failed(inode);
+        return ERR_CAST(on_disk_inode);
+    }
+
+    in_mem_inode->i_flags = le32_to_cpu(on_disk_inode->i_flags);
+    in_mem_inode->i_block_group = ext0_inode_group(sb, ino);
+
+    memcpy(in_mem_inode->i_data, on_disk_inode->i_block, sizeof(in_mem_inode->i_data));
+
+    inode->i_mode = le32_to_cpu(on_disk_inode->i_mode);
+    inode->i_size = le32_to_cpu(on_disk_inode->i_size);
+    inode->i_atime.tv_sec = le32_to_cpu(on_disk_inode->i_atime);
+    inode->i_ctime.tv_sec = le32_to_cpu(on_disk_inode->i_ctime);
+    inode->i_mtime.tv_sec = le32_to_cpu(on_disk_inode->i_mtime);
+    inode->i_blocks = le32_to_cpu(on_disk_inode->i_blocks);
+    inode->i_sb = sb;
+
+    /* Older images kept no link count. Guess one so the inode stays usable,
+     * it is never written back or trusted to free the inode
+     */
+    in_mem_inode->i_state = 0;
+    if (on_disk_inode->i_links_count)
+        set_nlink(inode, le16_to_cpu(on_disk_inode->i_links_count));
+    else
+    {
+        set_nlink(inode, S_ISDIR(inode->i_mode) ? 2 : 1);
+        in_mem_inode->i_state |= EXT0_STATE_NLINK_UNKNOWN;
+    }
+    inode->i_ino = ino;
+    in_mem_inode->i_dtime = 0;
+    inode->i_blkbits = sb->s_blocksize_bits;
+
+    /* Inodes without a tree yet(special files, older images) start empty */
+    if (le16_to_cpu(((struct ext0_extent_header *)in_mem_inode->i_data)->eh_magic) != EXT0_EXT_MAGIC)
+        ext0_ext_tree_init(inode);
+
+    if (S_ISREG(inode->i_mode))
+    {
+        inode->i_op = &ext0_file_inode_operations;
+        inode->i_fop = &ext0_file_operations;
+    }
+    else if (S_ISDIR(inode->i_mode))
+    {
+        inode->i_op = &ext0_dir_inode_operations;
+        inode->i_fop = &ext0_dir_operations;
+    }
+    else if (S_ISLNK(inode->i_mode))
+    {
+        inode->i_op = &page_symlink_inode_operations;
+        inode_nohighmem(inode);
+    }
+    ext0_set_aops(inode);
+
+    brelse(bh);
+    unlock_new_inode(inode);
+
+    return inode;
+}
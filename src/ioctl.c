@@ -0,0 +1,214 @@
+#include <linux/buffer_head.h>
+#include <linux/capability.h>
+#include <linux/fs.h>
+#include <linux/sched/signal.h>
+#include <linux/uaccess.h>
+
+#include "ext0.h"
+
+/*
+ * Bulk stat. Inode numbers map straight to inode table slots(see
+ * ext0_inode_block), so walking the inode bitmaps in order visits the
+ * allocated inodes in disk order without going through any directory. Each
+ * table block is read once for all the inodes it holds, with the blocks
+ * after it read ahead. Inodes in the inode cache are reported from there as
+ * the table may not have caught up with them yet. Deleted inodes keep their
+ * bit until the reclaim work frees them(see ext0_reclaim_queue), so that
+ * work is waited for before the walk.
+ */
+
+#define EXT0_BULKSTAT_RA_BLOCKS 16
+
+struct ext0_bulkstat_cursor
+{
+    struct buffer_head *bitmap_bh;
+    unsigned long group; /* Group of bitmap_bh */
+    struct buffer_head *bh; /* Inode table block being read */
+    unsigned long ra_end; /* First table block not read ahead yet */
+};
+
+static void ext0_bstat_from_inode(struct ext0_bstat *bs, struct inode *inode)
+{
+    bs->bs_size = i_size_read(inode);
+    bs->bs_blocks = inode->i_blocks;
+    bs->bs_atime = inode->i_atime.tv_sec;
+    bs->bs_mtime = inode->i_mtime.tv_sec;
+    bs->bs_ctime = inode->i_ctime.tv_sec;
+    bs->bs_mode = inode->i_mode;
+    bs->bs_flags = EXT0_I(inode)->i_flags;
+}
+
+static void ext0_bstat_from_disk(struct ext0_bstat *bs, struct ext0_inode *raw)
+{
+    bs->bs_size = le32_to_cpu(raw->i_size);
+    bs->bs_blocks = le32_to_cpu(raw->i_blocks);
+    bs->bs_atime = le32_to_cpu(raw->i_atime);
+    bs->bs_mtime = le32_to_cpu(raw->i_mtime);
+    bs->bs_ctime = le32_to_cpu(raw->i_ctime);
+    bs->bs_mode = le16_to_cpu(raw->i_mode);
+    bs->bs_flags = le32_to_cpu(raw->i_flags);
+}
+
+/* Returns the first allocated inode from @ino on, or 0 past the last one */
+static ino_t ext0_bulkstat_next(struct super_block *sb, struct ext0_bulkstat_cursor *cur, ino_t ino, int *err)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    unsigned long ipg = in_mem_sb->s_inodes_per_group;
+    unsigned long group, bit;
+
+    for (; ino <= le32_to_cpu(in_mem_sb->s_es->s_inodes_count); ino = EXT0_MAKE_INO((group + 1) * ipg))
+    {
+        struct ext0_block_descriptor *gdesc;
+
+        group = ext0_inode_group(sb, ino);
+        if (!cur->bitmap_bh || cur->group != group)
+        {
+            brelse(cur->bitmap_bh);
+            cur->bitmap_bh = NULL;
+
+            gdesc = ext0_get_group_desc(sb, group, NULL);
+            if (!gdesc)
+                break;
+            if (le16_to_cpu(READ_ONCE(gdesc->bg_free_inodes_count)) == ipg)
+                continue;
+
+            cur->bitmap_bh = sb_bread(sb, le32_to_cpu(gdesc->bg_inode_bitmap));
+            if (!cur->bitmap_bh)
+            {
+                *err = -EIO;
+                return 0;
+            }
+            cur->group = group;
+        }
+
+        bit = ext0_find_next_bit(cur->bitmap_bh->b_data, ipg, EXT0_GET_INO(ino) % ipg);
+        if (bit < ipg)
+        {
+            ino = EXT0_MAKE_INO(group * ipg + bit);
+            return ino <= le32_to_cpu(in_mem_sb->s_es->s_inodes_count) ? ino : 0;
+        }
+    }
+    return 0;
+}
+
+static int ext0_bulkstat_one(struct super_block *sb, struct ext0_bulkstat_cursor *cur, ino_t ino, struct ext0_bstat *bs)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    struct inode *inode;
+    unsigned long block, itable_end;
+    unsigned offset;
+    int ret;
+
+    memset(bs, 0, sizeof(*bs));
+    bs->bs_ino = ino;
+
+    inode = ilookup(sb, ino);
+    if (inode)
+    {
+        ext0_bstat_from_inode(bs, inode);
+        iput(inode);
+        return 0;
+    }
+
+    ret = ext0_inode_block(sb, ino, &block, &offset);
+    if (ret)
+        return ret;
+
+    if (!cur->bh || cur->bh->b_blocknr != block)
+    {
+        brelse(cur->bh);
+
+        /* Keep a window of the group's table in flight ahead of us */
+        itable_end = le32_to_cpu(ext0_get_group_desc(sb, ext0_inode_group(sb, ino), NULL)->bg_inode_table) +
+                     in_mem_sb->s_itb_per_group;
+        if (cur->ra_end <= block || cur->ra_end > itable_end)
+            cur->ra_end = block + 1;
+        while (cur->ra_end < min(block + EXT0_BULKSTAT_RA_BLOCKS, itable_end))
+            sb_breadahead(sb, cur->ra_end++);
+
+        cur->bh = sb_bread(sb, block);
+        if (!cur->bh)
+            return -EIO;
+    }
+
+    ext0_bstat_from_disk(bs, (struct ext0_inode *)(cur->bh->b_data + offset));
+    return 0;
+}
+
+static long ext0_ioc_bulkstat(struct file *filp, struct ext0_bulkstat_req __user *ureq)
+{
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct ext0_bulkstat_cursor cur = {};
+    struct ext0_bulkstat_req req;
+    struct ext0_bstat __user *ubuf;
+    struct ext0_bstat bs;
+    ino_t ino, next;
+    u32 done = 0;
+    int err = 0;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+
+    ext0_reclaim_flush(sb);
+
+    ubuf = u64_to_user_ptr(req.br_buffer);
+    ino = max_t(u64, req.br_ino, EXT0_ROOT_INO);
+
+    while (done < req.br_count)
+    {
+        next = ext0_bulkstat_next(sb, &cur, ino, &err);
+        if (err)
+            break;
+        if (!next)
+        {
+            ino = le32_to_cpu(EXT0_SB(sb)->s_es->s_inodes_count) + 1;
+            break;
+        }
+
+        err = ext0_bulkstat_one(sb, &cur, next, &bs);
+        if (err)
+            break;
+
+        if (copy_to_user(&ubuf[done], &bs, sizeof(bs)))
+        {
+            err = -EFAULT;
+            break;
+        }
+        done++;
+        ino = next + 1;
+
+        if (fatal_signal_pending(current))
+        {
+            err = -EINTR;
+            break;
+        }
+        cond_resched();
+    }
+
+    brelse(cur.bh);
+    brelse(cur.bitmap_bh);
+
+    /* Whatever was filled in is returned, the error only if nothing was */
+    if (err && !done)
+        return err;
+
+    req.br_ino = ino;
+    req.br_count = done;
+    if (copy_to_user(ureq, &req, sizeof(req)))
+        return -EFAULT;
+    return 0;
+}
+
+long ext0_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd)
+    {
+    case EXT0_IOC_BULKSTAT:
+        return ext0_ioc_bulkstat(filp, (struct ext0_bulkstat_req __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
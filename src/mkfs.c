@@ -1,178 +1,322 @@
-#include <fcntl.h>
-#include <errno.h>
-#include <stdint.h>
-#include <stddef.h>
-#include <string.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <stdio.h>
-#include <stdlib.h>
-
-#include "ext0.h"
-
-int main(int argc, char *argv[])
-{
-    printf("Setting up EXT0-fs...\n");
-    struct ext0_super_block *sb;
-    struct ext0_inode *inode;
-    struct stat statinfo;
-    struct ext0_dir_entry *de;
-    struct ext0_block_descriptor *gdesc;
-    uint32_t blk_no;
-    int fd;
-    char buf[EXT0_FS_MIN_BLOCK_SIZE];
-    unsigned blocks_per_group;
-    unsigned long last_block, group_count;
-
-    if (argc < 2)
-    {
-        fprintf(stderr, "Device-backed file required\n");
-        return EXIT_FAILURE;
-    }
-
-    fd = open(argv[1], O_RDWR);
-    if (!fd)
-    {
-        perror("open");
-        return EXIT_FAILURE;
-    }
-
-    if (fstat(fd, &statinfo) == -1)
-    {
-        perror("fstat");
-        goto cleanup;
-    }
-
-    blocks_per_group = EXT0_FS_MAX_DIRECT_BLOCKS + EXT0_GROUP_OVERHEAD_BLOCKS_NUM;
-    group_count = (statinfo.st_size - (EXT0_FS_MIN_BLOCK_SIZE * EXT0_FS_OVERHEAD_BLOCKS)) / (EXT0_FS_MIN_BLOCK_SIZE * blocks_per_group);
-    // group_count = EXT0_INODE_BITMAP_SIZE;
-    printf("fs_size=%li\ngroups=%zu\nblocks_per_group=%u\nlogical_block_size=%i\n\n", statinfo.st_size, group_count, blocks_per_group, EXT0_FS_MIN_BLOCK_SIZE);
-
-    last_block = EXT0_GROUP_OVERHEAD_BLOCKS_NUM * group_count + EXT0_FS_OVERHEAD_BLOCKS;
-
-    printf("Preparing root inode\n");
-    memset(buf, 0, EXT0_FS_MIN_BLOCK_SIZE);
-    inode = (struct ext0_inode *)buf;
-
-    inode->i_mode |= S_IFDIR;
-    inode->i_blocks = EXT0_FS_MAX_DIRECT_BLOCKS;
-    inode->i_size = sizeof(struct ext0_inode);
-
-    inode->i_mtime = inode->i_atime = inode->i_ctime = 1; // Use correct time
-
-    blk_no = ext0_inode_block(EXT0_ROOT_INO) - 1;
-    if (lseek(fd, blk_no * EXT0_FS_MIN_BLOCK_SIZE, SEEK_SET) < 0)
-        printf("lseek: Something wrong");
-
-    if (write(fd, buf, EXT0_FS_MIN_BLOCK_SIZE) != EXT0_FS_MIN_BLOCK_SIZE)
-    {
-        perror("root inode write");
-        goto cleanup;
-    }
-    fsync(fd);
-
-    // lseek(fd, 4096, SEEK_SET);
-    // lseek(fd, 3072, SEEK_CUR);
-    // memset(buf, 0, EXT0_FS_MIN_BLOCK_SIZE);
-    // read(fd, buf, EXT0_FS_MIN_BLOCK_SIZE);
-    // inode = (struct ext0_inode *)buf;
-    // // printf("Data: %u\n", inode->i_blocks);
-
-    printf("Setting up root inode default directories\n");
-    memset(buf, 0, EXT0_FS_MIN_BLOCK_SIZE);
-    de = (struct ext0_dir_entry *)buf;
-    de->name_len = 1;
-    de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-    memcpy(de->name, ".\0", 3); /* Remove hard coded */
-    de->inode = EXT0_ROOT_INO;
-    de->file_type = DT_DIR;
-
-    de = (struct ext0_dir_entry *)(buf + de->rec_len);
-    de->name_len = 2;
-    de->rec_len = EXT0_ALIGN_TO_SIZE(EXT0_DIR_SIZE + de->name_len);
-    memcpy(de->name, "..\0", 4);
-    de->inode = EXT0_ROOT_INO;
-    de->file_type = DT_DIR;
-
-    /*
-     * FS |boot--->group1----  ---->groupN--->group1 data blocks--- --->groupN data blocks|
-     * Group |superblock--->descriptor--->inode--->block bitmap|
-     */
-    blk_no = last_block + EXT0_FS_MAX_DIRECT_BLOCKS + 1;
-    lseek(fd, (blk_no - 1) * EXT0_FS_MIN_BLOCK_SIZE, SEEK_SET);
-    if (write(fd, buf, EXT0_FS_MIN_BLOCK_SIZE) != EXT0_FS_MIN_BLOCK_SIZE)
-    {
-        perror("directory write");
-        goto cleanup;
-    }
-    fsync(fd);
-    printf("Done setting up root inode\n");
-
-    printf("Setting up group descriptors\n");
-    blk_no = EXT0_SUPER_BLOCK + EXT0_FS_OVERHEAD_BLOCKS + 1; /* Block descriptor immediately follows superblock */
-    memset(buf, 0, EXT0_FS_MIN_BLOCK_SIZE);
-    gdesc = (struct ext0_block_descriptor *)buf;
-    for (size_t i = 0; i < group_count; i++)
-    {
-        gdesc->bg_block_bitmap = EXT0_TO_LE32(blk_no + 1); /* Block lookup is zero-based */
-
-        /* Take care of root dir */
-        gdesc->bg_free_blocks_count = EXT0_GET_INO(EXT0_ROOT_INO) == i ? EXT0_FS_MAX_DIRECT_BLOCKS - 1 : EXT0_FS_MAX_DIRECT_BLOCKS;
-        gdesc->bg_first_block = EXT0_TO_LE32(last_block + 1);
-
-        lseek(fd, (blk_no - 1) * EXT0_FS_MIN_BLOCK_SIZE, SEEK_SET);
-        if (write(fd, (char *)buf, EXT0_FS_MIN_BLOCK_SIZE) != EXT0_FS_MIN_BLOCK_SIZE)
-        {
-            perror("block descriptor write");
-            goto cleanup;
-        }
-
-        blk_no += EXT0_GROUP_OVERHEAD_BLOCKS_NUM;
-        last_block += EXT0_FS_MAX_DIRECT_BLOCKS;
-    }
-    fsync(fd);
-    printf("Done setting up group descriptors\n");
-
-    printf("Setting up superblocks per group\n");
-    memset(buf, 0, EXT0_FS_MIN_BLOCK_SIZE);
-    sb = (struct ext0_super_block *)buf;
-
-    sb->s_inode_size = EXT0_TO_LE32(sizeof(struct ext0_inode));
-    sb->s_inodes_per_group = 1;
-    sb->s_magic = EXT0_FS_MAGIC;
-    sb->s_blocks_count = EXT0_TO_LE32(statinfo.st_size / EXT0_FS_MIN_BLOCK_SIZE);
-    // sb->s_blocks_count = (group_count * blocks_per_group) + EXT0_FS_OVERHEAD_BLOCKS;
-    sb->s_blocks_per_group = blocks_per_group;
-    sb->s_inodes_count = sb->s_blocks_count;
-    sb->s_free_inodes_count = sb->s_inodes_count - 1;
-    sb->s_groups_count = group_count;
-    sb->s_last_block = last_block;
-    sb->s_free_blocks_count = sb->s_blocks_count - sb->s_last_block - 1;
-    memset(sb->s_inode_bitmap, 0, EXT0_INODE_BITMAP_SIZE);
-
-    blk_no = EXT0_GROUP_OVERHEAD_BLOCKS_NUM * group_count + EXT0_FS_OVERHEAD_BLOCKS + EXT0_FS_MAX_DIRECT_BLOCKS;
-    ext0_test_and_set_bit(EXT0_GET_INO(EXT0_ROOT_INO), (void *)sb->s_inode_bitmap);
-
-    blk_no = EXT0_SUPER_BLOCK;
-
-    for (size_t i = 0; i < sb->s_groups_count; i++)
-    {
-        lseek(fd, blk_no * EXT0_FS_MIN_BLOCK_SIZE, SEEK_SET);
-        if (write(fd, (char *)buf, EXT0_FS_MIN_BLOCK_SIZE) != EXT0_FS_MIN_BLOCK_SIZE)
-        {
-            perror("superblock write");
-            goto cleanup;
-        }
-        blk_no += EXT0_GROUP_OVERHEAD_BLOCKS_NUM;
-    }
-    fsync(fd);
-    printf("Done setting up superblocks\n");
-
-    close(fd);
-    printf("\nFilesystem setup complete\n");
-    return EXIT_SUCCESS;
-
-cleanup:
-    close(fd);
-    return EXIT_FAILURE;
-}
\ No newline at end of file
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ext0.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-b block-size] [-g blocks-per-group] [-i inodes-per-group] device\n", prog);
+}
+
+static unsigned long block_size = EXT0_FS_DEF_BLOCK_SIZE;
+
+/* Write size bytes at offset off of the(zero based) block number blk_no */
+static int write_at(int fd, unsigned long blk_no, unsigned long off, const char *buf, size_t size, const char *what)
+{
+    if (lseek(fd, (off_t)blk_no * block_size + off, SEEK_SET) < 0 ||
+        write(fd, buf, size) != (ssize_t)size)
+    {
+        perror(what);
+        return -1;
+    }
+    return 0;
+}
+
+/* Write one filesystem block at the(zero based) block number blk_no */
+static int write_block(int fd, unsigned long blk_no, const char *buf, const char *what)
+{
+    return write_at(fd, blk_no, 0, buf, block_size, what);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("Setting up EXT0-fs...\n");
+    struct ext0_super_block *sb;
+    struct ext0_inode *inode;
+    struct stat statinfo;
+    struct ext0_dir_entry *de;
+    struct ext0_block_descriptor *gdesc;
+    struct ext0_extent_header *eh;
+    struct ext0_extent *ex;
+    unsigned long blk_no;
+    int fd, opt;
+    char buf[EXT0_FS_MAX_BLOCK_SIZE];
+    char bitmap[EXT0_FS_MAX_BLOCK_SIZE];
+    char zero[EXT0_FS_MAX_BLOCK_SIZE];
+    unsigned inode_size, inodes_per_block;
+    unsigned long blocks_count, blocks_per_group, group_count, first_data_block, inodes_per_group, itable_blocks, meta_blocks;
+    unsigned long inodes_count, free_blocks_count, free_inodes_count, root_group, root_index, root_dir_block, log_block_size;
+
+    blocks_per_group = 0;
+    inodes_per_group = 0;
+    while ((opt = getopt(argc, argv, "b:g:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            blocks_per_group = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            inodes_per_group = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Device-backed file required\n");
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (log_block_size = 0; log_block_size <= EXT0_FS_MAX_LOG_BLOCK_SIZE; log_block_size++)
+    {
+        if (block_size == (unsigned long)EXT0_FS_MIN_BLOCK_SIZE << log_block_size)
+            break;
+    }
+    if (log_block_size > EXT0_FS_MAX_LOG_BLOCK_SIZE)
+    {
+        fprintf(stderr, "Block size must be one of 1024, 2048 or 4096\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!blocks_per_group)
+        blocks_per_group = EXT0_MAX_BLOCKS_PER_GROUP(block_size);
+    if (blocks_per_group > EXT0_MAX_BLOCKS_PER_GROUP(block_size) || blocks_per_group % 8)
+    {
+        fprintf(stderr, "Blocks per group must be a multiple of 8, at most %lu\n", EXT0_MAX_BLOCKS_PER_GROUP(block_size));
+        return EXIT_FAILURE;
+    }
+
+    inode_size = sizeof(struct ext0_inode);
+    inodes_per_block = block_size / inode_size;
+    if (!inodes_per_group)
+        inodes_per_group = blocks_per_group / EXT0_DEF_BLOCKS_PER_INODE;
+    if (inodes_per_group < EXT0_ROOT_INO)
+        inodes_per_group = EXT0_ROOT_INO;
+
+    /* Fill up the last inode table block */
+    inodes_per_group = (inodes_per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+    itable_blocks = ext0_itable_blocks(inodes_per_group, inode_size, block_size);
+    meta_blocks = EXT0_GROUP_OVERHEAD_BLOCKS_NUM + itable_blocks;
+    if (inodes_per_group > EXT0_MAX_INODES_PER_GROUP(block_size))
+    {
+        fprintf(stderr, "Inodes per group must be at most %lu\n", EXT0_MAX_INODES_PER_GROUP(block_size));
+        return EXIT_FAILURE;
+    }
+    if (meta_blocks >= blocks_per_group)
+    {
+        fprintf(stderr, "%lu inodes do not fit in groups of %lu blocks\n", inodes_per_group, blocks_per_group);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(argv[optind], O_RDWR);
+    if (fd < 0)
+    {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+
+    if (fstat(fd, &statinfo) == -1)
+    {
+        perror("fstat");
+        goto cleanup;
+    }
+
+    /*
+     * FS |boot--->group1--- --->groupN|
+     * Group |superblock--->descriptor--->block bitmap--->inode bitmap--->inode table--->data blocks|
+     * The last group gets whatever is left, as long as its metadata fits.
+     * The boot area is the first 1K: a block of its own with 1K blocks, the
+     * head of group 0's superblock block otherwise.
+     */
+    first_data_block = block_size == EXT0_FS_MIN_BLOCK_SIZE ? EXT0_FS_OVERHEAD_BLOCKS : 0;
+    blocks_count = statinfo.st_size / block_size;
+    group_count = (blocks_count - first_data_block) / blocks_per_group;
+    if ((blocks_count - first_data_block) % blocks_per_group > meta_blocks)
+        group_count++;
+    else
+        blocks_count = ext0_group_first_block(group_count, blocks_per_group, first_data_block);
+
+    if (!group_count)
+    {
+        fprintf(stderr, "Device too small for a single block group\n");
+        goto cleanup;
+    }
+
+    inodes_count = group_count * inodes_per_group;
+
+    printf("fs_size=%li\ngroups=%zu\nblocks_per_group=%lu\ninodes_per_group=%lu\ninodes=%lu\nblock_size=%lu\n\n",
+           statinfo.st_size, group_count, blocks_per_group, inodes_per_group, inodes_count, block_size);
+
+    root_group = EXT0_GET_INO(EXT0_ROOT_INO) / inodes_per_group;
+    root_index = EXT0_GET_INO(EXT0_ROOT_INO) % inodes_per_group;
+    root_dir_block = ext0_group_first_block(root_group, blocks_per_group, first_data_block) + meta_blocks;
+    free_blocks_count = 0;
+    free_inodes_count = 0;
+    memset(zero, 0, block_size);
+
+    printf("Setting up group descriptors and inode tables\n");
+    for (size_t i = 0; i < group_count; i++)
+    {
+        unsigned long group_first = ext0_group_first_block(i, blocks_per_group, first_data_block);
+        unsigned long group_blocks = blocks_count - group_first < blocks_per_group ? blocks_count - group_first : blocks_per_group;
+        unsigned long desc_block = ext0_group_desc_block(i, blocks_per_group, first_data_block);
+        unsigned long free_blocks = group_blocks - meta_blocks;
+        unsigned long free_inodes = inodes_per_group;
+
+        /* Metadata, the root directory and the tail of a short last group are in use */
+        memset(bitmap, 0, block_size);
+        for (blk_no = 0; blk_no < meta_blocks; blk_no++)
+            ext0_test_and_set_bit(blk_no, (void *)bitmap);
+        for (blk_no = group_blocks; blk_no < EXT0_MAX_BLOCKS_PER_GROUP(block_size); blk_no++)
+            ext0_test_and_set_bit(blk_no, (void *)bitmap);
+        if (root_group == i)
+        {
+            ext0_test_and_set_bit(meta_blocks, (void *)bitmap);
+            free_blocks--;
+        }
+        free_blocks_count += free_blocks;
+
+        memset(buf, 0, block_size);
+        gdesc = (struct ext0_block_descriptor *)buf;
+        gdesc->bg_block_bitmap = EXT0_TO_LE32(desc_block + 1); /* Block lookup is zero-based */
+        gdesc->bg_inode_bitmap = EXT0_TO_LE32(desc_block + 2);
+        gdesc->bg_inode_table = EXT0_TO_LE32(desc_block + 3);
+        gdesc->bg_first_block = EXT0_TO_LE32(group_first + meta_blocks);
+        gdesc->bg_free_blocks_count = EXT0_TO_LE16(free_blocks);
+
+        if (write_block(fd, desc_block + 1, bitmap, "block bitmap write"))
+            goto cleanup;
+
+        /* Inode 1 is reserved and 2 is the root directory. Bits past the inode table are in use */
+        memset(bitmap, 0, block_size);
+        for (blk_no = inodes_per_group; blk_no < EXT0_MAX_INODES_PER_GROUP(block_size); blk_no++)
+            ext0_test_and_set_bit(blk_no, (void *)bitmap);
+        if (i == 0)
+        {
+            ext0_test_and_set_bit(EXT0_GET_INO(1), (void *)bitmap);
+            free_inodes--;
+        }
+        if (root_group == i)
+        {
+            ext0_test_and_set_bit(root_index, (void *)bitmap);
+            free_inodes--;
+        }
+        gdesc->bg_free_inodes_count = EXT0_TO_LE16(free_inodes);
+        free_inodes_count += free_inodes;
+
+        if (write_block(fd, desc_block, buf, "block descriptor write") ||
+            write_block(fd, desc_block + 2, bitmap, "inode bitmap write"))
+            goto cleanup;
+
+        for (blk_no = 0; blk_no < itable_blocks; blk_no++)
+        {
+            if (write_block(fd, desc_block + 3 + blk_no, zero, "inode table write"))
+                goto cleanup;
+        }
+    }
+    fsync(fd);
+    printf("Done setting up group descriptors\n");
+
+    printf("Preparing root inode\n");
+    memset(buf, 0, block_size);
+    inode = (struct ext0_inode *)(buf + (root_index % inodes_per_block) * inode_size);
+
+    inode->i_mode |= S_IFDIR;
+    inode->i_links_count = EXT0_TO_LE16(2); /* "." and ".." */
+    inode->i_blocks = EXT0_TO_LE32(block_size >> 9);
+    inode->i_size = EXT0_TO_LE32(block_size);
+    inode->i_flags = EXT0_TO_LE32(EXT0_DIRENT_HASH_FL);
+
+    inode->i_mtime = inode->i_atime = inode->i_ctime = 1; // Use correct time
+
+    /* Root directory data is a single block extent */
+    eh = (struct ext0_extent_header *)inode->i_block;
+    eh->eh_magic = EXT0_TO_LE16(EXT0_EXT_MAGIC);
+    eh->eh_entries = EXT0_TO_LE16(1);
+    eh->eh_max = EXT0_TO_LE16(EXT0_EXT_ROOT_MAX);
+    eh->eh_depth = 0;
+    ex = EXT0_FIRST_EXTENT(eh);
+    ex->ee_block = 0;
+    ex->ee_start = EXT0_TO_LE32(root_dir_block);
+    ex->ee_len = EXT0_TO_LE16(1);
+
+    blk_no = ext0_group_desc_block(root_group, blocks_per_group, first_data_block) + 3 + root_index / inodes_per_block;
+    if (write_block(fd, blk_no, buf, "root inode write"))
+        goto cleanup;
+    fsync(fd);
+
+    printf("Setting up root inode default directories\n");
+    memset(buf, 0, block_size);
+    de = (struct ext0_dir_entry *)buf;
+    de->name_len = 1;
+    de->rec_len = EXT0_TO_LE16(EXT0_DIR_REC_LEN(de->name_len) + sizeof(__le32));
+    memcpy(de->name, ".", 1);
+    de->inode = EXT0_TO_LE32(EXT0_ROOT_INO);
+    de->file_type = DT_DIR;
+    *EXT0_DIR_HASH(de) = EXT0_TO_LE32(ext0_dirhash(de->name, de->name_len));
+
+    /* ".." takes up the rest of the block */
+    de = (struct ext0_dir_entry *)(buf + EXT0_DIR_REC_LEN(1) + sizeof(__le32));
+    de->name_len = 2;
+    de->rec_len = EXT0_TO_LE16(block_size - (EXT0_DIR_REC_LEN(1) + sizeof(__le32)));
+    memcpy(de->name, "..", 2);
+    de->inode = EXT0_TO_LE32(EXT0_ROOT_INO);
+    de->file_type = DT_DIR;
+    *EXT0_DIR_HASH(de) = EXT0_TO_LE32(ext0_dirhash(de->name, de->name_len));
+
+    if (write_block(fd, root_dir_block, buf, "directory write"))
+        goto cleanup;
+    fsync(fd);
+    printf("Done setting up root inode\n");
+
+    printf("Setting up superblocks per group\n");
+    memset(buf, 0, block_size);
+    sb = (struct ext0_super_block *)buf;
+
+    sb->s_inode_size = EXT0_TO_LE16(inode_size);
+    sb->s_inodes_per_group = EXT0_TO_LE32(inodes_per_group);
+    sb->s_magic = EXT0_FS_MAGIC;
+    sb->s_blocks_count = EXT0_TO_LE32(blocks_count);
+    sb->s_blocks_per_group = EXT0_TO_LE32(blocks_per_group);
+    sb->s_inodes_count = EXT0_TO_LE32(inodes_count);
+    sb->s_free_inodes_count = EXT0_TO_LE32(free_inodes_count);
+    sb->s_groups_count = group_count;
+    sb->s_last_block = EXT0_TO_LE32(blocks_count - 1);
+    sb->s_first_data_block = EXT0_TO_LE32(first_data_block);
+    sb->s_log_block_size = EXT0_TO_LE32(log_block_size);
+    sb->s_free_blocks_count = EXT0_TO_LE32(free_blocks_count);
+
+    /* Group 0 keeps the boot area, the backups take the whole of their first block */
+    if (write_at(fd, 0, EXT0_SUPER_BLOCK_OFFSET, buf, sizeof(struct ext0_super_block), "superblock write"))
+        goto cleanup;
+    for (size_t i = 1; i < group_count; i++)
+    {
+        if (write_block(fd, ext0_group_first_block(i, blocks_per_group, first_data_block), buf, "superblock write"))
+            goto cleanup;
+    }
+    fsync(fd);
+    printf("Done setting up superblocks\n");
+
+    close(fd);
+    printf("\nFilesystem setup complete\n");
+    return EXIT_SUCCESS;
+
+cleanup:
+    close(fd);
+    return EXIT_FAILURE;
+}
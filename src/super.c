@@ -1,348 +1,586 @@
-#include <linux/fs.h>
-#include <linux/buffer_head.h>
-#include <linux/module.h>
-#include <linux/slab.h>
-#include <linux/time.h>
-#include <linux/vfs.h>
-
-#include "ext0.h"
-
-static struct kmem_cache *ext0_inode_cachep;
-
-static void init_once(void *buf)
-{
-    struct ext0_inode_info *in_mem_inode = (struct ext0_inode_info *)buf;
-    inode_init_once(&in_mem_inode->vfs_inode);
-}
-
-static int __init init_inodecache(void)
-{
-    ext0_inode_cachep = kmem_cache_create("ext0_inode_cache",
-                                          sizeof(struct ext0_inode_info),
-                                          0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT),
-                                          init_once);
-    if (ext0_inode_cachep == NULL)
-    {
-        ext0_debug("Out of memory");
-        return -ENOMEM;
-    }
-    return 0;
-}
-
-static void destroy_inodecache(void)
-{
-    ext0_debug("Releasing memory");
-    rcu_barrier();
-    kmem_cache_destroy(ext0_inode_cachep);
-}
-
-static void ext0_i_callback(struct rcu_head *head)
-{
-    struct inode *inode = container_of(head, struct inode, i_rcu);
-    kmem_cache_free(ext0_inode_cachep, EXT0_I(inode));
-}
-
-static void ext0_destroy_inode(struct inode *inode)
-{
-    call_rcu(&inode->i_rcu, ext0_i_callback);
-}
-
-static struct inode *ext0_alloc_inode(struct super_block *sb)
-{
-    struct ext0_inode_info *in_mem_inode;
-    in_mem_inode = kmem_cache_alloc(ext0_inode_cachep, GFP_KERNEL);
-    if (!in_mem_inode)
-    {
-        ext0_debug("Unable to allocate memory for inode");
-        return NULL;
-    }
-    return &in_mem_inode->vfs_inode;
-}
-
-static int ext0_sync_fs(struct super_block *sb, int wait)
-{
-    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
-    struct ext0_super_block *on_disk_sb = in_mem_sb->s_es;
-
-    spin_lock(&in_mem_sb->s_lock);
-    on_disk_sb->s_wtime = cpu_to_le32(ktime_get_real_seconds());
-    spin_unlock(&in_mem_sb->s_lock);
-
-    mark_buffer_dirty(in_mem_sb->s_sbh);
-    if (wait)
-        sync_dirty_buffer(in_mem_sb->s_sbh);
-    return 0;
-}
-
-void ext0_write_super(struct super_block *sb)
-{
-    ext0_sync_fs(sb, 1);
-}
-
-void ext0_put_super(struct super_block *sb)
-{
-    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
-    unsigned long i;
-    ext0_sync_fs(sb, 1);
-
-    for (i = 0; i < in_mem_sb->s_groups_count; i++)
-    {
-        if (in_mem_sb->s_group_desc[i])
-            brelse(in_mem_sb->s_group_desc[i]);
-    }
-
-    brelse(in_mem_sb->s_sbh);
-    kfree(in_mem_sb->s_group_desc);
-    sb->s_fs_info = NULL;
-    kfree(in_mem_sb);
-}
-
-static int ext0_statfs(struct dentry *dentry, struct kstatfs *buf)
-{
-    struct super_block *sb = dentry->d_sb;
-    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
-    struct ext0_super_block *on_disk_sb = in_mem_sb->s_es;
-
-    spin_lock(&in_mem_sb->s_lock);
-    buf->f_type = EXT0_FS_MAGIC;
-    buf->f_namelen = EXT0_NAME_LEN;
-    buf->f_files = le32_to_cpu(on_disk_sb->s_inodes_count);
-    buf->f_bsize = sb->s_blocksize;
-    spin_unlock(&in_mem_sb->s_lock);
-    return 0;
-}
-
-static int ext0_freeze(struct super_block *sb)
-{
-    ext0_sync_fs(sb, 1);
-    return 0;
-}
-
-static int ext0_unfreeze(struct super_block *sb)
-{
-    ext0_write_super(sb);
-    return 0;
-}
-
-static const struct super_operations ext0_sops = {
-    .alloc_inode = ext0_alloc_inode,
-    .destroy_inode = ext0_destroy_inode,
-    .write_inode = ext0_write_inode,
-    .evict_inode = ext0_evict_inode,
-    .put_super = ext0_put_super,
-    .sync_fs = ext0_sync_fs,
-    .freeze_fs = ext0_freeze,
-    .unfreeze_fs = ext0_unfreeze,
-    .statfs = ext0_statfs,
-};
-
-/* Given a logical blk_no(start at 1) get the equivalent device
- * block number(starting at 0)
- */
-unsigned fs_to_dev_block_num(struct super_block *sb, unsigned blk_no, off_t *offset)
-{
-    unsigned long blocks_offset;
-    unsigned _blk_no;
-
-    blk_no = blk_no - 1;
-
-    if (blk_no < 0)
-        blocks_offset = 0;
-    else if (blk_no == 0)
-        blocks_offset = EXT0_FS_MIN_BLOCK_SIZE;
-    else
-        blocks_offset = blk_no * EXT0_FS_MIN_BLOCK_SIZE;
-
-    _blk_no = blocks_offset / sb->s_blocksize;
-
-    if (blocks_offset > sb->s_blocksize)
-        *offset = blocks_offset % sb->s_blocksize;
-    else
-        *offset = blocks_offset;
-    return _blk_no;
-}
-
-static int ext0_fill_super(struct super_block *sb, void *data, int silent)
-{
-    struct ext0_super_block_info *in_mem_sb;
-    struct ext0_super_block *on_disk_sb;
-    struct inode *root;
-    struct buffer_head *bh, *desc_bh;
-    int groups_count;
-    off_t offset;
-    unsigned long sb_block = EXT0_SUPER_BLOCK, desc_block;
-    unsigned desc_group_no;
-    unsigned long i;
-
-    if (!sb->s_blocksize)
-    {
-        ext0_debug("Invalid blocksize");
-        return -EINVAL;
-    }
-
-    offset = 0;
-    if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-        sb_block = fs_to_dev_block_num(sb, sb_block, &offset);
-    else if (EXT0_FS_MIN_BLOCK_SIZE > sb->s_blocksize)
-        sb_block = (int)EXT0_FS_MIN_BLOCK_SIZE / sb->s_blocksize;
-    else
-        sb_block = sb_block;
-
-    in_mem_sb = kzalloc(sizeof(struct ext0_super_block_info), GFP_KERNEL);
-    if (!in_mem_sb)
-    {
-        ext0_debug("Unable to allocate memory for super block");
-        return -ENOMEM;
-    }
-
-    spin_lock_init(&in_mem_sb->s_lock);
-
-    in_mem_sb->s_sb_block = sb_block;
-    bh = sb_bread(sb, sb_block);
-    if (!bh)
-    {
-        ext0_debug("Could not perform I/O for super block");
-        sb->s_fs_info = NULL;
-        kfree(in_mem_sb);
-        return -EIO;
-    }
-    on_disk_sb = (struct ext0_super_block *)(bh->b_data + offset);
-
-    groups_count = le32_to_cpu(on_disk_sb->s_groups_count);
-
-    sb->s_magic = le32_to_cpu(on_disk_sb->s_magic);
-
-    if (sb->s_magic != EXT0_FS_MAGIC)
-    {
-        ext0_debug("EXT0 filesystem does not exist: %zu", sb_block);
-        brelse(bh);
-        return -EINVAL;
-    }
-
-    in_mem_sb->s_group_desc = kmalloc(groups_count * sizeof(struct buffer_head *), GFP_KERNEL);
-    if (!in_mem_sb->s_group_desc)
-    {
-        ext0_debug("Unable to allocate memory for group descriptors with bytes=%zu", (unsigned long)(groups_count * sizeof(struct buffer_head *)));
-        brelse(bh);
-        kfree(in_mem_sb);
-        return -ENOMEM;
-    }
-
-    in_mem_sb->s_blocks_per_group = le32_to_cpu(on_disk_sb->s_blocks_per_group);
-
-    offset = 0;
-    desc_group_no = 3;
-    for (i = 0; i < groups_count; i++)
-    {
-        unsigned long j;
-
-        if (EXT0_FS_MIN_BLOCK_SIZE < sb->s_blocksize)
-            desc_block = fs_to_dev_block_num(sb, desc_group_no, &offset);
-        else
-        {
-            desc_block = desc_group_no;
-            offset = 0;
-        }
-
-        desc_bh = sb_bread(sb, desc_block);
-        if (!desc_bh)
-        {
-            /* We failed. Cleanup allocated mem */
-            for (j = 0; j < i; j++)
-            {
-                if (desc_bh)
-                    brelse(desc_bh);
-            }
-
-            ext0_debug("Unable to perform I/O for descriptor index=%zu", i);
-            brelse(bh);
-            sb->s_fs_info = NULL;
-            kfree(in_mem_sb);
-            return -EIO;
-        }
-
-        in_mem_sb->s_group_desc[i] = desc_bh;
-        desc_group_no += EXT0_GROUP_OVERHEAD_BLOCKS_NUM;
-    }
-
-    in_mem_sb->s_inodes_per_block = 1;
-    in_mem_sb->s_desc_per_block = 1;
-    in_mem_sb->s_inodes_per_group = le32_to_cpu(on_disk_sb->s_inodes_per_group);
-    in_mem_sb->s_groups_count = groups_count;
-    in_mem_sb->s_es = on_disk_sb;
-    in_mem_sb->s_sbh = bh;
-    in_mem_sb->s_last_block = le32_to_cpu(on_disk_sb->s_last_block);
-
-    sb->s_op = &ext0_sops;
-    sb->s_fs_info = in_mem_sb;
-
-    root = ext0_iget(sb, EXT0_ROOT_INO);
-    if (!root)
-    {
-        ext0_debug("Unable to find root directory inode: %i", EXT0_ROOT_INO);
-        brelse(bh);
-        kfree(in_mem_sb);
-        return -EIO;
-    }
-
-    sb->s_root = d_make_root(root);
-    if (!sb->s_root)
-    {
-        ext0_debug("Unable to create root directory entry");
-        brelse(bh);
-        kfree(in_mem_sb);
-        return -ENOMEM;
-    }
-
-    ext0_write_super(sb);
-    return 0;
-}
-
-static struct dentry *ext0_mount(struct file_system_type *fs_type,
-                                 int flags, const char *dev_name, void *data)
-{
-    return mount_bdev(fs_type, flags, dev_name, data, ext0_fill_super);
-}
-
-static struct file_system_type ext0_fs_type = {
-    .owner = THIS_MODULE,
-    .name = "ext0",
-    .mount = ext0_mount,
-    .kill_sb = kill_block_super,
-    .fs_flags = FS_REQUIRES_DEV,
-};
-MODULE_ALIAS_FS("ext0");
-
-static int __init init_ext0_fs(void)
-{
-    int ret;
-
-    ret = init_inodecache();
-    if (EXT0_IS_ERR(ret))
-    {
-        ext0_debug("Unable to initialize inode cache");
-        return ret;
-    }
-
-    ret = register_filesystem(&ext0_fs_type);
-    if (EXT0_IS_ERR(ret))
-    {
-        ext0_debug("Unable to regeister filesystem");
-        destroy_inodecache();
-    }
-    ext0_debug("EXT0 Loaded :)");
-    return ret;
-}
-
-static void __exit exit_ext0_fs(void)
-{
-    unregister_filesystem(&ext0_fs_type);
-    destroy_inodecache();
-    ext0_debug("EXT0 UnLoaded :(");
-}
-
-MODULE_AUTHOR("Brian Misachi");
-MODULE_DESCRIPTION("Zeroth Extended Filesystem");
-MODULE_LICENSE("GPL");
-module_init(init_ext0_fs);
-module_exit(exit_ext0_fs);
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/module.h>
+#include <linux/parser.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/time.h>
+#include <linux/vfs.h>
+
+#include "ext0.h"
+
+static struct kmem_cache *ext0_inode_cachep;
+
+static void init_once(void *buf)
+{
+    struct ext0_inode_info *in_mem_inode = (struct ext0_inode_info *)buf;
+    init_rwsem(&in_mem_inode->i_data_sem);
+    seqlock_init(&in_mem_inode->i_ext_lock);
+    spin_lock_init(&in_mem_inode->i_dir_cache_lock);
+    inode_init_once(&in_mem_inode->vfs_inode);
+}
+
+static int __init init_inodecache(void)
+{
+    ext0_inode_cachep = kmem_cache_create("ext0_inode_cache",
+                                          sizeof(struct ext0_inode_info),
+                                          0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT),
+                                          init_once);
+    if (ext0_inode_cachep == NULL)
+    {
+        ext0_debug("Out of memory");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void destroy_inodecache(void)
+{
+    ext0_debug("Releasing memory");
+    rcu_barrier();
+    kmem_cache_destroy(ext0_inode_cachep);
+}
+
+static void ext0_i_callback(struct rcu_head *head)
+{
+    struct inode *inode = container_of(head, struct inode, i_rcu);
+    kmem_cache_free(ext0_inode_cachep, EXT0_I(inode));
+}
+
+static void ext0_destroy_inode(struct inode *inode)
+{
+    call_rcu(&inode->i_rcu, ext0_i_callback);
+}
+
+static struct inode *ext0_alloc_inode(struct super_block *sb)
+{
+    struct ext0_inode_info *in_mem_inode;
+    in_mem_inode = kmem_cache_alloc(ext0_inode_cachep, GFP_KERNEL);
+    if (!in_mem_inode)
+    {
+        ext0_debug("Unable to allocate memory for inode");
+        return NULL;
+    }
+    in_mem_inode->i_cached_ext.ec_len = 0;
+    in_mem_inode->i_dir_cache = NULL;
+    in_mem_inode->i_dir_free = NULL;
+    in_mem_inode->i_dir_nr_free = 0;
+    return &in_mem_inode->vfs_inode;
+}
+
+/* Sum the free counts of every group descriptor, used to seed the per-CPU
+ * counters at mount
+ */
+static void ext0_count_free(struct super_block *sb, unsigned long *blocks, unsigned long *inodes)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    unsigned long i;
+
+    *blocks = *inodes = 0;
+    for (i = 0; i < in_mem_sb->s_groups_count; i++)
+    {
+        struct ext0_block_descriptor *gdesc = ext0_get_group_desc(sb, i, NULL);
+
+        spin_lock(ext0_group_lock_ptr(in_mem_sb, i));
+        *blocks += le16_to_cpu(gdesc->bg_free_blocks_count);
+        *inodes += le16_to_cpu(gdesc->bg_free_inodes_count);
+        spin_unlock(ext0_group_lock_ptr(in_mem_sb, i));
+    }
+}
+
+static int ext0_sync_fs(struct super_block *sb, int wait)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    struct ext0_super_block *on_disk_sb = in_mem_sb->s_es;
+
+    /* Let the inodes deleted so far give their space back first */
+    if (wait)
+        ext0_reclaim_flush(sb);
+
+    /* The allocators only touch their group and the per-CPU counters, fold
+     * the counters into the superblock here
+     */
+    lock_buffer(in_mem_sb->s_sbh);
+    on_disk_sb->s_wtime = cpu_to_le32(ktime_get_real_seconds());
+    on_disk_sb->s_free_blocks_count = cpu_to_le32(percpu_counter_sum_positive(&in_mem_sb->s_freeblocks_counter));
+    on_disk_sb->s_free_inodes_count = cpu_to_le32(percpu_counter_sum_positive(&in_mem_sb->s_freeinodes_counter));
+    unlock_buffer(in_mem_sb->s_sbh);
+
+    mark_buffer_dirty(in_mem_sb->s_sbh);
+    if (wait)
+        sync_dirty_buffer(in_mem_sb->s_sbh);
+    return 0;
+}
+
+void ext0_write_super(struct super_block *sb)
+{
+    ext0_sync_fs(sb, 1);
+}
+
+/* In-memory per-group state: group locks, allocation hints and the per-CPU
+ * directory rotors
+ */
+static int ext0_init_group_info(struct ext0_super_block_info *in_mem_sb)
+{
+    int cpu;
+
+    in_mem_sb->s_blockgroup_lock = kzalloc(sizeof(struct blockgroup_lock), GFP_KERNEL);
+    in_mem_sb->s_group_info = kcalloc(in_mem_sb->s_groups_count, sizeof(struct ext0_group_info), GFP_KERNEL);
+    in_mem_sb->s_dir_rotor = alloc_percpu(unsigned int);
+    if (!in_mem_sb->s_blockgroup_lock || !in_mem_sb->s_group_info || !in_mem_sb->s_dir_rotor)
+        return -ENOMEM;
+
+    bgl_lock_init(in_mem_sb->s_blockgroup_lock);
+
+    /* Start every CPU in a different group so parallel mkdirs spread out */
+    for_each_possible_cpu(cpu)
+        *per_cpu_ptr(in_mem_sb->s_dir_rotor, cpu) = cpu % in_mem_sb->s_groups_count;
+    return 0;
+}
+
+static void ext0_put_group_info(struct ext0_super_block_info *in_mem_sb)
+{
+    percpu_counter_destroy(&in_mem_sb->s_freeblocks_counter);
+    percpu_counter_destroy(&in_mem_sb->s_freeinodes_counter);
+    free_percpu(in_mem_sb->s_dir_rotor);
+    kfree(in_mem_sb->s_group_info);
+    kfree(in_mem_sb->s_blockgroup_lock);
+}
+
+void ext0_put_super(struct super_block *sb)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    unsigned long i;
+
+    ext0_reclaim_exit(in_mem_sb);
+    ext0_ioend_exit(in_mem_sb);
+    ext0_sync_fs(sb, 1);
+
+    for (i = 0; i < in_mem_sb->s_groups_count; i++)
+    {
+        if (in_mem_sb->s_group_desc[i])
+            brelse(in_mem_sb->s_group_desc[i]);
+    }
+
+    ext0_put_group_info(in_mem_sb);
+    brelse(in_mem_sb->s_sbh);
+    kfree(in_mem_sb->s_group_desc);
+    sb->s_fs_info = NULL;
+    kfree(in_mem_sb);
+}
+
+static int ext0_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct super_block *sb = dentry->d_sb;
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    unsigned long overhead;
+
+    /* Group metadata is not usable space. The last group may be short but
+     * carries the same metadata as the others
+     */
+    overhead = in_mem_sb->s_first_data_block +
+               in_mem_sb->s_groups_count * (EXT0_GROUP_OVERHEAD_BLOCKS_NUM + in_mem_sb->s_itb_per_group);
+
+    buf->f_type = EXT0_FS_MAGIC;
+    buf->f_namelen = EXT0_NAME_LEN;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = in_mem_sb->s_blocks_count - overhead;
+    buf->f_bfree = percpu_counter_read_positive(&in_mem_sb->s_freeblocks_counter);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = le32_to_cpu(in_mem_sb->s_es->s_inodes_count);
+    buf->f_ffree = percpu_counter_read_positive(&in_mem_sb->s_freeinodes_counter);
+    return 0;
+}
+
+static int ext0_freeze(struct super_block *sb)
+{
+    ext0_sync_fs(sb, 1);
+    return 0;
+}
+
+static int ext0_unfreeze(struct super_block *sb)
+{
+    ext0_write_super(sb);
+    return 0;
+}
+
+static int ext0_show_options(struct seq_file *seq, struct dentry *root)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(root->d_sb);
+
+    if (in_mem_sb->s_inode_readahead_blks != EXT0_DEF_INODE_READAHEAD_BLKS)
+        seq_printf(seq, ",inode_readahead_blks=%lu", in_mem_sb->s_inode_readahead_blks);
+    return 0;
+}
+
+static const struct super_operations ext0_sops = {
+    .alloc_inode = ext0_alloc_inode,
+    .destroy_inode = ext0_destroy_inode,
+    .write_inode = ext0_write_inode,
+    .evict_inode = ext0_evict_inode,
+    .put_super = ext0_put_super,
+    .sync_fs = ext0_sync_fs,
+    .freeze_fs = ext0_freeze,
+    .unfreeze_fs = ext0_unfreeze,
+    .statfs = ext0_statfs,
+    .show_options = ext0_show_options,
+};
+
+struct ext0_block_descriptor *ext0_get_group_desc(struct super_block *sb, unsigned long group, struct buffer_head **bhp)
+{
+    struct ext0_super_block_info *in_mem_sb = EXT0_SB(sb);
+    struct buffer_head *bh;
+
+    if (group >= in_mem_sb->s_groups_count)
+    {
+        ext0_debug("Block group out of range: %lu", group);
+        return NULL;
+    }
+
+    bh = in_mem_sb->s_group_desc[group];
+    if (bhp)
+        *bhp = bh;
+    return (struct ext0_block_descriptor *)bh->b_data;
+}
+
+/* The primary superblock lives EXT0_SUPER_BLOCK_OFFSET bytes into the device,
+ * which is block 1 with 1K blocks and inside block 0 with anything larger
+ */
+static struct ext0_super_block *ext0_read_super(struct super_block *sb, struct buffer_head **bhp)
+{
+    struct ext0_super_block *on_disk_sb;
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, EXT0_SUPER_BLOCK_OFFSET / sb->s_blocksize);
+    if (!bh)
+    {
+        ext0_debug("Could not perform I/O for super block");
+        return ERR_PTR(-EIO);
+    }
+
+    on_disk_sb = (struct ext0_super_block *)(bh->b_data + EXT0_SUPER_BLOCK_OFFSET % sb->s_blocksize);
+    if (le32_to_cpu(on_disk_sb->s_magic) != EXT0_FS_MAGIC)
+    {
+        ext0_debug("EXT0 filesystem does not exist: %lu", (unsigned long)bh->b_blocknr);
+        brelse(bh);
+        return ERR_PTR(-EINVAL);
+    }
+
+    *bhp = bh;
+    return on_disk_sb;
+}
+
+enum
+{
+    Opt_inode_readahead_blks,
+    Opt_err,
+};
+
+static const match_table_t ext0_tokens = {
+    {Opt_inode_readahead_blks, "inode_readahead_blks=%d"},
+    {Opt_err, NULL},
+};
+
+static int ext0_parse_options(char *options, struct ext0_super_block_info *in_mem_sb)
+{
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+    int option;
+
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL)
+    {
+        if (!*p)
+            continue;
+
+        switch (match_token(p, ext0_tokens, args))
+        {
+        case Opt_inode_readahead_blks:
+            if (match_int(&args[0], &option) || option < 0)
+            {
+                ext0_debug("Invalid inode_readahead_blks value");
+                return -EINVAL;
+            }
+            in_mem_sb->s_inode_readahead_blks = option;
+            break;
+        default:
+            ext0_debug("Unrecognized mount option: %s", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int ext0_fill_super(struct super_block *sb, void *data, int silent)
+{
+    struct ext0_super_block_info *in_mem_sb;
+    struct ext0_super_block *on_disk_sb;
+    struct inode *root;
+    struct buffer_head *bh, *desc_bh;
+    int groups_count, ret;
+    unsigned long blocksize, log_block_size, free_blocks, free_inodes;
+    unsigned long i;
+
+    /* Start with the smallest block size we know of, the superblock tells us the real one */
+    if (!sb_min_blocksize(sb, EXT0_FS_MIN_BLOCK_SIZE))
+    {
+        ext0_debug("Invalid blocksize");
+        return -EINVAL;
+    }
+
+    in_mem_sb = kzalloc(sizeof(struct ext0_super_block_info), GFP_KERNEL);
+    if (!in_mem_sb)
+    {
+        ext0_debug("Unable to allocate memory for super block");
+        return -ENOMEM;
+    }
+
+    in_mem_sb->s_inode_readahead_blks = EXT0_DEF_INODE_READAHEAD_BLKS;
+    ret = ext0_parse_options(data, in_mem_sb);
+    if (EXT0_IS_ERR(ret))
+    {
+        kfree(in_mem_sb);
+        return ret;
+    }
+
+    on_disk_sb = ext0_read_super(sb, &bh);
+    if (IS_ERR(on_disk_sb))
+    {
+        kfree(in_mem_sb);
+        return PTR_ERR(on_disk_sb);
+    }
+
+    log_block_size = le32_to_cpu(on_disk_sb->s_log_block_size);
+    if (log_block_size > EXT0_FS_MAX_LOG_BLOCK_SIZE)
+    {
+        ext0_debug("Invalid block size: log_block_size=%lu", log_block_size);
+        brelse(bh);
+        kfree(in_mem_sb);
+        return -EINVAL;
+    }
+
+    blocksize = EXT0_FS_MIN_BLOCK_SIZE << log_block_size;
+    if (sb->s_blocksize != blocksize)
+    {
+        brelse(bh);
+
+        /* Fails for blocks larger than a page or smaller than the device sector */
+        if (!sb_set_blocksize(sb, blocksize))
+        {
+            ext0_debug("Unsupported block size: %lu", blocksize);
+            kfree(in_mem_sb);
+            return -EINVAL;
+        }
+
+        on_disk_sb = ext0_read_super(sb, &bh);
+        if (IS_ERR(on_disk_sb))
+        {
+            kfree(in_mem_sb);
+            return PTR_ERR(on_disk_sb);
+        }
+    }
+
+    in_mem_sb->s_sb_block = bh->b_blocknr;
+    groups_count = le32_to_cpu(on_disk_sb->s_groups_count);
+    sb->s_magic = le32_to_cpu(on_disk_sb->s_magic);
+
+    in_mem_sb->s_group_desc = kmalloc(groups_count * sizeof(struct buffer_head *), GFP_KERNEL);
+    if (!in_mem_sb->s_group_desc)
+    {
+        ext0_debug("Unable to allocate memory for group descriptors with bytes=%zu", (unsigned long)(groups_count * sizeof(struct buffer_head *)));
+        brelse(bh);
+        kfree(in_mem_sb);
+        return -ENOMEM;
+    }
+
+    in_mem_sb->s_blocks_per_group = le32_to_cpu(on_disk_sb->s_blocks_per_group);
+    in_mem_sb->s_inodes_per_group = le32_to_cpu(on_disk_sb->s_inodes_per_group);
+    in_mem_sb->s_inode_size = le16_to_cpu(on_disk_sb->s_inode_size);
+
+    if (!in_mem_sb->s_inodes_per_group || in_mem_sb->s_inodes_per_group > EXT0_MAX_INODES_PER_GROUP(sb->s_blocksize) ||
+        in_mem_sb->s_inode_size < sizeof(struct ext0_inode) ||
+        in_mem_sb->s_inode_size > sb->s_blocksize)
+    {
+        ext0_debug("Invalid inode geometry: inodes_per_group=%lu inode_size=%lu",
+                   in_mem_sb->s_inodes_per_group, in_mem_sb->s_inode_size);
+        brelse(bh);
+        kfree(in_mem_sb->s_group_desc);
+        kfree(in_mem_sb);
+        return -EINVAL;
+    }
+    in_mem_sb->s_inodes_per_block = sb->s_blocksize / in_mem_sb->s_inode_size;
+    in_mem_sb->s_itb_per_group = ext0_itable_blocks(in_mem_sb->s_inodes_per_group, in_mem_sb->s_inode_size, sb->s_blocksize);
+    in_mem_sb->s_blocks_count = le32_to_cpu(on_disk_sb->s_blocks_count);
+    in_mem_sb->s_first_data_block = le32_to_cpu(on_disk_sb->s_first_data_block);
+
+    if (in_mem_sb->s_first_data_block != (sb->s_blocksize == EXT0_FS_MIN_BLOCK_SIZE) ||
+        in_mem_sb->s_blocks_per_group > EXT0_MAX_BLOCKS_PER_GROUP(sb->s_blocksize) ||
+        in_mem_sb->s_blocks_per_group <= EXT0_GROUP_OVERHEAD_BLOCKS_NUM + in_mem_sb->s_itb_per_group ||
+        !groups_count ||
+        ext0_group_first_block(groups_count - 1, in_mem_sb->s_blocks_per_group,
+                               in_mem_sb->s_first_data_block) >= in_mem_sb->s_blocks_count)
+    {
+        ext0_debug("Invalid group geometry: first_data_block=%lu blocks_per_group=%lu groups=%i blocks=%lu",
+                   in_mem_sb->s_first_data_block, in_mem_sb->s_blocks_per_group, groups_count, in_mem_sb->s_blocks_count);
+        brelse(bh);
+        kfree(in_mem_sb->s_group_desc);
+        kfree(in_mem_sb);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < groups_count; i++)
+    {
+        unsigned long j;
+
+        desc_bh = sb_bread(sb, ext0_group_desc_block(i, in_mem_sb->s_blocks_per_group, in_mem_sb->s_first_data_block));
+        if (!desc_bh)
+        {
+            /* We failed. Cleanup allocated mem */
+            for (j = 0; j < i; j++)
+                brelse(in_mem_sb->s_group_desc[j]);
+
+            ext0_debug("Unable to perform I/O for descriptor index=%zu", i);
+            brelse(bh);
+            kfree(in_mem_sb->s_group_desc);
+            sb->s_fs_info = NULL;
+            kfree(in_mem_sb);
+            return -EIO;
+        }
+
+        in_mem_sb->s_group_desc[i] = desc_bh;
+    }
+
+    in_mem_sb->s_desc_per_block = 1;
+    in_mem_sb->s_groups_count = groups_count;
+    in_mem_sb->s_es = on_disk_sb;
+    in_mem_sb->s_sbh = bh;
+    in_mem_sb->s_last_block = le32_to_cpu(on_disk_sb->s_last_block);
+
+    ret = ext0_init_group_info(in_mem_sb);
+    if (EXT0_IS_ERR(ret))
+    {
+        ext0_debug("Unable to allocate memory for group info");
+        goto failed_info;
+    }
+
+    sb->s_op = &ext0_sops;
+    sb->s_fs_info = in_mem_sb;
+
+    /* The descriptors are the truth, the superblock counts may be stale */
+    ext0_count_free(sb, &free_blocks, &free_inodes);
+    ret = percpu_counter_init(&in_mem_sb->s_freeblocks_counter, free_blocks, GFP_KERNEL);
+    if (!ret)
+        ret = percpu_counter_init(&in_mem_sb->s_freeinodes_counter, free_inodes, GFP_KERNEL);
+    if (EXT0_IS_ERR(ret))
+    {
+        ext0_debug("Unable to allocate free space counters");
+        goto failed_info;
+    }
+
+    ret = ext0_reclaim_init(sb);
+    if (EXT0_IS_ERR(ret))
+    {
+        ext0_debug("Unable to allocate the inode reclaim workqueue");
+        goto failed_info;
+    }
+
+    ret = ext0_ioend_init(sb);
+    if (EXT0_IS_ERR(ret))
+    {
+        ext0_debug("Unable to allocate the I/O completion workqueue");
+        goto failed_info;
+    }
+
+    root = ext0_iget(sb, EXT0_ROOT_INO);
+    if (IS_ERR(root))
+    {
+        ext0_debug("Unable to find root directory inode: %i", EXT0_ROOT_INO);
+        ret = PTR_ERR(root);
+        goto failed_info;
+    }
+
+    sb->s_root = d_make_root(root);
+    if (!sb->s_root)
+    {
+        ext0_debug("Unable to create root directory entry");
+        ret = -ENOMEM;
+        goto failed_info;
+    }
+
+    ext0_write_super(sb);
+    return 0;
+
+failed_info:
+    ext0_reclaim_exit(in_mem_sb);
+    ext0_ioend_exit(in_mem_sb);
+    ext0_put_group_info(in_mem_sb);
+    for (i = 0; i < groups_count; i++)
+        brelse(in_mem_sb->s_group_desc[i]);
+    brelse(bh);
+    kfree(in_mem_sb->s_group_desc);
+    sb->s_fs_info = NULL;
+    kfree(in_mem_sb);
+    return ret;
+}
+
+static struct dentry *ext0_mount(struct file_system_type *fs_type,
+                                 int flags, const char *dev_name, void *data)
+{
+    return mount_bdev(fs_type, flags, dev_name, data, ext0_fill_super);
+}
+
+static struct file_system_type ext0_fs_type = {
+    .owner = THIS_MODULE,
+    .name = "ext0",
+    .mount = ext0_mount,
+    .kill_sb = kill_block_super,
+    .fs_flags = FS_REQUIRES_DEV,
+};
+MODULE_ALIAS_FS("ext0");
+
+static int __init init_ext0_fs(void)
+{
+    int ret;
+
+    ret = init_inodecache();
+    if (EXT0_IS_ERR(ret))
+    {
+        ext0_debug("Unable to initialize inode cache");
+        return ret;
+    }
+
+    ret = ext0_dc_init();
+    if (EXT0_IS_ERR(ret))
+    {
+        ext0_debug("Unable to register directory cache shrinker");
+        destroy_inodecache();
+        return ret;
+    }
+
+    ret = register_filesystem(&ext0_fs_type);
+    if (EXT0_IS_ERR(ret))
+    {
+        ext0_debug("Unable to regeister filesystem");
+        ext0_dc_exit();
+        destroy_inodecache();
+    }
+    ext0_debug("EXT0 Loaded :)");
+    return ret;
+}
+
+static void __exit exit_ext0_fs(void)
+{
+    unregister_filesystem(&ext0_fs_type);
+    ext0_dc_exit();
+    destroy_inodecache();
+    ext0_debug("EXT0 UnLoaded :(");
+}
+
+MODULE_AUTHOR("Brian Misachi");
+MODULE_DESCRIPTION("Zeroth Extended Filesystem");
+MODULE_LICENSE("GPL");
+module_init(init_ext0_fs);
+module_exit(exit_ext0_fs);